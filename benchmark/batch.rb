@@ -0,0 +1,41 @@
+#!ruby
+
+#
+# Compare Zstd.encode_batch / Zstd.decode_batch with one call per blob.
+#
+#   $ ruby -I lib benchmark/batch.rb [number-of-blobs] [level]
+#
+
+require "extzstd"
+require "benchmark"
+require "etc"
+
+count = Integer(ARGV[0] || 20000)
+level = Integer(ARGV[1] || 3)
+rand = Random.new(1)
+words = Array.new(4096) { rand.bytes(rand.rand(2..12)).unpack1("H*") }
+srcs = Array.new(count) { Array.new(rand.rand(50..1000)) { words[rand.rand(words.size)] }.join(" ") }
+mib = srcs.sum(&:bytesize) / (1 << 20).to_f
+threads_set = [1, 2, 4, 8, 16].select { |n| n <= Etc.nprocessors }
+threads_set << Etc.nprocessors unless threads_set.include?(Etc.nprocessors)
+
+puts "blobs: %d, total: %.2f MiB, level: %d, processors: %d" % [count, mib, level, Etc.nprocessors]
+
+encoded = nil
+Benchmark.bm(24) do |x|
+  t = x.report("Zstd.encode (each)") { encoded = srcs.map { |s| Zstd.encode(s, level) } }
+  puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+
+  threads_set.each do |threads|
+    t = x.report("encode_batch threads=#{threads}") { Zstd.encode_batch(srcs, level: level, threads: threads) }
+    puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+  end
+
+  t = x.report("Zstd.decode (each)") { encoded.each { |s| Zstd.decode(s) } }
+  puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+
+  threads_set.each do |threads|
+    t = x.report("decode_batch threads=#{threads}") { Zstd.decode_batch(encoded, threads: threads) }
+    puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+  end
+end
@@ -0,0 +1,40 @@
+#!ruby
+
+#
+# Per-request streaming of small messages, with and without Zstd::ContextPool.
+#
+#   $ ruby -I lib benchmark/context_pool.rb [number-of-messages] [level]
+#
+
+require "extzstd"
+require "benchmark"
+require "stringio"
+
+count = Integer(ARGV[0] || 20000)
+level = Integer(ARGV[1] || 3)
+rand = Random.new(1)
+words = Array.new(4096) { rand.bytes(rand.rand(2..12)).unpack1("H*") }
+srcs = Array.new(count) { Array.new(rand.rand(50..1000)) { words[rand.rand(words.size)] }.join(" ") }
+encoded = srcs.map { |s| Zstd.encode(s, level) }
+mib = srcs.sum(&:bytesize) / (1 << 20).to_f
+
+puts "messages: %d, total: %.2f MiB, level: %d" % [count, mib, level]
+
+Benchmark.bm(24) do |x|
+  [nil, Zstd::ContextPool.new].each do |pool|
+    name = pool ? "pool" : "no pool"
+    opts = pool ? { pool: pool } : {}
+
+    t = x.report("Encoder (#{name})") do
+      srcs.each { |s| Zstd::Encoder.open("".b, level, nil, **opts) { |e| e << s } }
+    end
+    puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+
+    t = x.report("Decoder (#{name})") do
+      encoded.each { |s| Zstd::Decoder.open(StringIO.new(s), nil, **opts, &:read) }
+    end
+    puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+
+    puts "%24s  hits: %d, misses: %d" % ["", pool.hits, pool.misses] if pool
+  end
+end
@@ -0,0 +1,39 @@
+#!ruby
+
+#
+# Decode independent streams with 1..N threads.
+#
+#   $ ruby -I lib benchmark/decode_threads.rb [nstreams]
+#
+
+require "extzstd"
+require "benchmark"
+require "etc"
+require "stringio"
+
+nstreams = Integer(ARGV[0] || [Etc.nprocessors, 2].max)
+rand = Random.new(1)
+words = Array.new(4096) { rand.bytes(rand.rand(2..12)).unpack1("H*") }
+src = Array.new(2 << 20) { words[rand.rand(words.size)] }.join(" ")
+enc = Zstd.encode(src)
+mib = src.bytesize * nstreams / (1 << 20).to_f
+
+puts "%d streams of %.2f MiB (compressed %.2f MiB), processors: %d" %
+  [nstreams, src.bytesize / (1 << 20).to_f, enc.bytesize / (1 << 20).to_f, Etc.nprocessors]
+
+decode = ->(chunksize) {
+  buf = "".b
+  Zstd.decode(StringIO.new(enc)) { |z| nil while z.read(chunksize, buf) }
+}
+
+Benchmark.bm(12) do |x|
+  [1, 2, 4, 8, 16].select { |n| n <= nstreams }.each do |nthreads|
+    t = x.report("threads=#{nthreads}") do
+      queue = Queue.new
+      nstreams.times { queue << (4 << 20) }
+      queue.close
+      nthreads.times.map { Thread.new { while n = queue.pop; decode.(n); end } }.each(&:join)
+    end
+    puts "%12s  %8.2f MiB/s" % ["", mib / t.real]
+  end
+end
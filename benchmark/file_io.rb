@@ -0,0 +1,79 @@
+#!ruby
+
+#
+# File to file encoding and decoding:
+#
+# - Zstd::Encoder / Zstd::Decoder with the native I/O of the plain File
+# - same, with the duck typing (a subclass of File that redefines the methods)
+# - Zstd.copy_stream
+# - Zstd.compress_file / Zstd.decompress_file (memory-mapped, one-shot)
+#
+#   $ ruby -I lib benchmark/file_io.rb [size_mib]
+#
+
+require "extzstd"
+require "benchmark"
+require "tmpdir"
+
+class DuckFile < File
+  def <<(buf) super end
+  def write(*bufs) super end
+  def read(*args) super end
+end
+
+size = Integer(ARGV[0] || 256) << 20
+rand = Random.new(1)
+words = Array.new(4096) { rand.bytes(rand.rand(2..12)).unpack1("H*") }
+mib = size / (1 << 20).to_f
+
+Dir.mktmpdir do |dir|
+  srcpath = File.join(dir, "src")
+  zstpath = File.join(dir, "src.zst")
+  outpath = File.join(dir, "out")
+  File.open(srcpath, "wb") do |f|
+    f << Array.new(1 << 16) { words[rand.rand(words.size)] }.join(" ") while f.size < size
+  end
+  size = File.size(srcpath)
+  mib = size / (1 << 20).to_f
+  puts "source %.2f MiB" % mib
+
+  Benchmark.bm(16) do |x|
+    [File, DuckFile].each do |klass|
+      t = x.report("encode #{klass}") do
+        File.open(srcpath, "rb") do |src|
+          klass.open(zstpath, "wb") do |dest|
+            buf = "".b
+            Zstd::Encoder.open(dest, 1) { |z| z << buf while src.read(1 << 20, buf) }
+          end
+        end
+      end
+      puts "%16s  %8.2f MiB/s" % ["", mib / t.real]
+
+      t = x.report("decode #{klass}") do
+        klass.open(zstpath, "rb") do |src|
+          File.open(outpath, "wb") do |dest|
+            buf = "".b
+            Zstd::Decoder.open(src) { |z| dest << buf while z.read(1 << 20, buf) }
+          end
+        end
+      end
+      puts "%16s  %8.2f MiB/s" % ["", mib / t.real]
+    end
+
+    t = x.report("encode copy") do
+      File.open(srcpath, "rb") { |src| File.open(zstpath, "wb") { |dest| Zstd.copy_stream(src, dest, level: 1) } }
+    end
+    puts "%16s  %8.2f MiB/s" % ["", mib / t.real]
+
+    t = x.report("decode copy") do
+      File.open(zstpath, "rb") { |src| File.open(outpath, "wb") { |dest| Zstd.copy_stream(src, dest, mode: :decompress) } }
+    end
+    puts "%16s  %8.2f MiB/s" % ["", mib / t.real]
+
+    t = x.report("compress_file") { Zstd.compress_file(srcpath, zstpath, level: 1) }
+    puts "%16s  %8.2f MiB/s" % ["", mib / t.real]
+
+    t = x.report("decompress_file") { Zstd.decompress_file(zstpath, outpath) }
+    puts "%16s  %8.2f MiB/s" % ["", mib / t.real]
+  end
+end
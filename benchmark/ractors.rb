@@ -0,0 +1,47 @@
+#!ruby
+
+#
+# Measure compression throughput for each number of Ractors.
+# Each Ractor compresses its own chunks with the shared (frozen)
+# Zstd::Parameters and Zstd::Dictionary::Compressor.
+#
+#   $ ruby -I lib benchmark/ractors.rb [level] [chunks_per_ractor]
+#
+
+require "extzstd"
+require "benchmark"
+require "etc"
+
+Warning[:experimental] = false
+
+level = Integer(ARGV[0] || 3)
+chunks = Integer(ARGV[1] || 64)
+
+rand = Random.new(1)
+words = Array.new(4096) { rand.bytes(rand.rand(2..12)).unpack1("H*") }
+src = Ractor.make_shareable(Array.new(1 << 17) { words[rand.rand(words.size)] }.join(" "))
+dict = Zstd::Dictionary::Compressor.new(src.byteslice(0, 64 << 10), level)
+params = Ractor.make_shareable(Zstd::Parameters.new(level))
+mib = src.bytesize * chunks / (1 << 20).to_f
+ractors_set = [1, 2, 4, 8, 16].select { |n| n <= Etc.nprocessors }
+ractors_set << Etc.nprocessors unless ractors_set.include?(Etc.nprocessors)
+
+puts "chunk size: %.2f MiB, chunks per ractor: %d, level: %d, processors: %d" %
+     [src.bytesize / (1 << 20).to_f, chunks, level, Etc.nprocessors]
+
+Benchmark.bm(24) do |x|
+  base = nil
+  ractors_set.each do |n|
+    t = x.report("ractors=#{n}") do
+      n.times.map {
+        Ractor.new(src, params, dict, chunks) do |src, params, dict, chunks|
+          codec = Zstd::Codec.new(params, dict)
+          chunks.times { codec.encode(src) }
+        end
+      }.each(&:take)
+    end
+    rate = mib * n / t.real
+    base ||= rate
+    puts "%24s  %8.2f MiB/s (x%.2f, ideal x%d)" % ["", rate, rate / base, n]
+  end
+end
@@ -0,0 +1,47 @@
+#!ruby
+
+#
+# Measure compression throughput for each number of worker threads.
+#
+#   $ ruby -I lib benchmark/workers.rb [source-file] [level]
+#
+
+require "extzstd"
+require "benchmark"
+require "etc"
+
+src = ARGV[0] ? File.binread(ARGV[0]) : begin
+  rand = Random.new(1)
+  words = Array.new(4096) { rand.bytes(rand.rand(2..12)).unpack1("H*") }
+  Array.new(6 << 20) { words[rand.rand(words.size)] }.join(" ")
+end
+level = Integer(ARGV[1] || 3)
+mib = src.bytesize / (1 << 20).to_f
+workers_set = [0, 1, 2, 4, 8, 16].select { |n| n <= Etc.nprocessors }
+workers_set << Etc.nprocessors unless workers_set.include?(Etc.nprocessors)
+
+puts "source size: %.2f MiB, level: %d, processors: %d" % [mib, level, Etc.nprocessors]
+
+Benchmark.bm(24) do |x|
+  workers_set.each do |workers|
+    dest = nil
+    t = x.report("workers=#{workers}") do
+      params = Zstd::Parameters.new(level, workers: workers)
+      dest = Zstd.encode(src, params)
+    end
+    puts "%24s  %8.2f MiB/s (ratio %.3f)" % ["", mib / t.real, dest.bytesize / src.bytesize.to_f]
+  end
+
+  workers_set.each do |workers|
+    t = x.report("stream workers=#{workers}") do
+      Zstd.encode(File.open(File::NULL, "wb"), level, workers: workers) do |z|
+        off = 0
+        while off < src.bytesize
+          z << src.byteslice(off, 1 << 20)
+          off += 1 << 20
+        end
+      end
+    end
+    puts "%24s  %8.2f MiB/s" % ["", mib / t.real]
+  end
+end
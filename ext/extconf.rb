@@ -34,6 +34,8 @@ $INCFLAGS = %w(
 if RbConfig::CONFIG["arch"] =~ /mingw/i
   $LDFLAGS << " -static-libgcc" if try_ldflags("-static-libgcc")
 else
+  have_library("pthread", "pthread_create")
+
   if try_compile(<<-"VISIBILITY")
 __attribute__ ((visibility("hidden"))) int conftest(void) { return 0; }
   VISIBILITY
@@ -44,6 +46,19 @@ __attribute__ ((visibility("hidden"))) int conftest(void) { return 0; }
   end
 end
 
+# for the native I/O of Zstd::Encoder and Zstd::Decoder with the plain IO
+have_func("rb_io_descriptor", "ruby/io.h")
+have_func("rb_io_maybe_wait_readable", "ruby/io.h")
+
+# for Zstd.compress_file and Zstd.decompress_file
+have_header("sys/mman.h")
+
+# for the worker threads after fork
+have_func("pthread_atfork", "pthread.h")
+
+# for the memory accounting of the contexts
+have_header("ruby/atomic.h")
+
 mod = %w(__attribute__((__noreturn__)) __declspec(noreturn) [[noreturn]] _Noreturn).find { |m|
   has_function_modifier?(m)
 }
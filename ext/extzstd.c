@@ -2,6 +2,11 @@
 #include <zstd/lib/common/mem.h>
 #include <zstd_errors.h>
 #include <zdict.h>
+#include <compress/zstd_compress_internal.h> /* for sizeof(ZSTD_CCtx_params) */
+
+#ifdef HAVE_UNISTD_H
+#   include <unistd.h>
+#endif
 
 #ifndef RB_EXT_RACTOR_SAFE
 # define RB_EXT_RACTOR_SAFE(FEATURE) ((void)(FEATURE))
@@ -25,15 +30,8 @@ libver_s_to_i(VALUE ver)
 static VALUE
 libver_s_to_s(VALUE ver)
 {
-    static VALUE str;
-    if (!str) {
-        str = rb_sprintf("%d.%d.%d",
-                ZSTD_VERSION_MAJOR,
-                ZSTD_VERSION_MINOR,
-                ZSTD_VERSION_RELEASE);
-        rb_obj_freeze(str);
-    }
-    return str;
+    /* no process-global cache, so each Ractor can call this */
+    return rb_obj_freeze(rb_str_new_cstr(ZSTD_VERSION_STRING));
 }
 
 static void
@@ -50,6 +48,20 @@ init_libver(void)
     rb_define_const(extzstd_mZstd, "LIBRARY_VERSION", libver);
 }
 
+/*
+ * Returns the number of online processors (at least 1).
+ */
+int
+extzstd_cpu_count(void)
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > INT_MAX) { return INT_MAX; }
+    if (n > 0) { return (int)n; }
+#endif
+    return 1;
+}
+
 /*
  * error classes
  */
@@ -154,6 +166,8 @@ init_constants(void)
 
     rb_define_const(mConstants, "ZSTD_MAX_COMPRESSION_LEVEL", INT2NUM(ZSTD_maxCLevel()));
     rb_define_const(mConstants, "MAX_COMPRESSION_LEVEL", INT2NUM(ZSTD_maxCLevel()));
+    rb_define_const(mConstants, "ZSTD_MIN_COMPRESSION_LEVEL", INT2NUM(ZSTD_minCLevel()));
+    rb_define_const(mConstants, "MIN_COMPRESSION_LEVEL", INT2NUM(ZSTD_minCLevel()));
 
     rb_define_const(mConstants, "ZSTD_FAST", INT2NUM(ZSTD_fast));
     rb_define_const(mConstants, "ZSTD_DFAST", INT2NUM(ZSTD_dfast));
@@ -206,17 +220,51 @@ init_constants(void)
 }
 
 /*
- * class Zstd::EncodeParameter
+ * class Zstd::Parameters
  */
 
 VALUE extzstd_cParams;
 
-AUX_IMPLEMENT_CONTEXT(
-        ZSTD_parameters, params_type, "extzstd.Parameters",
-        params_alloc_dummy, NULL, free, NULL,
-        getparamsp, getparams, params_p);
+static void
+params_free(void *pp)
+{
+    if (pp) {
+        ZSTD_freeCCtxParams((ZSTD_CCtx_params *)pp);
+    }
+}
+
+static size_t
+params_memsize(const void *pp)
+{
+    return (pp ? sizeof(ZSTD_CCtx_params) : 0);
+}
 
-ZSTD_parameters *
+/*
+ * The frozen object is shareable between Ractors, because the parameters
+ * are only read by ZSTD_CCtx_setParametersUsingCCtxParams() after that.
+ */
+static const rb_data_type_t params_type = {
+    .wrap_struct_name = "extzstd.Parameters",
+    .function.dfree = params_free,
+    .function.dsize = params_memsize,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    .flags = RUBY_TYPED_FROZEN_SHAREABLE,
+#endif
+};
+
+static inline ZSTD_CCtx_params *
+getparams(VALUE v)
+{
+    return getref(v, &params_type);
+}
+
+static inline int
+params_p(VALUE v)
+{
+    return rb_typeddata_is_kind_of(v, &params_type);
+}
+
+ZSTD_CCtx_params *
 extzstd_getparams(VALUE v)
 {
     return getparams(v);
@@ -231,36 +279,281 @@ extzstd_params_p(VALUE v)
 static VALUE
 params_alloc(VALUE mod)
 {
-    ZSTD_parameters *p;
-    return TypedData_Make_Struct(mod, ZSTD_parameters, &params_type, p);
+    VALUE v = TypedData_Wrap_Struct(mod, &params_type, NULL);
+    ZSTD_CCtx_params *p;
+    AUX_TRY_WITH_GC(
+            p = ZSTD_createCCtxParams(),
+            "failed ZSTD_createCCtxParams()");
+    DATA_PTR(v) = p;
+    return v;
+}
+
+VALUE
+extzstd_params_alloc(ZSTD_CCtx_params **p)
+{
+    VALUE v = params_alloc(extzstd_cParams);
+    *p = getparams(v);
+    return v;
+}
+
+/*
+ * Name of parameters for Zstd::Parameters#[] and the keyword options.
+ *
+ * ZSTD_c_nbWorkers must be placed before ZSTD_c_jobSize and ZSTD_c_overlapLog.
+ */
+static const struct params_entry
+{
+    const char *name;
+    ZSTD_cParameter param;
+} params_table[] = {
+    { "compression_level", ZSTD_c_compressionLevel },
+    { "windowlog", ZSTD_c_windowLog },
+    { "chainlog", ZSTD_c_chainLog },
+    { "hashlog", ZSTD_c_hashLog },
+    { "searchlog", ZSTD_c_searchLog },
+    { "minmatch", ZSTD_c_minMatch },
+    { "targetlength", ZSTD_c_targetLength },
+    { "strategy", ZSTD_c_strategy },
+    { "target_cblock_size", ZSTD_c_targetCBlockSize },
+    { "long_distance_matching", ZSTD_c_enableLongDistanceMatching },
+    { "ldm_hashlog", ZSTD_c_ldmHashLog },
+    { "ldm_minmatch", ZSTD_c_ldmMinMatch },
+    { "ldm_bucketsizelog", ZSTD_c_ldmBucketSizeLog },
+    { "ldm_hashratelog", ZSTD_c_ldmHashRateLog },
+    { "contentsize", ZSTD_c_contentSizeFlag },
+    { "checksum", ZSTD_c_checksumFlag },
+    { "dictid", ZSTD_c_dictIDFlag },
+    { "workers", ZSTD_c_nbWorkers },
+    { "job_size", ZSTD_c_jobSize },
+    { "overlap_log", ZSTD_c_overlapLog },
+    { "rsyncable", ZSTD_c_rsyncable },
+    { "format", ZSTD_c_format },
+    { "force_max_window", ZSTD_c_forceMaxWindow },
+    { "force_attach_dict", ZSTD_c_forceAttachDict },
+    { "literal_compression_mode", ZSTD_c_literalCompressionMode },
+    { "srcsize_hint", ZSTD_c_srcSizeHint },
+    { "enable_dedicated_dict_search", ZSTD_c_enableDedicatedDictSearch },
+    { "stable_in_buffer", ZSTD_c_stableInBuffer },
+    { "stable_out_buffer", ZSTD_c_stableOutBuffer },
+    { "block_delimiters", ZSTD_c_blockDelimiters },
+    { "validate_sequences", ZSTD_c_validateSequences },
+#ifdef ZSTD_c_splitAfterSequences
+    { "split_after_sequences", ZSTD_c_splitAfterSequences },
+#else
+    { "split_after_sequences", ZSTD_c_useBlockSplitter },
+#endif
+#ifdef ZSTD_c_blockSplitterLevel
+    { "block_splitter_level", ZSTD_c_blockSplitterLevel },
+#endif
+    { "use_row_match_finder", ZSTD_c_useRowMatchFinder },
+    { "deterministic_ref_prefix", ZSTD_c_deterministicRefPrefix },
+    { "prefetch_cdict_tables", ZSTD_c_prefetchCDictTables },
+    { "enable_seq_producer_fallback", ZSTD_c_enableSeqProducerFallback },
+    { "max_block_size", ZSTD_c_maxBlockSize },
+    { "repcode_resolution", ZSTD_c_searchForExternalRepcodes },
+};
+
+static const struct params_entry *
+params_lookup(VALUE key)
+{
+    ID id = rb_to_id(key);
+
+    for (const struct params_entry *e = params_table; e < ENDOF(params_table); e++) {
+        if (rb_intern(e->name) == id) {
+            return e;
+        }
+    }
+
+    rb_raise(rb_eArgError, "unknown parameter - %"PRIsVALUE, rb_id2str(id));
+}
+
+static int
+params_value(VALUE v)
+{
+    switch (v) {
+    case Qtrue:
+        return 1;
+    case Qfalse:
+        return 0;
+    default:
+        if (SYMBOL_P(v)) {
+            /* for format */
+            if (SYM2ID(v) == rb_intern("zstd1")) {
+                return ZSTD_f_zstd1;
+            } else if (SYM2ID(v) == rb_intern("magicless")) {
+                return ZSTD_f_zstd1_magicless;
+            }
+
+            rb_raise(rb_eArgError, "unknown value - %"PRIsVALUE, v);
+        }
+
+        return NUM2INT(v);
+    }
+}
+
+static int
+params_get(const ZSTD_CCtx_params *p, const struct params_entry *e)
+{
+    int value;
+    size_t s = ZSTD_CCtxParams_getParameter(p, e->param, &value);
+    if (ZSTD_isError(s)) {
+        rb_exc_raise(extzstd_make_errorf(ZSTD_getErrorCode(s), "%s", e->name));
+    }
+
+    return value;
+}
+
+static void
+params_set(ZSTD_CCtx_params *p, const struct params_entry *e, int value)
+{
+    size_t s = ZSTD_CCtxParams_setParameter(p, e->param, value);
+    if (ZSTD_isError(s)) {
+        rb_exc_raise(extzstd_make_errorf(ZSTD_getErrorCode(s), "%s = %d", e->name, value));
+    }
+
+    if (e->param == ZSTD_c_compressionLevel) {
+        /* clear the compression parameters to be selected from the level by libzstd */
+        static const ZSTD_cParameter cparams[] = {
+            ZSTD_c_windowLog, ZSTD_c_chainLog, ZSTD_c_hashLog, ZSTD_c_searchLog,
+            ZSTD_c_minMatch, ZSTD_c_targetLength, ZSTD_c_strategy,
+        };
+
+        for (size_t i = 0; i < ELEMENTOF(cparams); i++) {
+            ZSTD_CCtxParams_setParameter(p, cparams[i], 0);
+        }
+    }
+}
+
+static void
+params_init_preset(ZSTD_CCtx_params *p, int level, uint64_t sizehint, size_t dictsize)
+{
+    extzstd_check_error(ZSTD_CCtxParams_init_advanced(p, ZSTD_getParams(level, sizehint, dictsize)));
+}
+
+/*
+ * Apply all parameters to the compression context at once.
+ * The values are already validated by Zstd::Parameters#initialize and
+ * Zstd::Parameters#[]=.
+ *
+ * This must be called before loading the dictionary.
+ *
+ * When an error occurs, +ctx+ is released and an exception is raised.
+ */
+void
+extzstd_params_setup_cctx(ZSTD_CCtx *ctx, const ZSTD_CCtx_params *p)
+{
+    aux_ZSTD_CCtx_setParametersUsingCCtxParams(ctx, p);
+}
+
+/*
+ * Apply +workers+, +job_size+, +overlap_log+ and +thread_pool+ keyword
+ * options to the compression context. Omitted (or nil) options are left as
+ * is, except that the multithreaded context refers the default thread pool.
+ *
+ * Returns the Zstd::ThreadPool object that the caller must keep with ctx,
+ * or nil (see extzstd_threadpool_setup_cctx()).
+ *
+ * When an error occurs, +ctx+ is released and an exception is raised.
+ */
+static const char *const mtopts_keys[] = { "workers", "job_size", "overlap_log" };
+
+struct mtopts_args
+{
+    VALUE opts;
+    int given[ELEMENTOF(mtopts_keys)];
+    int values[ELEMENTOF(mtopts_keys)];
+};
+
+static VALUE
+mtopts_convert(VALUE args)
+{
+    struct mtopts_args *a = (struct mtopts_args *)args;
+
+    for (size_t i = 0; i < ELEMENTOF(mtopts_keys); i++) {
+        VALUE v = rb_hash_lookup(a->opts, ID2SYM(rb_intern(mtopts_keys[i])));
+        a->given[i] = !NIL_P(v);
+        a->values[i] = aux_num2int(v, 0);
+    }
+
+    return Qnil;
 }
 
 VALUE
-extzstd_params_alloc(ZSTD_parameters **p)
+extzstd_mtopts_setup_cctx(ZSTD_CCtx *ctx, VALUE opts)
 {
-    return TypedData_Make_Struct(extzstd_cParams, ZSTD_parameters, &params_type, *p);
+    if (NIL_P(opts)) {
+        return extzstd_threadpool_setup_cctx(ctx, Qnil);
+    }
+
+    static const ZSTD_cParameter zparams[] = { ZSTD_c_nbWorkers, ZSTD_c_jobSize, ZSTD_c_overlapLog };
+
+    /* all of the values are converted before touching ctx */
+    struct mtopts_args args = { opts };
+    int state;
+    rb_protect(mtopts_convert, (VALUE)&args, &state);
+    if (state) {
+        ZSTD_freeCCtx(ctx);
+        rb_jump_tag(state);
+    }
+
+    for (size_t i = 0; i < ELEMENTOF(zparams); i++) {
+        if (args.given[i]) {
+            aux_ZSTD_CCtx_setParameter(ctx, zparams[i], args.values[i]);
+        }
+    }
+
+    return extzstd_threadpool_setup_cctx(ctx, rb_hash_lookup(opts, ID2SYM(rb_intern("thread_pool"))));
 }
 
 /*
  * call-seq:
- *  initialize(preset_level = 1, srcsize_hint = 0, dictsize = 0, opts = {})
+ *  initialize(preset_level = 0, srcsize_hint = 0, dictsize = 0, **opts)
+ *
+ * Initialize struct ZSTD_CCtx_params of C layer.
  *
- * Initialize struct ZSTD_parameters of C layer.
+ * The compression parameters are selected from the preset level
+ * (negative levels are ultra-fast modes), and then overwritten by +opts+.
  *
- * [preset_level = 1]
+ * [preset_level = 0]
+ *   From Zstd::MIN_COMPRESSION_LEVEL to Zstd::MAX_COMPRESSION_LEVEL.
+ *   0 is the default level.
  * [srcsize_hint = 0]
+ * [dictsize = 0]
  * [opts windowlog: nil]
- * [opts contentlog: nil]
+ * [opts chainlog: nil]
  * [opts hashlog: nil]
  * [opts searchlog: nil]
  * [opts minmatch: nil]
  * [opts targetlength: nil]
  * [opts strategy: nil]
+ * [opts contentsize: nil]
+ * [opts checksum: nil]
+ * [opts nodictid: nil]
+ * [opts workers: 0]
+ *   Number of compression worker threads.
+ *   0 is single threaded (blocking) mode.
+ * [opts job_size: 0]
+ *   Size of a compression job in bytes (only for multithreaded mode).
+ *   0 means that libzstd selects it automatically.
+ * [opts overlap_log: 0]
+ *   Overlap size between jobs (only for multithreaded mode).
+ *   0 means that libzstd selects it automatically.
+ * [opts other parameters]
+ *   Any name of Zstd::Parameters.keys (e.g. +long_distance_matching+,
+ *   +ldm_hashlog+, +target_cblock_size+ and +srcsize_hint+).
+ *   See Zstd::Parameters#[]=.
+ *
+ * Invalid values are rejected by raising Zstd::Error.
+ *
+ * The parameters are applied to the compression context by a single
+ * ZSTD_CCtx_setParametersUsingCCtxParams() call.
+ * Frozen instance can be shared between threads and Ractors
+ * (e.g. <tt>Ractor.make_shareable(Zstd::Parameters.new(19))</tt>).
  */
 static VALUE
 params_init(int argc, VALUE argv[], VALUE v)
 {
-    ZSTD_parameters *p = getparams(v);
+    ZSTD_CCtx_params *p = getparams(v);
     uint64_t sizehint;
     size_t dictsize;
     int level;
@@ -271,28 +564,20 @@ params_init(int argc, VALUE argv[], VALUE v)
     sizehint = argc > 1 ? aux_num2int_u64(argv[1], 0) : 0;
     dictsize = argc > 2 ? aux_num2int_u64(argv[2], 0) : 0;
 
-    *p = ZSTD_getParams(level, sizehint, dictsize);
+    params_init_preset(p, level, sizehint, dictsize);
 
     if (!NIL_P(opts)) {
-#define SETUP_PARAM(var, opts, key, converter)                          \
-        do {                                                            \
-            VALUE tmp = rb_hash_lookup(opts, ID2SYM(rb_intern(key)));   \
-            if (!NIL_P(tmp)) {                                          \
-                var = converter(tmp);                                   \
-            }                                                           \
-        } while (0)                                                     \
-
-        SETUP_PARAM(p->cParams.windowLog, opts, "windowlog", NUM2UINT);
-        SETUP_PARAM(p->cParams.chainLog, opts, "chainlog", NUM2UINT);
-        SETUP_PARAM(p->cParams.hashLog, opts, "hashlog", NUM2UINT);
-        SETUP_PARAM(p->cParams.searchLog, opts, "searchlog", NUM2UINT);
-        SETUP_PARAM(p->cParams.minMatch, opts, "minmatch", NUM2UINT);
-        SETUP_PARAM(p->cParams.targetLength, opts, "targetlength", NUM2UINT);
-        SETUP_PARAM(p->cParams.strategy, opts, "strategy", NUM2UINT);
-        SETUP_PARAM(p->fParams.contentSizeFlag, opts, "contentsize", RTEST);
-        SETUP_PARAM(p->fParams.checksumFlag, opts, "checksum", RTEST);
-        SETUP_PARAM(p->fParams.noDictIDFlag, opts, "nodictid", RTEST);
-#undef SETUP_PARAM
+        for (const struct params_entry *e = params_table; e < ENDOF(params_table); e++) {
+            VALUE tmp = rb_hash_lookup(opts, ID2SYM(rb_intern(e->name)));
+            if (!NIL_P(tmp)) {
+                params_set(p, e, params_value(tmp));
+            }
+        }
+
+        VALUE nodictid = rb_hash_lookup(opts, ID2SYM(rb_intern("nodictid")));
+        if (!NIL_P(nodictid)) {
+            extzstd_check_error(ZSTD_CCtxParams_setParameter(p, ZSTD_c_dictIDFlag, !RTEST(nodictid)));
+        }
     }
 
     return v;
@@ -301,45 +586,110 @@ params_init(int argc, VALUE argv[], VALUE v)
 static VALUE
 params_init_copy(VALUE params, VALUE src)
 {
-    ZSTD_parameters *a = getparams(params);
-    ZSTD_parameters *b = getparams(src);
+    ZSTD_CCtx_params *a = getparams(params);
+    ZSTD_CCtx_params *b = getparams(src);
     rb_check_frozen(params);
-    rb_obj_infect(params, src);
-    memcpy(a, b, sizeof(*a));
+
+    extzstd_check_error(ZSTD_CCtxParams_init(a, params_get(b, &params_table[0])));
+    for (const struct params_entry *e = params_table + 1; e < ENDOF(params_table); e++) {
+        extzstd_check_error(ZSTD_CCtxParams_setParameter(a, e->param, params_get(b, e)));
+    }
+
     return params;
 }
 
-//static VALUE
-//params_validate(VALUE v)
-//{
-//    ZSTD_validateParams(getparams(v));
-//    return v;
-//}
-
-#define IMP_PARAMS(GETTER, SETTER, FIELD)                   \
-    static VALUE                                            \
-    GETTER(VALUE v)                                         \
-    {                                                       \
-        return UINT2NUM(getparams(v)->cParams.FIELD);    \
-    }                                                       \
-                                                            \
-    static VALUE                                            \
-    SETTER(VALUE v, VALUE n)                                \
-    {                                                       \
-        getparams(v)->cParams.FIELD = NUM2UINT(n);       \
-        return n;                                           \
-    }                                                       \
-
-//IMP_PARAMS(params_srcsize, params_set_srcsize, srcSize);
-IMP_PARAMS(params_windowlog, params_set_windowlog, windowLog);
-IMP_PARAMS(params_chainlog, params_set_chainlog, chainLog);
-IMP_PARAMS(params_hashlog, params_set_hashlog, hashLog);
-IMP_PARAMS(params_searchlog, params_set_searchlog, searchLog);
-IMP_PARAMS(params_minmatch, params_set_minmatch, minMatch);
-IMP_PARAMS(params_targetlength, params_set_targetlength, targetLength);
-IMP_PARAMS(params_strategy, params_set_strategy, strategy);
-
-#undef IMP_PARAMS
+/*
+ * call-seq:
+ *  [](name) -> integer
+ *
+ * Get the parameter value.
+ *
+ * [name (symbol or string)]
+ *   One of Zstd::Parameters.keys.
+ */
+static VALUE
+params_aref(VALUE v, VALUE name)
+{
+    return INT2NUM(params_get(getparams(v), params_lookup(name)));
+}
+
+/*
+ * call-seq:
+ *  []=(name, value)
+ *
+ * Set the parameter value.
+ *
+ * [name (symbol or string)]
+ *   One of Zstd::Parameters.keys.
+ * [value (integer, true, false, :zstd1 or :magicless)]
+ *   0 means that libzstd selects it automatically for the most parameters.
+ *   It is checked by ZSTD_CCtxParams_setParameter(), and Zstd::Error is
+ *   raised if out of bounds.
+ *
+ *   Setting +compression_level+ clears the compression parameters
+ *   (+windowlog+, ..., +strategy+) to be selected from the level.
+ */
+static VALUE
+params_aset(VALUE v, VALUE name, VALUE value)
+{
+    rb_check_frozen(v);
+    params_set(getparams(v), params_lookup(name), params_value(value));
+    return value;
+}
+
+/*
+ * call-seq:
+ *  to_h -> hash
+ *
+ * Get all parameters as a hash.
+ */
+static VALUE
+params_to_h(VALUE v)
+{
+    const ZSTD_CCtx_params *p = getparams(v);
+    VALUE hash = rb_hash_new();
+
+    for (const struct params_entry *e = params_table; e < ENDOF(params_table); e++) {
+        rb_hash_aset(hash, ID2SYM(rb_intern(e->name)), INT2NUM(params_get(p, e)));
+    }
+
+    return hash;
+}
+
+/*
+ * call-seq:
+ *  keys -> array of symbols
+ *
+ * Get the names of all parameters.
+ */
+static VALUE
+params_s_keys(VALUE mod)
+{
+    VALUE keys = rb_ary_new_capa(ELEMENTOF(params_table));
+
+    for (const struct params_entry *e = params_table; e < ENDOF(params_table); e++) {
+        rb_ary_push(keys, ID2SYM(rb_intern(e->name)));
+    }
+
+    return keys;
+}
+
+/*
+ * call-seq:
+ *  bounds(name) -> range
+ *
+ * Get the valid range of the parameter by ZSTD_cParam_getBounds().
+ *
+ * [name (symbol or string)]
+ *   One of Zstd::Parameters.keys.
+ */
+static VALUE
+params_s_bounds(VALUE mod, VALUE name)
+{
+    ZSTD_bounds bounds = ZSTD_cParam_getBounds(params_lookup(name)->param);
+    extzstd_check_error(bounds.error);
+    return rb_range_new(INT2NUM(bounds.lowerBound), INT2NUM(bounds.upperBound), 0);
+}
 
 static VALUE
 params_s_get_preset(int argc, VALUE argv[], VALUE mod)
@@ -373,31 +723,11 @@ params_s_get_preset(int argc, VALUE argv[], VALUE mod)
         rb_error_arity(argc, 0, 3);
     }
 
-    ZSTD_parameters *p;
-    VALUE v = TypedData_Make_Struct(mod, ZSTD_parameters, &params_type, p);
-    *p = ZSTD_getParams(level, sizehint, dictsize);
+    VALUE v = params_alloc(mod);
+    params_init_preset(getparams(v), level, sizehint, dictsize);
     return v;
 }
 
-/*
- * Document-method: Zstd::Parameters#windowlog
- * Document-method: Zstd::Parameters#windowlog=
- * Document-method: Zstd::Parameters#chainlog
- * Document-method: Zstd::Parameters#chainlog=
- * Document-method: Zstd::Parameters#hashlog
- * Document-method: Zstd::Parameters#hashlog=
- * Document-method: Zstd::Parameters#searchlog
- * Document-method: Zstd::Parameters#searchlog=
- * Document-method: Zstd::Parameters#minmatch
- * Document-method: Zstd::Parameters#minmatch=
- * Document-method: Zstd::Parameters#targetlength
- * Document-method: Zstd::Parameters#targetlength=
- * Document-method: Zstd::Parameters#strategy
- * Document-method: Zstd::Parameters#strategy=
- *
- * Get/Set any field from/to struct ZSTD_parameters of C layer.
- */
-
 static void
 init_params(void)
 {
@@ -405,34 +735,319 @@ init_params(void)
     rb_define_alloc_func(extzstd_cParams, params_alloc);
     rb_define_method(extzstd_cParams, "initialize", RUBY_METHOD_FUNC(params_init), -1);
     rb_define_method(extzstd_cParams, "initialize_copy", RUBY_METHOD_FUNC(params_init_copy), 1);
-    //rb_define_method(extzstd_cParams, "validate", RUBY_METHOD_FUNC(params_validate), 0);
-    //rb_define_method(extzstd_cParams, "srcsize", RUBY_METHOD_FUNC(params_srcsize), 0);
-    //rb_define_method(extzstd_cParams, "srcsize=", RUBY_METHOD_FUNC(params_set_srcsize), 1);
-    rb_define_method(extzstd_cParams, "windowlog", RUBY_METHOD_FUNC(params_windowlog), 0);
-    rb_define_method(extzstd_cParams, "windowlog=", RUBY_METHOD_FUNC(params_set_windowlog), 1);
-    rb_define_method(extzstd_cParams, "chainlog", RUBY_METHOD_FUNC(params_chainlog), 0);
-    rb_define_method(extzstd_cParams, "chainlog=", RUBY_METHOD_FUNC(params_set_chainlog), 1);
-    rb_define_method(extzstd_cParams, "hashlog", RUBY_METHOD_FUNC(params_hashlog), 0);
-    rb_define_method(extzstd_cParams, "hashlog=", RUBY_METHOD_FUNC(params_set_hashlog), 1);
-    rb_define_method(extzstd_cParams, "searchlog", RUBY_METHOD_FUNC(params_searchlog), 0);
-    rb_define_method(extzstd_cParams, "searchlog=", RUBY_METHOD_FUNC(params_set_searchlog), 1);
-    rb_define_method(extzstd_cParams, "minmatch", RUBY_METHOD_FUNC(params_minmatch), 0);
-    rb_define_method(extzstd_cParams, "minmatch=", RUBY_METHOD_FUNC(params_set_minmatch), 1);
-    rb_define_method(extzstd_cParams, "targetlength", RUBY_METHOD_FUNC(params_targetlength), 0);
-    rb_define_method(extzstd_cParams, "targetlength=", RUBY_METHOD_FUNC(params_set_targetlength), 1);
-    rb_define_method(extzstd_cParams, "strategy", RUBY_METHOD_FUNC(params_strategy), 0);
-    rb_define_method(extzstd_cParams, "strategy=", RUBY_METHOD_FUNC(params_set_strategy), 1);
+    rb_define_method(extzstd_cParams, "[]", RUBY_METHOD_FUNC(params_aref), 1);
+    rb_define_method(extzstd_cParams, "[]=", RUBY_METHOD_FUNC(params_aset), 2);
+    rb_define_method(extzstd_cParams, "to_h", RUBY_METHOD_FUNC(params_to_h), 0);
 
+    rb_define_singleton_method(extzstd_cParams, "keys", RUBY_METHOD_FUNC(params_s_keys), 0);
+    rb_define_singleton_method(extzstd_cParams, "bounds", RUBY_METHOD_FUNC(params_s_bounds), 1);
     rb_define_singleton_method(extzstd_cParams, "preset", RUBY_METHOD_FUNC(params_s_get_preset), -1);
     rb_define_alias(rb_singleton_class(extzstd_cParams), "[]", "preset");
 }
 
+/*
+ * class Zstd::DecodeParameters
+ */
+
+VALUE extzstd_cDParams;
+
+static const struct dparams_entry
+{
+    const char *name;
+    ZSTD_dParameter param;
+} dparams_table[] = {
+    { "window_log_max", ZSTD_d_windowLogMax },
+    { "format", ZSTD_d_format },
+    { "stable_out_buffer", ZSTD_d_stableOutBuffer },
+    { "ignore_checksum", ZSTD_d_forceIgnoreChecksum },
+    { "ref_multiple_ddicts", ZSTD_d_refMultipleDDicts },
+    { "disable_huffman_assembly", ZSTD_d_disableHuffmanAssembly },
+#ifdef ZSTD_d_maxBlockSize
+    { "max_block_size", ZSTD_d_maxBlockSize },
+#endif
+};
+
+/*
+ * libzstd has no parameter object for the decompression context, so the
+ * values are kept here. 0 is the default value of all parameters.
+ */
+struct extzstd_dparams
+{
+    int values[ELEMENTOF(dparams_table)];
+};
+
+static size_t
+dparams_memsize(const void *pp)
+{
+    return (pp ? sizeof(struct extzstd_dparams) : 0);
+}
+
+static const rb_data_type_t dparams_type = {
+    .wrap_struct_name = "extzstd.DecodeParameters",
+    .function.dfree = RUBY_TYPED_DEFAULT_FREE,
+    .function.dsize = dparams_memsize,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    .flags = RUBY_TYPED_FROZEN_SHAREABLE,
+#endif
+};
+
+static inline struct extzstd_dparams *
+getdparams(VALUE v)
+{
+    return getref(v, &dparams_type);
+}
+
+int
+extzstd_dparams_p(VALUE v)
+{
+    return rb_typeddata_is_kind_of(v, &dparams_type);
+}
+
+static VALUE
+dparams_alloc(VALUE mod)
+{
+    struct extzstd_dparams *p;
+    return TypedData_Make_Struct(mod, struct extzstd_dparams, &dparams_type, p);
+}
+
+static const struct dparams_entry *
+dparams_lookup(VALUE key)
+{
+    ID id = rb_to_id(key);
+
+    for (const struct dparams_entry *e = dparams_table; e < ENDOF(dparams_table); e++) {
+        if (rb_intern(e->name) == id) {
+            return e;
+        }
+    }
+
+    rb_raise(rb_eArgError, "unknown parameter - %"PRIsVALUE, rb_id2str(id));
+}
+
+static void
+dparams_set(struct extzstd_dparams *p, const struct dparams_entry *e, VALUE value)
+{
+    int n = params_value(value);
+
+    /* 0 selects the default value by libzstd */
+    if (n != 0) {
+        ZSTD_bounds bounds = ZSTD_dParam_getBounds(e->param);
+        extzstd_check_error(bounds.error);
+        if (n < bounds.lowerBound || n > bounds.upperBound) {
+            rb_exc_raise(extzstd_make_errorf(ZSTD_error_parameter_outOfBound,
+                        "%s = %d (expected %d..%d)",
+                        e->name, n, bounds.lowerBound, bounds.upperBound));
+        }
+    }
+
+    p->values[e - dparams_table] = n;
+}
+
+/*
+ * Apply all parameters to the decompression context.
+ *
+ * When an error occurs, +dctx+ is released and an exception is raised.
+ */
+void
+extzstd_dparams_setup_dctx(ZSTD_DCtx *dctx, VALUE dparams)
+{
+    if (NIL_P(dparams)) {
+        return;
+    }
+
+    const struct extzstd_dparams *p = getdparams(dparams);
+
+    for (size_t i = 0; i < ELEMENTOF(dparams_table); i++) {
+        if (p->values[i] != 0) {
+            size_t s = ZSTD_DCtx_setParameter(dctx, dparams_table[i].param, p->values[i]);
+            if (ZSTD_isError(s)) {
+                ZSTD_freeDCtx(dctx);
+                extzstd_error(s);
+            }
+        }
+    }
+}
+
+/*
+ * Returns the value of param in dparams (nil or Zstd::DecodeParameters),
+ * or 0 if not set.
+ */
+int
+extzstd_dparams_get(VALUE dparams, ZSTD_dParameter param)
+{
+    if (NIL_P(dparams)) {
+        return 0;
+    }
+
+    const struct extzstd_dparams *p = getdparams(dparams);
+
+    for (size_t i = 0; i < ELEMENTOF(dparams_table); i++) {
+        if (dparams_table[i].param == param) {
+            return p->values[i];
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Convert nil, Zstd::DecodeParameters or keyword options (hash) to
+ * nil or Zstd::DecodeParameters.
+ */
+VALUE
+extzstd_dparams_new(VALUE dparams)
+{
+    if (NIL_P(dparams) || extzstd_dparams_p(dparams)) {
+        return dparams;
+    }
+
+    return rb_class_new_instance_kw(1, &dparams, extzstd_cDParams, RB_PASS_KEYWORDS);
+}
+
+static int
+dparams_init_i(VALUE key, VALUE value, VALUE v)
+{
+    dparams_set(getdparams(v), dparams_lookup(key), value);
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ *  initialize(**opts)
+ *
+ * Parameters for the decompression context.
+ *
+ * [opts window_log_max: 0]
+ *   Refuse the frames that require the window larger than
+ *   <tt>2 ** window_log_max</tt> bytes (ZSTD_d_windowLogMax).
+ *   It limits the memory usage of each decompression context.
+ *   0 is libzstd's default (27).
+ * [opts ignore_checksum: false]
+ *   Skip the checksum verification (ZSTD_d_forceIgnoreChecksum).
+ * [opts format: :zstd1]
+ *   :zstd1 or :magicless (ZSTD_d_format).
+ *   Magicless frames are made by <tt>Zstd::Parameters.new(format: :magicless)</tt>.
+ * [opts stable_out_buffer: false]
+ *   The output buffer is not copied through the internal buffer
+ *   (ZSTD_d_stableOutBuffer).
+ *   Only for Zstd::Codec#decode with +maxsize+, because the output
+ *   buffer must be the same during the frame.
+ * [opts ref_multiple_ddicts: false]
+ * [opts disable_huffman_assembly: false]
+ * [opts max_block_size: 0]
+ *
+ * Invalid values are rejected by raising Zstd::Error.
+ * Frozen instance can be shared between threads and Ractors.
+ */
+static VALUE
+dparams_init(int argc, VALUE argv[], VALUE v)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+
+    if (!NIL_P(opts)) {
+        rb_hash_foreach(opts, dparams_init_i, v);
+    }
+
+    return v;
+}
+
+static VALUE
+dparams_init_copy(VALUE v, VALUE src)
+{
+    rb_check_frozen(v);
+    memcpy(getdparams(v), getdparams(src), sizeof(struct extzstd_dparams));
+    return v;
+}
+
+/*
+ * call-seq:
+ *  [](name) -> integer
+ *
+ * [name (symbol or string)]
+ *   One of Zstd::DecodeParameters.keys.
+ */
+static VALUE
+dparams_aref(VALUE v, VALUE name)
+{
+    return INT2NUM(getdparams(v)->values[dparams_lookup(name) - dparams_table]);
+}
+
+/*
+ * call-seq:
+ *  []=(name, value)
+ *
+ * [name (symbol or string)]
+ *   One of Zstd::DecodeParameters.keys.
+ * [value (integer, true, false, :zstd1 or :magicless)]
+ */
+static VALUE
+dparams_aset(VALUE v, VALUE name, VALUE value)
+{
+    rb_check_frozen(v);
+    dparams_set(getdparams(v), dparams_lookup(name), value);
+    return value;
+}
+
+static VALUE
+dparams_to_h(VALUE v)
+{
+    const struct extzstd_dparams *p = getdparams(v);
+    VALUE hash = rb_hash_new();
+
+    for (size_t i = 0; i < ELEMENTOF(dparams_table); i++) {
+        rb_hash_aset(hash, ID2SYM(rb_intern(dparams_table[i].name)), INT2NUM(p->values[i]));
+    }
+
+    return hash;
+}
+
+static VALUE
+dparams_s_keys(VALUE mod)
+{
+    VALUE keys = rb_ary_new_capa(ELEMENTOF(dparams_table));
+
+    for (size_t i = 0; i < ELEMENTOF(dparams_table); i++) {
+        rb_ary_push(keys, ID2SYM(rb_intern(dparams_table[i].name)));
+    }
+
+    return keys;
+}
+
+/*
+ * call-seq:
+ *  bounds(name) -> range
+ *
+ * Get the valid range of the parameter by ZSTD_dParam_getBounds().
+ */
+static VALUE
+dparams_s_bounds(VALUE mod, VALUE name)
+{
+    ZSTD_bounds bounds = ZSTD_dParam_getBounds(dparams_lookup(name)->param);
+    extzstd_check_error(bounds.error);
+    return rb_range_new(INT2NUM(bounds.lowerBound), INT2NUM(bounds.upperBound), 0);
+}
+
+static void
+init_dparams(void)
+{
+    extzstd_cDParams = rb_define_class_under(extzstd_mZstd, "DecodeParameters", rb_cObject);
+    rb_define_alloc_func(extzstd_cDParams, dparams_alloc);
+    rb_define_method(extzstd_cDParams, "initialize", RUBY_METHOD_FUNC(dparams_init), -1);
+    rb_define_method(extzstd_cDParams, "initialize_copy", RUBY_METHOD_FUNC(dparams_init_copy), 1);
+    rb_define_method(extzstd_cDParams, "[]", RUBY_METHOD_FUNC(dparams_aref), 1);
+    rb_define_method(extzstd_cDParams, "[]=", RUBY_METHOD_FUNC(dparams_aset), 2);
+    rb_define_method(extzstd_cDParams, "to_h", RUBY_METHOD_FUNC(dparams_to_h), 0);
+
+    rb_define_singleton_method(extzstd_cDParams, "keys", RUBY_METHOD_FUNC(dparams_s_keys), 0);
+    rb_define_singleton_method(extzstd_cDParams, "bounds", RUBY_METHOD_FUNC(dparams_s_bounds), 1);
+}
 
 /*
  * module Zstd::Dictionary
  */
 
-static VALUE mDictionary;
+VALUE extzstd_mDictionary;
 
 /*
  * call-seq:
@@ -452,6 +1067,201 @@ dict_s_train_from_buffer(VALUE mod, VALUE src, VALUE dict_capacity)
     return dict;
 }
 
+enum dict_train_algorithm
+{
+    DICT_TRAIN_LEGACY,
+    DICT_TRAIN_COVER,
+    DICT_TRAIN_FASTCOVER,
+};
+
+struct dict_train_args
+{
+    enum dict_train_algorithm algorithm;
+    int optimize;
+    char *dict;
+    size_t capacity;
+    const char *samples;
+    const size_t *sizes;
+    unsigned nsamples;
+    ZDICT_legacy_params_t legacy;
+    ZDICT_cover_params_t cover;
+    ZDICT_fastCover_params_t fastcover;
+    size_t status;
+};
+
+static void *
+dict_train_nogvl(void *pp)
+{
+    struct dict_train_args *a = (struct dict_train_args *)pp;
+
+    switch (a->algorithm) {
+    case DICT_TRAIN_LEGACY:
+        a->status = ZDICT_trainFromBuffer_legacy(a->dict, a->capacity,
+                a->samples, a->sizes, a->nsamples, a->legacy);
+        break;
+    case DICT_TRAIN_COVER:
+        if (a->optimize) {
+            a->status = ZDICT_optimizeTrainFromBuffer_cover(a->dict, a->capacity,
+                    a->samples, a->sizes, a->nsamples, &a->cover);
+        } else {
+            a->status = ZDICT_trainFromBuffer_cover(a->dict, a->capacity,
+                    a->samples, a->sizes, a->nsamples, a->cover);
+        }
+        break;
+    case DICT_TRAIN_FASTCOVER:
+        if (a->optimize) {
+            a->status = ZDICT_optimizeTrainFromBuffer_fastCover(a->dict, a->capacity,
+                    a->samples, a->sizes, a->nsamples, &a->fastcover);
+        } else {
+            a->status = ZDICT_trainFromBuffer_fastCover(a->dict, a->capacity,
+                    a->samples, a->sizes, a->nsamples, a->fastcover);
+        }
+        break;
+    }
+
+    return NULL;
+}
+
+static unsigned
+dict_train_opt(VALUE v, unsigned default_value)
+{
+    return (NIL_P(v) || v == Qundef) ? default_value : NUM2UINT(v);
+}
+
+/*
+ * call-seq:
+ *  train(samples, dict_capacity, algorithm: :fastcover, k: nil, d: nil, f: nil, steps: nil, threads: nil, split_point: nil, accel: nil, level: nil, optimize: nil) -> dictionary'd string
+ *
+ * Train a dictionary from the array of samples.
+ *
+ * When k or d is not given (or optimize is true), the parameters are
+ * searched by ZDICT_optimizeTrainFromBuffer_cover() or
+ * ZDICT_optimizeTrainFromBuffer_fastCover().
+ *
+ * The GVL is released while training. It can not be interrupted.
+ *
+ * [samples (array of strings)]
+ * [dict_capacity (integer)]
+ * [algorithm: :fastcover (:fastcover, :cover or :legacy)]
+ * [k: nil (integer)] Segment size.
+ * [d: nil (integer)] dmer size.
+ * [f: nil (integer)] Log of size of frequency array (fastcover only).
+ * [steps: nil (integer)] Number of steps for optimization.
+ * [threads: nil (integer)]
+ *   Number of threads for optimization.
+ *   nil means the number of online processors.
+ * [split_point: nil (float)] Ratio of samples used for training (the rest are used for testing).
+ * [accel: nil (integer)] Acceleration level 1..10 (fastcover only).
+ * [level: nil (integer)] Compression level for the dictionary header (entropy tables).
+ * [optimize: nil (true, false or nil)]
+ */
+static VALUE
+dict_s_train(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE samples, dict_capacity, opts;
+    rb_scan_args(argc, argv, "2:", &samples, &dict_capacity, &opts);
+
+    enum { o_algorithm, o_k, o_d, o_f, o_steps, o_threads, o_split_point, o_accel, o_level, o_optimize, o_count };
+    ID ids[o_count] = {
+        rb_intern("algorithm"), rb_intern("k"), rb_intern("d"), rb_intern("f"),
+        rb_intern("steps"), rb_intern("threads"), rb_intern("split_point"),
+        rb_intern("accel"), rb_intern("level"), rb_intern("optimize"),
+    };
+    VALUE v[o_count];
+    for (int i = 0; i < o_count; i++) { v[i] = Qundef; }
+    rb_get_kwargs(opts, ids, 0, o_count, v);
+
+    struct dict_train_args a = { 0 };
+
+    if (v[o_algorithm] == Qundef || NIL_P(v[o_algorithm]) || v[o_algorithm] == ID2SYM(rb_intern("fastcover"))) {
+        a.algorithm = DICT_TRAIN_FASTCOVER;
+    } else if (v[o_algorithm] == ID2SYM(rb_intern("cover"))) {
+        a.algorithm = DICT_TRAIN_COVER;
+    } else if (v[o_algorithm] == ID2SYM(rb_intern("legacy"))) {
+        a.algorithm = DICT_TRAIN_LEGACY;
+    } else {
+        rb_raise(rb_eArgError,
+                 "wrong algorithm - %" PRIsVALUE " (expect :fastcover, :cover or :legacy)",
+                 rb_inspect(v[o_algorithm]));
+    }
+
+    ZDICT_params_t zparams = {
+        .compressionLevel = (int)dict_train_opt(v[o_level], 0),
+        .notificationLevel = 0,
+        .dictID = 0,
+    };
+    unsigned k = dict_train_opt(v[o_k], 0);
+    unsigned d = dict_train_opt(v[o_d], 0);
+    unsigned threads = dict_train_opt(v[o_threads], (unsigned)extzstd_cpu_count());
+    double split_point = (v[o_split_point] == Qundef || NIL_P(v[o_split_point])) ? 0.0 : NUM2DBL(v[o_split_point]);
+    if (v[o_optimize] == Qundef || NIL_P(v[o_optimize])) {
+        a.optimize = (k == 0 || d == 0);
+    } else {
+        a.optimize = RTEST(v[o_optimize]);
+    }
+
+    a.legacy.zParams = zparams;
+    a.cover = (ZDICT_cover_params_t) {
+        .k = k, .d = d,
+        .steps = dict_train_opt(v[o_steps], 0),
+        .nbThreads = (threads < 1 ? 1 : threads),
+        .splitPoint = split_point,
+        .zParams = zparams,
+    };
+    a.fastcover = (ZDICT_fastCover_params_t) {
+        .k = k, .d = d,
+        .f = dict_train_opt(v[o_f], 0),
+        .steps = a.cover.steps,
+        .nbThreads = a.cover.nbThreads,
+        .splitPoint = split_point,
+        .accel = dict_train_opt(v[o_accel], 0),
+        .zParams = zparams,
+    };
+
+    samples = rb_convert_type(samples, RUBY_T_ARRAY, "Array", "to_ary");
+    long nsamples = RARRAY_LEN(samples);
+    if (nsamples > UINT_MAX) {
+        rb_raise(rb_eArgError, "too many samples (%ld)", nsamples);
+    }
+
+    VALUE sizesv;
+    size_t *sizes = ALLOCV_N(size_t, sizesv, nsamples);
+    size_t total = 0;
+    for (long i = 0; i < nsamples; i++) {
+        VALUE e = RARRAY_AREF(samples, i);
+        sizes[i] = RSTRING_LEN(StringValue(e));
+        total += sizes[i];
+    }
+
+    VALUE buf = rb_str_buf_new(total);
+    for (long i = 0; i < nsamples && i < RARRAY_LEN(samples); i++) {
+        VALUE e = RARRAY_AREF(samples, i);
+        StringValue(e);
+        if ((size_t)RSTRING_LEN(e) != sizes[i]) {
+            rb_raise(rb_eRuntimeError, "samples are modified while training");
+        }
+        rb_str_buf_cat(buf, RSTRING_PTR(e), RSTRING_LEN(e));
+    }
+
+    size_t capa = NUM2SIZET(dict_capacity);
+    VALUE dict = rb_str_buf_new(capa);
+
+    a.dict = RSTRING_PTR(dict);
+    a.capacity = capa;
+    a.samples = RSTRING_PTR(buf);
+    a.sizes = sizes;
+    a.nsamples = (unsigned)nsamples;
+
+    rb_thread_call_without_gvl(dict_train_nogvl, &a, NULL, NULL);
+
+    RB_GC_GUARD(buf);
+    ALLOCV_END(sizesv);
+    extzstd_check_error(a.status);
+    rb_str_set_len(dict, a.status);
+
+    return dict;
+}
+
 /*
  * call-seq:
  *  add_entropy_tables_from_buffer(dict, dict_capacity, sample) -> dict
@@ -502,10 +1312,11 @@ dict_s_getid(VALUE mod, VALUE dict)
 static void
 init_dictionary(void)
 {
-    mDictionary = rb_define_module_under(extzstd_mZstd, "Dictionary");
-    rb_define_singleton_method(mDictionary, "train_from_buffer", dict_s_train_from_buffer, 2);
-    rb_define_singleton_method(mDictionary, "add_entropy_tables_from_buffer", dict_s_add_entropy_tables_from_buffer, 3);
-    rb_define_singleton_method(mDictionary, "getid", dict_s_getid, 1);
+    extzstd_mDictionary = rb_define_module_under(extzstd_mZstd, "Dictionary");
+    rb_define_singleton_method(extzstd_mDictionary, "train_from_buffer", dict_s_train_from_buffer, 2);
+    rb_define_singleton_method(extzstd_mDictionary, "train", dict_s_train, -1);
+    rb_define_singleton_method(extzstd_mDictionary, "add_entropy_tables_from_buffer", dict_s_add_entropy_tables_from_buffer, 3);
+    rb_define_singleton_method(extzstd_mDictionary, "getid", dict_s_getid, 1);
 }
 
 /*
@@ -516,12 +1327,15 @@ static VALUE mContextLess;
 
 /*
  * call-seq:
- *  encode(src, dest, maxdest, params)
+ *  encode(src, dest, maxdest, predict, params)
  *
  * [RETURN] dest
  * [src (string)]
  * [dest (string)]
  * [maxdest (integer or nil)]
+ * [predict (nil, string or Zstd::Dictionary::Compressor)]
+ *   When given Zstd::Dictionary::Compressor without params, the compression
+ *   level is taken from the digested dictionary.
  * [params (nil, integer or Zstd::Parameters)]
  */
 static VALUE
@@ -536,10 +1350,17 @@ less_s_encode(VALUE mod, VALUE src, VALUE dest, VALUE maxdest, VALUE predict, VA
     aux_string_expand_pointer(dest, &r, rsize);
     rb_obj_infect(dest, src);
 
+    const ZSTD_CDict *cdict = NULL;
     const char *d;
     size_t dsize;
-    aux_string_pointer_with_nil(predict, &d, &dsize);
-    rb_obj_infect(dest, predict);
+    if (extzstd_cdict_p(predict)) {
+        cdict = extzstd_getcdict(predict);
+        d = NULL;
+        dsize = 0;
+    } else {
+        aux_string_pointer_with_nil(predict, &d, &dsize);
+        rb_obj_infect(dest, predict);
+    }
 
     if (extzstd_params_p(params)) {
         /*
@@ -549,27 +1370,21 @@ less_s_encode(VALUE mod, VALUE src, VALUE dest, VALUE maxdest, VALUE predict, VA
          * ZSTDLIB_API size_t ZSTD_CCtx_setParameter(ZSTD_CCtx* cctx, ZSTD_cParameter param, int value);
          * ZSTDLIB_API size_t ZSTD_CCtx_setPledgedSrcSize(ZSTD_CCtx* cctx, unsigned long long pledgedSrcSize);
          */
-        ZSTD_CCtx *zstd = ZSTD_createCCtx();
-        ZSTD_parameters *param = extzstd_getparams(params);
-
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_windowLog, param->cParams.windowLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_chainLog, param->cParams.chainLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_hashLog, param->cParams.hashLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_searchLog, param->cParams.searchLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_minMatch, param->cParams.minMatch);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_targetLength, param->cParams.targetLength);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_strategy, param->cParams.strategy);
-
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_contentSizeFlag, param->fParams.contentSizeFlag);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_checksumFlag, param->fParams.checksumFlag);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_dictIDFlag, !param->fParams.noDictIDFlag);
+        ZSTD_CCtx *zstd = extzstd_create_cctx();
+        extzstd_params_setup_cctx(zstd, extzstd_getparams(params));
+        extzstd_threadpool_setup_cctx(zstd, Qnil);
 
         //aux_ZSTD_CCtx_setPledgedSrcSize(zstd, (unsigned long long)qsize);
 
-        aux_ZSTD_CCtx_loadDictionary(zstd, d, dsize);
+        if (cdict) {
+            aux_ZSTD_CCtx_refCDict(zstd, cdict);
+        } else {
+            aux_ZSTD_CCtx_loadDictionary(zstd, d, dsize);
+        }
 
         size_t s = ZSTD_compress2(zstd, r, rsize, q, qsize);
         ZSTD_freeCCtx(zstd);
+        extzstd_memory_flush();
         extzstd_check_error(s);
         rb_str_set_len(dest, s);
         return dest;
@@ -582,9 +1397,15 @@ less_s_encode(VALUE mod, VALUE src, VALUE dest, VALUE maxdest, VALUE predict, VA
          *      const void* dict,size_t dictSize,
          *      int compressionLevel);
          */
-        ZSTD_CCtx *zstd = ZSTD_createCCtx();
-        size_t s = ZSTD_compress_usingDict(zstd, r, rsize, q, qsize, d, dsize, aux_num2int(params, 0));
+        ZSTD_CCtx *zstd = extzstd_create_cctx();
+        size_t s;
+        if (cdict) {
+            s = ZSTD_compress_usingCDict(zstd, r, rsize, q, qsize, cdict);
+        } else {
+            s = ZSTD_compress_usingDict(zstd, r, rsize, q, qsize, d, dsize, aux_num2int(params, 0));
+        }
         ZSTD_freeCCtx(zstd);
+        extzstd_memory_flush();
         extzstd_check_error(s);
         rb_str_set_len(dest, s);
         return dest;
@@ -593,12 +1414,13 @@ less_s_encode(VALUE mod, VALUE src, VALUE dest, VALUE maxdest, VALUE predict, VA
 
 /*
  * call-seq:
- *  decode(src, dest, maxdest)
+ *  decode(src, dest, maxdest, predict)
  *
  * [RETURN] dest
  * [src (string)]
  * [dest (string)]
  * [maxdest (integer or nil)]
+ * [predict (nil, string or Zstd::Dictionary::Decompressor)]
  */
 static VALUE
 less_s_decode(VALUE mod, VALUE src, VALUE dest, VALUE maxdest, VALUE predict)
@@ -612,14 +1434,19 @@ less_s_decode(VALUE mod, VALUE src, VALUE dest, VALUE maxdest, VALUE predict)
     aux_string_expand_pointer(dest, &r, rsize);
     rb_obj_infect(dest, src);
 
-    const char *d;
-    size_t dsize;
-    aux_string_pointer_with_nil(predict, &d, &dsize);
-    rb_obj_infect(dest, predict);
-
-    ZSTD_DCtx *z = ZSTD_createDCtx();
-    size_t s = ZSTD_decompress_usingDict(z, r, rsize, q, qsize, d, dsize);
+    ZSTD_DCtx *z = extzstd_create_dctx();
+    size_t s;
+    if (extzstd_ddict_p(predict)) {
+        s = ZSTD_decompress_usingDDict(z, r, rsize, q, qsize, extzstd_getddict(predict));
+    } else {
+        const char *d;
+        size_t dsize;
+        aux_string_pointer_with_nil(predict, &d, &dsize);
+        rb_obj_infect(dest, predict);
+        s = ZSTD_decompress_usingDict(z, r, rsize, q, qsize, d, dsize);
+    }
     ZSTD_freeDCtx(z);
+    extzstd_memory_flush();
     extzstd_check_error(s);
     rb_str_set_len(dest, s);
 
@@ -652,10 +1479,16 @@ Init_extzstd(void)
     init_error();
     init_constants();
     init_params();
+    init_dparams();
     init_dictionary();
     init_contextless();
+    extzstd_init_dict();
+    extzstd_init_codec();
+    extzstd_init_batch();
+    extzstd_init_copy();
+    extzstd_init_threadpool();
+    extzstd_init_memory();
+    extzstd_init_workspace();
+    extzstd_init_contextpool();
     extzstd_init_stream();
-
-    (void)params_alloc_dummy;
-    (void)getparamsp;
 }
@@ -2,6 +2,7 @@
 #define EXTZSTD_H 1
 
 #define ZSTD_LEGACY_SUPPORT 1
+#define ZSTD_MULTITHREAD 1
 #define ZDICT_STATIC_LINKING_ONLY 1
 //#define ZSTD_STATIC_LINKING_ONLY 1
 #include <common/zstd_internal.h> /* for MIN() */
@@ -29,20 +30,81 @@ RDOCFAKE(extzstd_mZstd = rb_define_module("Zstd"));
 extern VALUE extzstd_cParams;
 RDOCFAKE(extzstd_cParams = rb_define_class_under(extzstd_mZstd, "Parameters", rb_cObject));
 
+extern VALUE extzstd_cDParams;
+RDOCFAKE(extzstd_cDParams = rb_define_class_under(extzstd_mZstd, "DecodeParameters", rb_cObject));
+
+extern VALUE extzstd_mDictionary;
+RDOCFAKE(extzstd_mDictionary = rb_define_module_under(extzstd_mZstd, "Dictionary"));
+
 extern VALUE extzstd_mExceptions;
 extern VALUE extzstd_eError;
 
 extern void init_extzstd_stream(void);
 extern void extzstd_init_buffered(void);
 extern void extzstd_init_stream(void);
+extern void extzstd_init_dict(void);
+extern void extzstd_init_codec(void);
+extern void extzstd_init_batch(void);
+extern void extzstd_init_copy(void);
+extern void extzstd_init_threadpool(void);
+extern void extzstd_init_memory(void);
+extern void extzstd_init_workspace(void);
+extern void extzstd_init_contextpool(void);
 extern RBEXT_NORETURN void extzstd_error(ssize_t errcode);
 extern void extzstd_check_error(ssize_t errcode);
 extern VALUE extzstd_make_error(ssize_t errcode);
 extern VALUE extzstd_make_errorf(ssize_t errcode, const char *fmt, ...);
+extern int extzstd_cpu_count(void);
+extern ZSTD_CCtx *extzstd_create_cctx(void);
+extern ZSTD_DCtx *extzstd_create_dctx(void);
+extern void extzstd_memory_flush(void);
+
+/* incremented in the child process by fork(2) */
+extern unsigned int extzstd_fork_generation;
+
+static inline int
+extzstd_forked_p(unsigned int generation)
+{
+    return generation != extzstd_fork_generation;
+}
 
-extern ZSTD_parameters *extzstd_getparams(VALUE v);
+/*
+ * Returns the decompressed size bound from the number of blocks in the frames
+ * (not from the content size fields), or ZSTD_CONTENTSIZE_ERROR.
+ * Defined in zstd_decompress.c.
+ */
+extern unsigned long long extzstd_decompress_block_bound(const void *src, size_t srcsize);
+
+extern ZSTD_CCtx_params *extzstd_getparams(VALUE v);
 extern int extzstd_params_p(VALUE v);
-extern VALUE extzstd_params_alloc(ZSTD_parameters **p);
+extern VALUE extzstd_params_alloc(ZSTD_CCtx_params **p);
+extern void extzstd_params_setup_cctx(ZSTD_CCtx *ctx, const ZSTD_CCtx_params *p);
+extern VALUE extzstd_mtopts_setup_cctx(ZSTD_CCtx *ctx, VALUE opts);
+extern VALUE extzstd_threadpool_setup_cctx(ZSTD_CCtx *ctx, VALUE pool);
+extern int extzstd_cctx_mt_p(ZSTD_CCtx *ctx);
+extern void extzstd_discard_cctx(ZSTD_CCtx *ctx);
+extern int extzstd_dparams_p(VALUE v);
+extern VALUE extzstd_dparams_new(VALUE dparams);
+extern void extzstd_dparams_setup_dctx(ZSTD_DCtx *dctx, VALUE dparams);
+extern int extzstd_dparams_get(VALUE dparams, ZSTD_dParameter param);
+
+struct extzstd_workspace;
+extern ZSTD_CCtx *extzstd_workspace_cctx(VALUE workspace, VALUE params, VALUE predict, VALUE opts, struct extzstd_workspace **arena);
+extern ZSTD_DCtx *extzstd_workspace_dctx(VALUE workspace, VALUE dparams, VALUE predict, struct extzstd_workspace **arena);
+extern void extzstd_workspace_release(struct extzstd_workspace *arena);
+
+enum {
+    EXTZSTD_CONTEXTPOOL_CCTX = 1,
+    EXTZSTD_CONTEXTPOOL_DCTX = 2,
+};
+extern VALUE extzstd_contextpool_key(long argc, const VALUE argv[]);
+extern void *extzstd_contextpool_checkout(VALUE pool, int kind, VALUE key, VALUE *thread_pool);
+extern void extzstd_contextpool_checkin(VALUE pool, int kind, VALUE key, void *context, VALUE thread_pool, unsigned int generation);
+
+extern int extzstd_cdict_p(VALUE v);
+extern ZSTD_CDict *extzstd_getcdict(VALUE v);
+extern int extzstd_ddict_p(VALUE v);
+extern ZSTD_DDict *extzstd_getddict(VALUE v);
 
 static RBEXT_NORETURN inline void
 referror(VALUE v)
@@ -81,14 +143,29 @@ getref(VALUE v, const rb_data_type_t *type)
     return checkref(v, getrefp(v, type));
 }
 
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+#   define AUX_FROZEN_SHAREABLE RUBY_TYPED_FROZEN_SHAREABLE
+#else
+#   define AUX_FROZEN_SHAREABLE 0
+#endif
+
 #define AUX_IMPLEMENT_CONTEXT(TYPE, TYPEDDATANAME, STRUCTNAME, ALLOCNAME,   \
                               MARKFUNC, FREEFUNC, SIZEFUNC,                 \
                               GETREFP, GETREF, REF_P)                       \
+    AUX_IMPLEMENT_CONTEXT_FLAGS(TYPE, TYPEDDATANAME, STRUCTNAME, ALLOCNAME, \
+                                MARKFUNC, FREEFUNC, SIZEFUNC, 0,            \
+                                GETREFP, GETREF, REF_P)                     \
+
+#define AUX_IMPLEMENT_CONTEXT_FLAGS(TYPE, TYPEDDATANAME, STRUCTNAME,        \
+                                    ALLOCNAME, MARKFUNC, FREEFUNC,          \
+                                    SIZEFUNC, FLAGS,                        \
+                                    GETREFP, GETREF, REF_P)                 \
     static const rb_data_type_t TYPEDDATANAME = {                           \
         .wrap_struct_name = STRUCTNAME,                                     \
         .function.dmark = MARKFUNC,                                         \
         .function.dfree = FREEFUNC,                                         \
         .function.dsize = SIZEFUNC,                                         \
+        .flags = FLAGS,                                                     \
     };                                                                      \
                                                                             \
     static VALUE                                                            \
@@ -252,11 +329,20 @@ MAKE_AUX_FUNC(aux_ZSTD_CCtx_reset(ZSTD_CCtx *zstd, ZSTD_ResetDirective reset),
 MAKE_AUX_FUNC(aux_ZSTD_CCtx_setParameter(ZSTD_CCtx *ctx, ZSTD_cParameter param, int value),
               ZSTD_CCtx_setParameter(ctx, param, value),
               ZSTD_freeCCtx(ctx))
+MAKE_AUX_FUNC(aux_ZSTD_CCtx_setParametersUsingCCtxParams(ZSTD_CCtx *ctx, const ZSTD_CCtx_params *params),
+              ZSTD_CCtx_setParametersUsingCCtxParams(ctx, params),
+              ZSTD_freeCCtx(ctx))
 MAKE_AUX_FUNC(aux_ZSTD_CCtx_setPledgedSrcSize(ZSTD_CCtx *ctx, unsigned long long pledgedSrcSize),
               ZSTD_CCtx_setPledgedSrcSize(ctx, pledgedSrcSize),
               ZSTD_freeCCtx(ctx))
 MAKE_AUX_FUNC(aux_ZSTD_CCtx_loadDictionary(ZSTD_CCtx *ctx, const void* dict, size_t dictSize),
               ZSTD_CCtx_loadDictionary(ctx, dict, dictSize),
               ZSTD_freeCCtx(ctx))
+MAKE_AUX_FUNC(aux_ZSTD_CCtx_refCDict(ZSTD_CCtx *ctx, const ZSTD_CDict *cdict),
+              ZSTD_CCtx_refCDict(ctx, cdict),
+              ZSTD_freeCCtx(ctx))
+MAKE_AUX_FUNC(aux_ZSTD_CCtx_refThreadPool(ZSTD_CCtx *ctx, ZSTD_threadPool *pool),
+              ZSTD_CCtx_refThreadPool(ctx, pool),
+              ZSTD_freeCCtx(ctx))
 
 #endif /* EXTZSTD_H */
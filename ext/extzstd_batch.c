@@ -0,0 +1,961 @@
+#include "extzstd.h"
+#include <common/pool.h>
+#include <common/threading.h>
+#ifdef HAVE_PTHREAD_ATFORK
+#   include <pthread.h>
+#endif
+
+enum {
+    EXT_BATCH_GROWUP_SIZE = 256 * 1024, /* 256 KiB */
+    EXT_PARALLEL_WINDOW_SIZE = 64 * 1024 * 1024, /* 64 MiB */
+    EXT_PARALLEL_READ_SIZE = 16 * 1024 * 1024, /* 16 MiB */
+    EXT_BATCH_IDLE_MAX = 64,    /* idle contexts kept for each kind */
+};
+
+static ID id_read, id_write;
+
+/*
+ * Zstd.encode_batch / Zstd.decode_batch / Zstd::Decoder.decode_parallel
+ *
+ * The items are processed by the native worker threads of POOL_ctx (pool.c).
+ * Each worker has own context, and takes the next item until all items are
+ * done. The caller thread waits without the GVL.
+ *
+ * The threads and the contexts are kept in the process for the next batch
+ * (see batch_pool_acquire() and batch_checkout()). The threads are shared by
+ * the concurrent batches, and grown to the largest number of workers.
+ * After fork(2), the threads of the parent process are lost and made again,
+ * and the idle contexts are released by the first use in the child.
+ */
+
+struct batch_item
+{
+    const char *src;
+    size_t srcsize;
+    VALUE str;          /* destination string, or nil */
+    char *dest;         /* the pointer of presized string, or malloc'ed buffer */
+    size_t destcapa;
+    size_t destsize;
+    int heap;           /* dest is malloc'ed (decompressed size is unknown) */
+    size_t status;
+};
+
+struct batch;
+
+struct batch_worker
+{
+    struct batch *batch;
+    void *context;      /* ZSTD_CCtx or ZSTD_DCtx */
+};
+
+struct batch
+{
+    int decode;
+    size_t nitems;
+    struct batch_item *items;
+    size_t nworkers;
+    struct batch_worker *workers;
+    VALUE values[3];    /* the source (string or array of strings), the dictionary and the destination */
+    POOL_ctx *pool;     /* borrowed from batch_pool */
+    ZSTD_pthread_mutex_t mutex;
+    ZSTD_pthread_cond_t cond;
+    int sync_ready;
+    unsigned int generation;    /* extzstd_fork_generation at made the batch */
+    size_t next;
+    size_t running;
+    volatile int canceled;
+};
+
+static struct
+{
+    POOL_ctx *pool;
+    size_t size;
+    void *idle[2][EXT_BATCH_IDLE_MAX];  /* ZSTD_CCtx and ZSTD_DCtx, reset with the parameters */
+    size_t nidle[2];
+    unsigned int generation;    /* extzstd_fork_generation of the threads and the contexts */
+} batch_pool;
+
+static ZSTD_pthread_mutex_t batch_pool_mutex;
+
+static void
+batch_context_free(int decode, void *context)
+{
+    if (decode) {
+        ZSTD_freeDCtx((ZSTD_DCtx *)context);
+    } else {
+        ZSTD_freeCCtx((ZSTD_CCtx *)context);
+    }
+}
+
+/*
+ * Forget the threads of the parent process, and release the idle contexts.
+ * Must be called with batch_pool_mutex.
+ */
+static void
+batch_pool_check_fork(void)
+{
+    if (extzstd_forked_p(batch_pool.generation)) {
+        batch_pool.pool = NULL;
+        batch_pool.size = 0;
+        for (int k = 0; k < 2; k++) {
+            for (size_t i = 0; i < batch_pool.nidle[k]; i++) {
+                batch_context_free(k, batch_pool.idle[k][i]);
+            }
+            batch_pool.nidle[k] = 0;
+        }
+        batch_pool.generation = extzstd_fork_generation;
+    }
+}
+
+/*
+ * Returns the worker threads of the process, grown to nworkers if possible.
+ * Returns NULL if failed.
+ *
+ * When the pool has less threads (or it is used by another batch), the rest
+ * of the workers wait in the queue.
+ */
+static POOL_ctx *
+batch_pool_acquire(size_t nworkers)
+{
+    ZSTD_pthread_mutex_lock(&batch_pool_mutex);
+    batch_pool_check_fork();
+    if (!batch_pool.pool) {
+        batch_pool.pool = POOL_create(nworkers, nworkers);
+        batch_pool.size = (batch_pool.pool ? nworkers : 0);
+    } else if (batch_pool.size < nworkers && POOL_resize(batch_pool.pool, nworkers) == 0) {
+        batch_pool.size = nworkers;
+    }
+    POOL_ctx *pool = batch_pool.pool;
+    ZSTD_pthread_mutex_unlock(&batch_pool_mutex);
+
+    return pool;
+}
+
+/*
+ * Returns an idle context, or NULL.
+ */
+static void *
+batch_checkout(int decode)
+{
+    void *context = NULL;
+
+    ZSTD_pthread_mutex_lock(&batch_pool_mutex);
+    batch_pool_check_fork();
+    if (batch_pool.nidle[decode] > 0) {
+        context = batch_pool.idle[decode][-- batch_pool.nidle[decode]];
+    }
+    ZSTD_pthread_mutex_unlock(&batch_pool_mutex);
+
+    return context;
+}
+
+/*
+ * Keep the context for the next batch, or release it.
+ * The parameters and the dictionary are reset, so the context does not refer
+ * the dictionary object of this batch.
+ * The multithreaded contexts are released, because zstdmt resizes the referred
+ * pool when the number of workers is changed.
+ */
+static void
+batch_checkin(int decode, void *context)
+{
+    if (!context) { return; }
+
+    size_t s;
+    if (decode) {
+        s = ZSTD_DCtx_reset((ZSTD_DCtx *)context, ZSTD_reset_session_and_parameters);
+    } else if (extzstd_cctx_mt_p((ZSTD_CCtx *)context)) {
+        s = (size_t)-ZSTD_error_GENERIC;
+    } else {
+        s = ZSTD_CCtx_reset((ZSTD_CCtx *)context, ZSTD_reset_session_and_parameters);
+    }
+
+    if (!ZSTD_isError(s)) {
+        ZSTD_pthread_mutex_lock(&batch_pool_mutex);
+        batch_pool_check_fork();
+        if (batch_pool.nidle[decode] < EXT_BATCH_IDLE_MAX) {
+            batch_pool.idle[decode][batch_pool.nidle[decode] ++] = context;
+            context = NULL;
+        }
+        ZSTD_pthread_mutex_unlock(&batch_pool_mutex);
+    }
+
+    if (context) {
+        batch_context_free(decode, context);
+    }
+}
+
+#ifdef HAVE_PTHREAD_ATFORK
+static void
+batch_pool_atfork_prepare(void)
+{
+    ZSTD_pthread_mutex_lock(&batch_pool_mutex);
+}
+
+static void
+batch_pool_atfork_parent(void)
+{
+    ZSTD_pthread_mutex_unlock(&batch_pool_mutex);
+}
+
+static void
+batch_pool_atfork_child(void)
+{
+    ZSTD_pthread_mutex_init(&batch_pool_mutex, NULL);
+}
+#endif /* HAVE_PTHREAD_ATFORK */
+
+static void
+batch_mark(void *pp)
+{
+    if (pp) {
+        struct batch *p = (struct batch *)pp;
+        /* pinned, because the pointers are used without the GVL */
+        for (size_t i = 0; i < ELEMENTOF(p->values); i++) {
+            rb_gc_mark(p->values[i]);
+        }
+        if (RB_TYPE_P(p->values[0], RUBY_T_ARRAY)) {
+            for (long i = 0; i < RARRAY_LEN(p->values[0]); i++) {
+                rb_gc_mark(RARRAY_AREF(p->values[0], i));
+            }
+        }
+        for (size_t i = 0; i < p->nitems; i++) {
+            rb_gc_mark(p->items[i].str);
+        }
+    }
+}
+
+static void
+batch_free_items(struct batch *p)
+{
+    if (p->items) {
+        for (size_t i = 0; i < p->nitems; i++) {
+            if (p->items[i].heap) {
+                free(p->items[i].dest);
+            }
+        }
+        xfree(p->items);
+        p->items = NULL;
+        p->nitems = 0;
+    }
+}
+
+/*
+ * Return the contexts of the workers for the next batch.
+ * The workers must be stopped.
+ */
+static void
+batch_release_contexts(struct batch *p)
+{
+    for (size_t i = 0; i < p->nworkers; i++) {
+        batch_checkin(p->decode, p->workers[i].context);
+        p->workers[i].context = NULL;
+    }
+    extzstd_memory_flush();
+}
+
+static void
+batch_free(void *pp)
+{
+    if (pp) {
+        struct batch *p = (struct batch *)pp;
+
+        /*
+         * After fork(2), the worker threads are lost in the middle of the
+         * items, and the contexts and the locks may be in use.
+         * They are left.
+         */
+        int forked = extzstd_forked_p(p->generation);
+
+        if (p->workers) {
+            if (!forked) {
+                batch_release_contexts(p);
+            }
+            xfree(p->workers);
+        }
+
+        batch_free_items(p);
+
+        if (p->sync_ready && !forked) {
+            ZSTD_pthread_mutex_destroy(&p->mutex);
+            ZSTD_pthread_cond_destroy(&p->cond);
+        }
+
+        xfree(p);
+    }
+}
+
+static const rb_data_type_t batch_type = {
+    .wrap_struct_name = "extzstd.batch",
+    .function.dmark = batch_mark,
+    .function.dfree = batch_free,
+};
+
+static VALUE
+batch_new(int decode, size_t nworkers, struct batch **pp)
+{
+    struct batch *p;
+    VALUE obj = TypedData_Make_Struct(0, struct batch, &batch_type, p);
+    p->decode = decode;
+    p->generation = extzstd_fork_generation;
+    for (size_t i = 0; i < ELEMENTOF(p->values); i++) {
+        p->values[i] = Qnil;
+    }
+    p->workers = ZALLOC_N(struct batch_worker, nworkers);
+    p->nworkers = nworkers;
+
+    if (ZSTD_pthread_mutex_init(&p->mutex, NULL) != 0) {
+        rb_sys_fail("pthread_mutex_init");
+    }
+    if (ZSTD_pthread_cond_init(&p->cond, NULL) != 0) {
+        ZSTD_pthread_mutex_destroy(&p->mutex);
+        rb_sys_fail("pthread_cond_init");
+    }
+    p->sync_ready = 1;
+
+    *pp = p;
+    return obj;
+}
+
+static void
+batch_reset_items(struct batch *p, size_t nitems)
+{
+    batch_free_items(p);
+    p->items = ZALLOC_N(struct batch_item, nitems);
+    for (size_t i = 0; i < nitems; i++) {
+        p->items[i].str = Qnil;
+    }
+    p->nitems = nitems;
+    p->next = 0;
+}
+
+static size_t
+batch_decompress_heap(ZSTD_DCtx *dctx, struct batch_item *item)
+{
+    size_t s = ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    if (ZSTD_isError(s)) { return s; }
+
+    ZSTD_inBuffer input = { item->src, item->srcsize, 0 };
+    ZSTD_outBuffer output = { NULL, 0, 0 };
+
+    for (;;) {
+        if (output.pos >= output.size) {
+            size_t capa = (output.size < EXT_BATCH_GROWUP_SIZE ? EXT_BATCH_GROWUP_SIZE : output.size * 2);
+            char *dest = realloc(item->dest, capa);
+            if (!dest) { return (size_t)-ZSTD_error_memory_allocation; }
+            item->dest = dest;
+            item->destcapa = capa;
+            output.dst = dest;
+            output.size = capa;
+        }
+
+        s = ZSTD_decompressStream(dctx, &output, &input);
+        item->destsize = output.pos;
+        if (ZSTD_isError(s)) { return s; }
+
+        if (s == 0 && input.pos >= input.size) {
+            /* ZSTD_decompressStream() does not check the content size for an empty last block */
+            unsigned long long size = ZSTD_findDecompressedSize(item->src, item->srcsize);
+            if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR && size != output.pos) {
+                return (size_t)-ZSTD_error_corruption_detected;
+            }
+            return output.pos;
+        }
+
+        if (output.pos < output.size && input.pos >= input.size) {
+            return (size_t)-ZSTD_error_srcSize_wrong;
+        }
+    }
+}
+
+static void
+batch_process(struct batch *p, void *context, struct batch_item *item)
+{
+    if (p->decode) {
+        if (item->heap) {
+            item->status = batch_decompress_heap((ZSTD_DCtx *)context, item);
+        } else {
+            item->status = ZSTD_decompressDCtx((ZSTD_DCtx *)context,
+                    item->dest, item->destcapa, item->src, item->srcsize);
+        }
+    } else {
+        item->status = ZSTD_compress2((ZSTD_CCtx *)context,
+                item->dest, item->destcapa, item->src, item->srcsize);
+    }
+
+    if (!ZSTD_isError(item->status)) {
+        item->destsize = item->status;
+    }
+}
+
+static void
+batch_work(void *opaque)
+{
+    struct batch_worker *w = (struct batch_worker *)opaque;
+    struct batch *p = w->batch;
+
+    for (;;) {
+        ZSTD_pthread_mutex_lock(&p->mutex);
+        if (p->canceled || p->next >= p->nitems) {
+            ZSTD_pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+        size_t i = p->next ++;
+        ZSTD_pthread_mutex_unlock(&p->mutex);
+
+        batch_process(p, w->context, &p->items[i]);
+    }
+
+    ZSTD_pthread_mutex_lock(&p->mutex);
+    p->running --;
+    if (p->running == 0) {
+        ZSTD_pthread_cond_broadcast(&p->cond);
+    }
+    ZSTD_pthread_mutex_unlock(&p->mutex);
+}
+
+static void *
+batch_join(void *pp)
+{
+    struct batch *p = (struct batch *)pp;
+
+    ZSTD_pthread_mutex_lock(&p->mutex);
+    while (p->running > 0) {
+        ZSTD_pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    ZSTD_pthread_mutex_unlock(&p->mutex);
+
+    return NULL;
+}
+
+/*
+ * POOL_add() may block while the threads are used by another batch,
+ * so the workers are added without the GVL.
+ */
+static void *
+batch_wait_nogvl(void *pp)
+{
+    struct batch *p = (struct batch *)pp;
+
+    for (size_t i = 0; i < p->nworkers && !p->canceled; i++) {
+        ZSTD_pthread_mutex_lock(&p->mutex);
+        p->running ++;
+        ZSTD_pthread_mutex_unlock(&p->mutex);
+        POOL_add(p->pool, batch_work, &p->workers[i]);
+    }
+
+    return batch_join(p);
+}
+
+static void
+batch_cancel(void *pp)
+{
+    struct batch *p = (struct batch *)pp;
+    p->canceled = 1;
+}
+
+static VALUE
+batch_wait(VALUE pp)
+{
+    rb_thread_call_without_gvl(batch_wait_nogvl, (void *)pp, batch_cancel, (void *)pp);
+    return Qnil;
+}
+
+/*
+ * When the waiting is interrupted, the workers stop after the current items.
+ * Wait for them with the GVL, because the batch is freed after that.
+ */
+static VALUE
+batch_stop(VALUE pp)
+{
+    struct batch *p = (struct batch *)pp;
+    p->canceled = 1;
+    batch_join(p);
+    return Qnil;
+}
+
+static void
+batch_run(struct batch *p)
+{
+    if (p->nitems == 0) { return; }
+
+    if (!p->pool) {
+        AUX_TRY_WITH_GC(
+                p->pool = batch_pool_acquire(p->nworkers),
+                "failed POOL_create()");
+    }
+
+    /* retry if interrupted by such as the trap handler without exception */
+    while (p->next < p->nitems) {
+        p->canceled = 0;
+        p->running = 0;
+        rb_ensure(batch_wait, (VALUE)p, batch_stop, (VALUE)p);
+    }
+}
+
+static void
+batch_check_errors(struct batch *p)
+{
+    for (size_t i = 0; i < p->nitems; i++) {
+        struct batch_item *item = &p->items[i];
+        if (ZSTD_isError(item->status)) {
+            rb_exc_raise(extzstd_make_errorf(ZSTD_getErrorCode(item->status),
+                        "%s (batch item %zu)", ZSTD_getErrorName(item->status), i));
+        }
+    }
+}
+
+static VALUE
+batch_results(struct batch *p)
+{
+    batch_check_errors(p);
+
+    VALUE results = rb_ary_new_capa(p->nitems);
+
+    for (size_t i = 0; i < p->nitems; i++) {
+        struct batch_item *item = &p->items[i];
+        VALUE dest;
+        if (item->heap) {
+            dest = rb_str_new(item->dest, item->destsize);
+        } else {
+            dest = item->str;
+            rb_str_set_len(dest, item->destsize);
+            if (item->destsize < item->destcapa) {
+                /* shrink from ZSTD_compressBound() or batch_decode_bound() */
+                rb_str_resize(dest, item->destsize);
+            }
+        }
+        rb_ary_push(results, dest);
+    }
+
+    return results;
+}
+
+static size_t
+batch_nworkers(VALUE threads, size_t nitems)
+{
+    long n;
+    if (NIL_P(threads)) {
+        n = extzstd_cpu_count();
+    } else {
+        n = NUM2LONG(threads);
+        if (n < 1) {
+            rb_raise(rb_eArgError, "threads must be positive (given %ld)", n);
+        }
+    }
+
+    if (n < 1) { n = 1; }
+    if ((size_t)n > nitems) { n = (long)nitems; }
+
+    return (size_t)n;
+}
+
+static void
+batch_get_kwargs(VALUE opts, int decode, VALUE *dict, VALUE *threads, VALUE *level)
+{
+    ID ids[3] = { rb_intern("dict"), rb_intern("threads"), rb_intern("level") };
+    VALUE vals[3] = { Qundef, Qundef, Qundef };
+    rb_get_kwargs(opts, ids, 0, (decode ? 2 : 3), vals);
+    *dict = (vals[0] == Qundef ? Qnil : vals[0]);
+    *threads = (vals[1] == Qundef ? Qnil : vals[1]);
+    *level = (vals[2] == Qundef ? Qnil : vals[2]);
+}
+
+static VALUE
+batch_prepare(VALUE srcs, VALUE opts, int decode, VALUE *level, VALUE *dict, struct batch **pp)
+{
+    VALUE threads;
+    batch_get_kwargs(opts, decode, dict, &threads, level);
+
+    srcs = rb_convert_type(srcs, RUBY_T_ARRAY, "Array", "to_ary");
+    srcs = rb_ary_new_from_values(RARRAY_LEN(srcs), RARRAY_CONST_PTR(srcs));
+    size_t nitems = RARRAY_LEN(srcs);
+    for (size_t i = 0; i < nitems; i++) {
+        VALUE src = RARRAY_AREF(srcs, i);
+        rb_ary_store(srcs, i, rb_str_new_frozen(StringValue(src)));
+    }
+    rb_obj_freeze(srcs);
+
+    VALUE batch = batch_new(decode, batch_nworkers(threads, nitems), pp);
+    struct batch *p = *pp;
+    p->values[0] = srcs;
+
+    batch_reset_items(p, nitems);
+    for (size_t i = 0; i < nitems; i++) {
+        RSTRING_GETMEM(RARRAY_AREF(srcs, i), p->items[i].src, p->items[i].srcsize);
+    }
+
+    return batch;
+}
+
+static void
+batch_setup_cctxs(struct batch *p, VALUE level, VALUE dict)
+{
+    if (!NIL_P(dict) && !extzstd_cdict_p(dict)) {
+        dict = rb_str_new_frozen(StringValue(dict));
+    }
+    p->values[1] = dict;
+
+    int params = extzstd_params_p(level);
+    int clevel = (params ? 0 : aux_num2int(level, ZSTD_CLEVEL_DEFAULT));
+
+    for (size_t i = 0; i < p->nworkers; i++) {
+        ZSTD_CCtx *cctx = (ZSTD_CCtx *)batch_checkout(0);
+        if (!cctx) {
+            AUX_TRY_WITH_GC(
+                    cctx = extzstd_create_cctx(),
+                    "failed ZSTD_createCCtx()");
+        }
+
+        if (params) {
+            extzstd_params_setup_cctx(cctx, extzstd_getparams(level));
+        } else {
+            aux_ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, clevel);
+        }
+        extzstd_threadpool_setup_cctx(cctx, Qnil); /* the default pool is never freed */
+
+        if (extzstd_cdict_p(dict)) {
+            aux_ZSTD_CCtx_refCDict(cctx, extzstd_getcdict(dict));
+        } else if (!NIL_P(dict)) {
+            aux_ZSTD_CCtx_loadDictionary(cctx, RSTRING_PTR(dict), RSTRING_LEN(dict));
+        }
+
+        p->workers[i].batch = p;
+        p->workers[i].context = cctx;
+    }
+}
+
+static void
+batch_setup_dctxs(struct batch *p, VALUE dict)
+{
+    if (!NIL_P(dict) && !extzstd_ddict_p(dict)) {
+        dict = rb_str_new_frozen(StringValue(dict));
+    }
+    p->values[1] = dict;
+
+    for (size_t i = 0; i < p->nworkers; i++) {
+        ZSTD_DCtx *dctx = (ZSTD_DCtx *)batch_checkout(1);
+        if (!dctx) {
+            AUX_TRY_WITH_GC(
+                    dctx = extzstd_create_dctx(),
+                    "failed ZSTD_createDCtx()");
+        }
+
+        size_t s = 0;
+        if (extzstd_ddict_p(dict)) {
+            s = ZSTD_DCtx_refDDict(dctx, extzstd_getddict(dict));
+        } else if (!NIL_P(dict)) {
+            s = ZSTD_DCtx_loadDictionary(dctx, RSTRING_PTR(dict), RSTRING_LEN(dict));
+        }
+
+        if (ZSTD_isError(s)) {
+            ZSTD_freeDCtx(dctx);
+            extzstd_error(s);
+        }
+
+        p->workers[i].batch = p;
+        p->workers[i].context = dctx;
+    }
+}
+
+/*
+ * Returns the decompressed size of src, capped by the bound counted from the
+ * blocks (the content size in the frame header is not trusted).
+ * Returns ZSTD_CONTENTSIZE_ERROR if src is not the complete frames, or the
+ * bound is too large.
+ */
+static unsigned long long
+batch_decode_bound(const char *src, size_t srcsize)
+{
+    if (srcsize == 0) { return ZSTD_CONTENTSIZE_ERROR; }
+
+    unsigned long long bound = extzstd_decompress_block_bound(src, srcsize);
+    if (bound == ZSTD_CONTENTSIZE_ERROR || bound > SIZE_MAX) {
+        return ZSTD_CONTENTSIZE_ERROR;
+    }
+
+    unsigned long long size = ZSTD_findDecompressedSize(src, srcsize);
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR && size < bound) {
+        bound = size;
+    }
+
+    return bound;
+}
+
+/*
+ * call-seq:
+ *  encode_batch(srcs, level: nil, dict: nil, threads: nil) -> array of encoded strings
+ *
+ * Encode each string in srcs as a separate frame, using native worker threads.
+ *
+ * [srcs (array of strings)]
+ * [level: nil (nil, integer or Zstd::Parameters)]
+ * [dict: nil (nil, string or Zstd::Dictionary::Compressor)]
+ * [threads: nil (nil or positive integer)]
+ *   Number of worker threads.
+ *   nil means the number of online processors.
+ */
+static VALUE
+batch_s_encode(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE srcs, opts, level, dict;
+    rb_scan_args(argc, argv, "1:", &srcs, &opts);
+
+    struct batch *p;
+    VALUE batch = batch_prepare(srcs, opts, 0, &level, &dict, &p);
+
+    for (size_t i = 0; i < p->nitems; i++) {
+        struct batch_item *item = &p->items[i];
+        item->destcapa = ZSTD_compressBound(item->srcsize);
+        item->str = rb_str_buf_new(item->destcapa);
+        item->dest = RSTRING_PTR(item->str);
+    }
+
+    batch_setup_cctxs(p, level, dict);
+    batch_run(p);
+    batch_release_contexts(p);
+
+    VALUE results = batch_results(p);
+    RB_GC_GUARD(batch);
+    return results;
+}
+
+/*
+ * call-seq:
+ *  decode_batch(srcs, dict: nil, threads: nil) -> array of decoded strings
+ *
+ * Decode each string in srcs, using native worker threads.
+ *
+ * The destination is allocated once for the decompressed size written in
+ * the frames, or for the bound counted from the blocks (128 KiB each) when it
+ * is unknown. The content size larger than that bound is not trusted.
+ *
+ * [srcs (array of strings)]
+ * [dict: nil (nil, string or Zstd::Dictionary::Decompressor)]
+ * [threads: nil (nil or positive integer)]
+ *   Number of worker threads.
+ *   nil means the number of online processors.
+ */
+static VALUE
+batch_s_decode(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE srcs, opts, level, dict;
+    rb_scan_args(argc, argv, "1:", &srcs, &opts);
+
+    struct batch *p;
+    VALUE batch = batch_prepare(srcs, opts, 1, &level, &dict, &p);
+
+    for (size_t i = 0; i < p->nitems; i++) {
+        struct batch_item *item = &p->items[i];
+        unsigned long long size = batch_decode_bound(item->src, item->srcsize);
+        if (size != ZSTD_CONTENTSIZE_ERROR) {
+            item->destcapa = (size_t)size;
+            item->str = rb_str_buf_new(item->destcapa);
+            item->dest = RSTRING_PTR(item->str);
+        } else {
+            item->heap = 1;
+        }
+    }
+
+    batch_setup_dctxs(p, dict);
+    batch_run(p);
+    batch_release_contexts(p);
+
+    VALUE results = batch_results(p);
+    RB_GC_GUARD(batch);
+    return results;
+}
+
+/*
+ * Decode the complete frames in src by a window, and append to dest.
+ * Returns the consumed size of src.
+ *
+ * Each frame is decoded into own region of dest (batch_decode_bound()), then
+ * the regions are packed in order.
+ *
+ * When a bound is larger than the window, all frames of the window are
+ * decoded into the buffers grown by the workers, and appended to dest.
+ */
+static size_t
+parallel_decode_window(struct batch *p, const char *src, size_t srcsize, int eof, VALUE dest)
+{
+    size_t off = 0, capa = 0, nframes = 0;
+    int heap = 0;
+
+    while (off < srcsize && capa < EXT_PARALLEL_WINDOW_SIZE) {
+        size_t s = ZSTD_findFrameCompressedSize(src + off, srcsize - off);
+        if (ZSTD_isError(s)) {
+            if (!eof && ZSTD_getErrorCode(s) == ZSTD_error_srcSize_wrong) {
+                break; /* need more input */
+            }
+            extzstd_error(s);
+        }
+
+        unsigned long long bound = batch_decode_bound(src + off, s);
+        if (bound == ZSTD_CONTENTSIZE_ERROR || bound > EXT_PARALLEL_WINDOW_SIZE) {
+            heap = 1;
+            bound = EXT_PARALLEL_WINDOW_SIZE; /* estimated for the window */
+        }
+
+        if (nframes > 0 && bound > EXT_PARALLEL_WINDOW_SIZE - capa) {
+            break; /* decoded by the next window */
+        }
+
+        off += s;
+        capa += (size_t)bound;
+        nframes ++;
+    }
+
+    if (nframes == 0) { return 0; }
+
+    batch_reset_items(p, nframes);
+
+    size_t destoff = RSTRING_LEN(dest);
+    char *destp = NULL;
+    if (!heap) {
+        aux_str_modify_expand(dest, destoff + capa);
+        p->values[2] = dest;
+        destp = RSTRING_PTR(dest) + destoff;
+    }
+
+    off = 0;
+    for (size_t i = 0; i < nframes; i++) {
+        struct batch_item *item = &p->items[i];
+        item->src = src + off;
+        item->srcsize = ZSTD_findFrameCompressedSize(item->src, srcsize - off);
+        off += item->srcsize;
+        if (heap) {
+            item->heap = 1;
+        } else {
+            item->dest = destp;
+            item->destcapa = (size_t)batch_decode_bound(item->src, item->srcsize);
+            destp += item->destcapa;
+        }
+    }
+
+    batch_run(p);
+    batch_check_errors(p);
+
+    if (heap) {
+        for (size_t i = 0; i < nframes; i++) {
+            struct batch_item *item = &p->items[i];
+            rb_str_buf_cat(dest, item->dest, item->destsize);
+        }
+        batch_free_items(p);
+
+        return off;
+    }
+
+    destp = RSTRING_PTR(dest) + destoff;
+    for (size_t i = 0; i < nframes; i++) {
+        struct batch_item *item = &p->items[i];
+        if (item->dest != destp) {
+            memmove(destp, item->dest, item->destsize);
+        }
+        destp += item->destsize;
+    }
+    rb_str_set_len(dest, destp - RSTRING_PTR(dest));
+
+    return off;
+}
+
+/*
+ * call-seq:
+ *  decode_parallel(src, outport = nil, dict: nil, threads: nil) -> decoded string
+ *  decode_parallel(src, outport, dict: nil, threads: nil) -> outport
+ *
+ * Decode the concatenated frames in src, using native worker threads.
+ *
+ * The frames are found by ZSTD_findFrameCompressedSize() and decoded
+ * concurrently by a window (about 64 MiB of output), and written in order.
+ * A single frame is decoded by one thread.
+ *
+ * [src (string or io liked object)]
+ *   If src is not a string, it is read by +src.read(size)+.
+ * [outport (nil or io liked object)]
+ *   If given, each window is written by +outport.write(string)+.
+ * [dict: nil (nil, string or Zstd::Dictionary::Decompressor)]
+ * [threads: nil (nil or positive integer)]
+ */
+static VALUE
+parallel_s_decode(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, outport, opts, dict, threads, level;
+    rb_scan_args(argc, argv, "11:", &src, &outport, &opts);
+    batch_get_kwargs(opts, 1, &dict, &threads, &level);
+
+    struct batch *p;
+    VALUE batch = batch_new(1, batch_nworkers(threads, SIZE_MAX), &p);
+    batch_setup_dctxs(p, dict);
+
+    VALUE dest = rb_str_buf_new(0);
+
+    if (RB_TYPE_P(src, RUBY_T_STRING)) {
+        src = rb_str_new_frozen(src);
+        p->values[0] = src;
+        const char *q = RSTRING_PTR(src);
+        size_t qsize = RSTRING_LEN(src);
+        size_t off = 0;
+        while (off < qsize) {
+            off += parallel_decode_window(p, q + off, qsize - off, 1, dest);
+            if (!NIL_P(outport)) {
+                AUX_FUNCALL(outport, id_write, dest);
+                dest = rb_str_buf_new(0);
+            }
+        }
+    } else {
+        VALUE buf = rb_str_buf_new(0);
+        p->values[0] = buf;
+        int eof = 0;
+        while (!eof) {
+            VALUE chunk = AUX_FUNCALL(src, id_read, SIZET2NUM(EXT_PARALLEL_READ_SIZE));
+            if (NIL_P(chunk)) {
+                eof = 1;
+            } else {
+                rb_str_buf_append(buf, StringValue(chunk));
+                if (RSTRING_LEN(buf) < EXT_PARALLEL_READ_SIZE) { continue; }
+            }
+
+            for (;;) {
+                size_t s = parallel_decode_window(p, RSTRING_PTR(buf), RSTRING_LEN(buf), eof, dest);
+                if (s == 0) { break; }
+
+                size_t rest = RSTRING_LEN(buf) - s;
+                memmove(RSTRING_PTR(buf), RSTRING_PTR(buf) + s, rest);
+                rb_str_set_len(buf, rest);
+
+                if (!NIL_P(outport)) {
+                    AUX_FUNCALL(outport, id_write, dest);
+                    dest = rb_str_buf_new(0);
+                }
+            }
+        }
+    }
+
+    batch_release_contexts(p);
+    RB_GC_GUARD(batch);
+
+    return (NIL_P(outport) ? dest : outport);
+}
+
+/*
+ * initialize for extzstd_batch.c
+ */
+
+void
+extzstd_init_batch(void)
+{
+    id_read = rb_intern("read");
+    id_write = rb_intern("write");
+
+    ZSTD_pthread_mutex_init(&batch_pool_mutex, NULL);
+#ifdef HAVE_PTHREAD_ATFORK
+    pthread_atfork(batch_pool_atfork_prepare, batch_pool_atfork_parent, batch_pool_atfork_child);
+#endif
+
+    rb_define_singleton_method(extzstd_mZstd, "encode_batch", batch_s_encode, -1);
+    rb_define_singleton_method(extzstd_mZstd, "decode_batch", batch_s_decode, -1);
+
+    VALUE cDecoder = rb_define_class_under(extzstd_mZstd, "Decoder", rb_cObject);
+    rb_define_singleton_method(cDecoder, "decode_parallel", parallel_s_decode, -1);
+}
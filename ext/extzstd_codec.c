@@ -0,0 +1,647 @@
+#include "extzstd.h"
+#include "extzstd_nogvls.h"
+
+enum {
+    EXT_NOGVL_THRESHOLD = 64 * 1024, /* 64 KiB */
+    EXT_DECODE_GROWUP_SIZE = 256 * 1024, /* 256 KiB */
+    EXT_DECODE_DOUBLE_GROWUP_LIMIT_SIZE = 4 * 1024 * 1024, /* 4 MiB */
+};
+
+/*
+ * class Zstd::Codec
+ */
+
+static VALUE cCodec;
+
+struct codec
+{
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    VALUE params;
+    VALUE predict;
+    VALUE dparams;
+    unsigned int generation;    /* extzstd_fork_generation of the contexts */
+    int busy;
+};
+
+static void
+codec_mark(void *pp)
+{
+    if (pp) {
+        struct codec *p = (struct codec *)pp;
+        rb_gc_mark(p->params);
+        rb_gc_mark(p->predict);
+        rb_gc_mark(p->dparams);
+    }
+}
+
+static void
+codec_free(void *pp)
+{
+    if (pp) {
+        struct codec *p = (struct codec *)pp;
+        if (p->cctx) {
+            if (extzstd_forked_p(p->generation)) {
+                extzstd_discard_cctx(p->cctx);
+            } else {
+                ZSTD_freeCCtx(p->cctx);
+            }
+            p->cctx = NULL;
+        }
+        if (p->dctx) {
+            ZSTD_freeDCtx(p->dctx);
+            p->dctx = NULL;
+        }
+        extzstd_memory_flush();
+        xfree(p);
+    }
+}
+
+static size_t
+codec_memsize(const void *pp)
+{
+    const struct codec *p = (const struct codec *)pp;
+    size_t size = sizeof(*p) + ZSTD_sizeof_DCtx(p->dctx);
+    if (p->cctx && !(extzstd_forked_p(p->generation) && extzstd_cctx_mt_p(p->cctx))) {
+        size += ZSTD_sizeof_CCtx(p->cctx);
+    }
+    return size;
+}
+
+AUX_IMPLEMENT_CONTEXT(
+        struct codec, codec_type, "extzstd.Zstd::Codec",
+        codec_alloc_dummy, codec_mark, codec_free, codec_memsize,
+        getcodecp, getcodec, codec_p);
+
+static VALUE
+codec_alloc(VALUE mod)
+{
+    struct codec *p;
+    VALUE obj = TypedData_Make_Struct(mod, struct codec, &codec_type, p);
+    p->params = Qnil;
+    p->predict = Qnil;
+    p->dparams = Qnil;
+    p->generation = extzstd_fork_generation;
+    return obj;
+}
+
+static void
+codec_check_predict(VALUE predict)
+{
+    if (NIL_P(predict) || extzstd_cdict_p(predict) || extzstd_ddict_p(predict)) {
+        return;
+    }
+
+    rb_check_type(predict, RUBY_T_STRING);
+}
+
+/*
+ * call-seq:
+ *  initialize(compression_parameters = nil, predict = nil, decode_params = nil)
+ *  initialize(compression_parameters = nil, predict = nil, **opts)
+ *
+ * Zstd::Codec keeps a compression context and a decompression context for
+ * one-shot encode/decode. Only the session is reset between calls, so the
+ * contexts (and the loaded dictionary) are not rebuilt for each message.
+ *
+ * Each context is created at the first use.
+ *
+ * A codec can not be used by multiple threads at the same time.
+ *
+ * [compression_parameters = nil (nil, integer or Zstd::Parameters)]
+ * [predict = nil]
+ *   nil, string, Zstd::Dictionary::Compressor, Zstd::Dictionary::Decompressor,
+ *   or array of them.
+ *   A string is used for both of encoding and decoding.
+ * [decode_params = nil (nil or Zstd::DecodeParameters)]
+ * [opts]
+ *   Same as Zstd::DecodeParameters.new (+window_log_max+, +ignore_checksum+,
+ *   +format+, +stable_out_buffer+, ...).
+ */
+static VALUE
+codec_init(int argc, VALUE argv[], VALUE self)
+{
+    VALUE params, predict, dparams, opts;
+    rb_scan_args(argc, argv, "03:", &params, &predict, &dparams, &opts);
+
+    struct codec *p = getcodec(self);
+    if (p->cctx || p->dctx || !NIL_P(p->params) || !NIL_P(p->predict) || !NIL_P(p->dparams)) {
+        reiniterror(self);
+    }
+
+    if (!NIL_P(params) && !extzstd_params_p(params)) {
+        params = INT2NUM(NUM2INT(params));
+    }
+
+    if (!NIL_P(opts)) {
+        if (!NIL_P(dparams)) {
+            rb_raise(rb_eArgError, "decode_params and keyword options are given together");
+        }
+        dparams = opts;
+    }
+    dparams = extzstd_dparams_new(dparams);
+
+    if (RB_TYPE_P(predict, RUBY_T_ARRAY)) {
+        predict = rb_ary_new_from_values(RARRAY_LEN(predict), RARRAY_CONST_PTR(predict));
+        for (long i = 0; i < RARRAY_LEN(predict); i++) {
+            VALUE e = RARRAY_AREF(predict, i);
+            codec_check_predict(e);
+            if (RB_TYPE_P(e, RUBY_T_STRING)) {
+                rb_ary_store(predict, i, rb_str_new_frozen(e));
+            }
+        }
+        rb_obj_freeze(predict);
+    } else {
+        codec_check_predict(predict);
+        if (RB_TYPE_P(predict, RUBY_T_STRING)) {
+            predict = rb_str_new_frozen(predict);
+        }
+    }
+
+    p->params = params;
+    p->predict = predict;
+    p->dparams = dparams;
+
+    return self;
+}
+
+static void
+codec_setup_cctx_dict(ZSTD_CCtx *cctx, VALUE predict)
+{
+    if (extzstd_cdict_p(predict)) {
+        aux_ZSTD_CCtx_refCDict(cctx, extzstd_getcdict(predict));
+    } else if (RB_TYPE_P(predict, RUBY_T_STRING)) {
+        aux_ZSTD_CCtx_loadDictionary(cctx, RSTRING_PTR(predict), RSTRING_LEN(predict));
+    }
+}
+
+static ZSTD_CCtx *
+codec_cctx(struct codec *p)
+{
+    if (!p->cctx) {
+        ZSTD_CCtx *cctx;
+        AUX_TRY_WITH_GC(
+                cctx = extzstd_create_cctx(),
+                "failed ZSTD_createCCtx()");
+
+        if (extzstd_params_p(p->params)) {
+            extzstd_params_setup_cctx(cctx, extzstd_getparams(p->params));
+        } else {
+            aux_ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                    aux_num2int(p->params, ZSTD_CLEVEL_DEFAULT));
+        }
+        extzstd_threadpool_setup_cctx(cctx, Qnil); /* the default pool is never freed */
+
+        if (RB_TYPE_P(p->predict, RUBY_T_ARRAY)) {
+            for (long i = 0; i < RARRAY_LEN(p->predict); i++) {
+                codec_setup_cctx_dict(cctx, RARRAY_AREF(p->predict, i));
+            }
+        } else {
+            codec_setup_cctx_dict(cctx, p->predict);
+        }
+
+        p->cctx = cctx;
+    }
+
+    return p->cctx;
+}
+
+static void
+codec_setup_dctx_dict(ZSTD_DCtx *dctx, VALUE predict)
+{
+    size_t s = 0;
+
+    if (extzstd_ddict_p(predict)) {
+        s = ZSTD_DCtx_refDDict(dctx, extzstd_getddict(predict));
+    } else if (RB_TYPE_P(predict, RUBY_T_STRING)) {
+        s = ZSTD_DCtx_loadDictionary(dctx, RSTRING_PTR(predict), RSTRING_LEN(predict));
+    }
+
+    if (ZSTD_isError(s)) {
+        ZSTD_freeDCtx(dctx);
+        extzstd_error(s);
+    }
+}
+
+static ZSTD_DCtx *
+codec_dctx(struct codec *p)
+{
+    if (!p->dctx) {
+        ZSTD_DCtx *dctx;
+        AUX_TRY_WITH_GC(
+                dctx = extzstd_create_dctx(),
+                "failed ZSTD_createDCtx()");
+        extzstd_dparams_setup_dctx(dctx, p->dparams);
+
+        if (RB_TYPE_P(p->predict, RUBY_T_ARRAY)) {
+            for (long i = 0; i < RARRAY_LEN(p->predict); i++) {
+                codec_setup_dctx_dict(dctx, RARRAY_AREF(p->predict, i));
+            }
+        } else {
+            codec_setup_dctx_dict(dctx, p->predict);
+        }
+
+        p->dctx = dctx;
+    }
+
+    return p->dctx;
+}
+
+static struct codec *
+codec_acquire(VALUE self)
+{
+    struct codec *p = getcodec(self);
+
+    if (extzstd_forked_p(p->generation)) {
+        /* the contexts (and the busy flag) are of the parent process */
+        extzstd_discard_cctx(p->cctx);
+        p->cctx = NULL;
+        if (p->dctx) {
+            ZSTD_freeDCtx(p->dctx);
+            p->dctx = NULL;
+        }
+        p->busy = 0;
+        p->generation = extzstd_fork_generation;
+    }
+
+    if (p->busy) {
+        rb_raise(rb_eRuntimeError,
+                "codec is in use by another thread - #<%s:%p>",
+                rb_obj_classname(self), (void *)self);
+    }
+    return p;
+}
+
+struct codec_args
+{
+    struct codec *codec;
+    int nogvl;
+    VALUE dest;
+    char *destp;
+    size_t destcapa;
+    const char *src;
+    size_t srcsize;
+    ZSTD_outBuffer *output;
+    ZSTD_inBuffer *input;
+    size_t status;
+};
+
+static VALUE
+codec_unlock(VALUE args)
+{
+    struct codec_args *a = (struct codec_args *)args;
+    rb_str_unlocktmp(a->dest);
+    extzstd_memory_flush();
+    return Qnil;
+}
+
+static VALUE
+codec_compress_body(VALUE args)
+{
+    struct codec_args *a = (struct codec_args *)args;
+    if (a->nogvl) {
+        a->status = aux_ZSTD_compress2(a->codec->cctx, a->destp, a->destcapa, a->src, a->srcsize);
+    } else {
+        a->status = ZSTD_compress2(a->codec->cctx, a->destp, a->destcapa, a->src, a->srcsize);
+    }
+    return Qnil;
+}
+
+static VALUE
+codec_decompress_whole_body(VALUE args)
+{
+    struct codec_args *a = (struct codec_args *)args;
+    if (a->nogvl) {
+        a->status = aux_ZSTD_decompressDCtx(a->codec->dctx, a->destp, a->destcapa, a->src, a->srcsize);
+    } else {
+        a->status = ZSTD_decompressDCtx(a->codec->dctx, a->destp, a->destcapa, a->src, a->srcsize);
+    }
+    return Qnil;
+}
+
+static VALUE
+codec_decompress_body(VALUE args)
+{
+    struct codec_args *a = (struct codec_args *)args;
+    if (a->nogvl) {
+        a->status = aux_ZSTD_decompressStream(a->codec->dctx, a->output, a->input);
+    } else {
+        a->status = ZSTD_decompressStream(a->codec->dctx, a->output, a->input);
+    }
+    return Qnil;
+}
+
+/*
+ * Lock the destination string while calling func.
+ *
+ * When a->nogvl is true, func releases the GVL. In this case interrupts can
+ * be raised after func, so the lock is released by rb_ensure().
+ * Otherwise (small data), func is called directly without the extra cost.
+ */
+static size_t
+codec_call(struct codec_args *a, VALUE (*func)(VALUE))
+{
+    rb_str_locktmp(a->dest);
+
+    if (a->nogvl) {
+        rb_ensure(func, (VALUE)a, codec_unlock, (VALUE)a);
+    } else {
+        func((VALUE)a);
+        codec_unlock((VALUE)a);
+    }
+
+    return a->status;
+}
+
+struct codec_method_args
+{
+    struct codec *codec;
+    VALUE src;
+    VALUE maxsize;
+    VALUE dest;
+};
+
+static VALUE
+codec_unbusy(VALUE pp)
+{
+    ((struct codec *)pp)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * Call func(args) with marking the codec as busy.
+ *
+ * The context is reset at the beginning of encode/decode, and the streaming
+ * decode releases the GVL between the steps, so the flag covers the whole
+ * call instead of each step.
+ */
+static VALUE
+codec_run(struct codec *p, VALUE (*func)(VALUE), struct codec_method_args *args)
+{
+    p->busy = 1;
+    return rb_ensure(func, (VALUE)args, codec_unbusy, (VALUE)p);
+}
+
+static VALUE
+codec_encode_body(VALUE margs)
+{
+    struct codec_method_args *m = (struct codec_method_args *)margs;
+    struct codec *p = m->codec;
+    VALUE src = m->src, dest = m->dest;
+
+    codec_cctx(p);
+
+    int nogvl = (RSTRING_LEN(src) >= EXT_NOGVL_THRESHOLD);
+    if (nogvl) {
+        /* the source is referenced without the GVL, so take a frozen (shared) copy */
+        src = rb_str_new_frozen(src);
+    }
+
+    size_t destcapa = ZSTD_compressBound(RSTRING_LEN(src));
+    if (NIL_P(dest)) {
+        dest = rb_str_buf_new(destcapa);
+    } else {
+        rb_check_type(dest, RUBY_T_STRING);
+        aux_str_modify_expand(dest, destcapa);
+    }
+    rb_obj_infect(dest, src);
+
+    struct codec_args args = {
+        .codec = p,
+        .nogvl = nogvl,
+        .dest = dest,
+        .destp = RSTRING_PTR(dest),
+        .destcapa = destcapa,
+        .src = RSTRING_PTR(src),
+        .srcsize = RSTRING_LEN(src),
+    };
+    size_t s = codec_call(&args, codec_compress_body);
+    RB_GC_GUARD(src);
+    extzstd_check_error(s);
+    rb_str_set_len(dest, s);
+
+    return dest;
+}
+
+/*
+ * call-seq:
+ *  encode(src, dest = "".b) -> dest
+ */
+static VALUE
+codec_encode(int argc, VALUE argv[], VALUE self)
+{
+    /*
+     * ZSTDLIB_API size_t ZSTD_compress2( ZSTD_CCtx* cctx,
+     *                                    void* dst, size_t dstCapacity,
+     *                              const void* src, size_t srcSize);
+     */
+
+    VALUE src, dest;
+    rb_scan_args(argc, argv, "11", &src, &dest);
+    rb_check_type(src, RUBY_T_STRING);
+
+    struct codec *p = codec_acquire(self);
+    struct codec_method_args args = { p, src, Qnil, dest };
+    return codec_run(p, codec_encode_body, &args);
+}
+
+static VALUE
+codec_decode_body(VALUE margs)
+{
+    struct codec_method_args *m = (struct codec_method_args *)margs;
+    struct codec *p = m->codec;
+    VALUE src = m->src, maxsize = m->maxsize, dest = m->dest;
+
+    ZSTD_DCtx *dctx = codec_dctx(p);
+    extzstd_check_error(ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only));
+
+    const char *q;
+    size_t qsize;
+    RSTRING_GETMEM(src, q, qsize);
+
+    size_t limit, capa;
+    int whole = 0;
+    unsigned long long expected = ZSTD_CONTENTSIZE_UNKNOWN;
+    if (NIL_P(maxsize)) {
+        /*
+         * ZSTDLIB_API unsigned long long ZSTD_findDecompressedSize(const void* src, size_t srcSize);
+         *
+         * The content size in the header is not trusted; it is accepted only
+         * up to the bound counted from the blocks, which are really in src.
+         */
+
+        unsigned long long total = (qsize > 0 ? ZSTD_findDecompressedSize(q, qsize) : ZSTD_CONTENTSIZE_ERROR);
+        unsigned long long bound = (qsize > 0 ? extzstd_decompress_block_bound(q, qsize) : ZSTD_CONTENTSIZE_ERROR);
+        if (bound > SIZE_MAX) { bound = ZSTD_CONTENTSIZE_ERROR; }
+        limit = SIZE_MAX;
+        if (total != ZSTD_CONTENTSIZE_UNKNOWN && total != ZSTD_CONTENTSIZE_ERROR &&
+                bound != ZSTD_CONTENTSIZE_ERROR && total <= bound) {
+            capa = (size_t)total;
+            whole = 1;
+        } else {
+            if (total != ZSTD_CONTENTSIZE_UNKNOWN && total != ZSTD_CONTENTSIZE_ERROR) {
+                expected = total;
+            }
+
+            capa = (bound == ZSTD_CONTENTSIZE_ERROR ? EXT_DECODE_GROWUP_SIZE : (size_t)bound);
+        }
+    } else {
+        limit = capa = NUM2SIZET(maxsize);
+    }
+
+    int nogvl = (qsize >= EXT_NOGVL_THRESHOLD || capa >= EXT_NOGVL_THRESHOLD);
+    if (nogvl) {
+        src = rb_str_new_frozen(src);
+        RSTRING_GETMEM(src, q, qsize);
+    }
+
+    if (NIL_P(dest)) {
+        dest = rb_str_buf_new(capa);
+    } else {
+        rb_check_type(dest, RUBY_T_STRING);
+        aux_str_modify_expand(dest, capa);
+        rb_str_set_len(dest, 0);
+    }
+    rb_obj_infect(dest, src);
+
+    if (whole) {
+        struct codec_args args = {
+            .codec = p,
+            .nogvl = nogvl,
+            .dest = dest,
+            .destp = RSTRING_PTR(dest),
+            .destcapa = capa,
+            .src = q,
+            .srcsize = qsize,
+        };
+        size_t s = codec_call(&args, codec_decompress_whole_body);
+        RB_GC_GUARD(src);
+        extzstd_check_error(s);
+        rb_str_set_len(dest, s);
+
+        return dest;
+    }
+
+    ZSTD_inBuffer input = { q, qsize, 0 };
+
+    for (;;) {
+        aux_str_modify_expand(dest, capa);
+        ZSTD_outBuffer output = { RSTRING_PTR(dest), capa, RSTRING_LEN(dest) };
+        struct codec_args args = {
+            .codec = p,
+            .nogvl = nogvl,
+            .dest = dest,
+            .output = &output,
+            .input = &input,
+        };
+        size_t s = codec_call(&args, codec_decompress_body);
+        extzstd_check_error(s);
+        rb_str_set_len(dest, output.pos);
+
+        if (s == 0 && input.pos >= input.size) {
+            break;
+        }
+
+        if (output.pos < output.size) {
+            if (input.pos >= input.size) {
+                rb_raise(rb_eRuntimeError,
+                         "unexpected EOF - #<%s:%p>",
+                         rb_obj_classname(src), (void *)src);
+            }
+        } else {
+            if (capa >= limit) {
+                break;
+            } else if (capa > EXT_DECODE_DOUBLE_GROWUP_LIMIT_SIZE) {
+                capa += EXT_DECODE_DOUBLE_GROWUP_LIMIT_SIZE;
+            } else if (capa < EXT_DECODE_GROWUP_SIZE) {
+                capa = EXT_DECODE_GROWUP_SIZE;
+            } else {
+                capa *= 2;
+            }
+
+            if (capa > limit) { capa = limit; }
+        }
+    }
+
+    /* ZSTD_decompressStream() does not check the content size for an empty last block */
+    if (expected != ZSTD_CONTENTSIZE_UNKNOWN && (unsigned long long)RSTRING_LEN(dest) != expected) {
+        extzstd_error(-ZSTD_error_corruption_detected);
+    }
+
+    RB_GC_GUARD(src);
+
+    return dest;
+}
+
+/*
+ * call-seq:
+ *  decode(src, maxsize = nil, dest = "".b) -> dest
+ *
+ * Decode all of frames in src.
+ *
+ * When all frames have the content size, and it is within the bound counted
+ * from the blocks in src (128 KiB each), the destination is allocated once
+ * and decoded directly from the memory of src.
+ * Otherwise it is presized to that bound and grown as needed, so that a
+ * forged frame header can not allocate the huge memory.
+ *
+ * [src (string)]
+ * [maxsize = nil (integer or nil)]
+ *   If given, returns up to maxsize bytes from the beginning of decoded data.
+ * [dest = "".b (string)]
+ */
+static VALUE
+codec_decode(int argc, VALUE argv[], VALUE self)
+{
+    /*
+     * ZSTDLIB_API size_t ZSTD_decompressStream(ZSTD_DStream* zds, ZSTD_outBuffer* output, ZSTD_inBuffer* input);
+     */
+
+    VALUE src, maxsize, dest;
+    rb_scan_args(argc, argv, "12", &src, &maxsize, &dest);
+    rb_check_type(src, RUBY_T_STRING);
+
+    struct codec *p = codec_acquire(self);
+    struct codec_method_args args = { p, src, maxsize, dest };
+    return codec_run(p, codec_decode_body, &args);
+}
+
+static VALUE
+codec_sizeof(VALUE self)
+{
+    /*
+     * ZSTDLIB_API size_t ZSTD_sizeof_CCtx(const ZSTD_CCtx* cctx);
+     * ZSTDLIB_API size_t ZSTD_sizeof_DCtx(const ZSTD_DCtx* dctx);
+     */
+
+    struct codec *p = codec_acquire(self);
+    return SIZET2NUM(ZSTD_sizeof_CCtx(p->cctx) + ZSTD_sizeof_DCtx(p->dctx));
+}
+
+static void
+init_codec(void)
+{
+    cCodec = rb_define_class_under(extzstd_mZstd, "Codec", rb_cObject);
+    rb_define_alloc_func(cCodec, codec_alloc);
+    rb_define_method(cCodec, "initialize", codec_init, -1);
+    rb_define_method(cCodec, "encode", codec_encode, -1);
+    rb_define_method(cCodec, "decode", codec_decode, -1);
+    rb_define_method(cCodec, "sizeof", codec_sizeof, 0);
+    rb_define_alias(cCodec, "compress", "encode");
+    rb_define_alias(cCodec, "decompress", "decode");
+    rb_define_alias(cCodec, "uncompress", "decode");
+
+    (void)codec_alloc_dummy;
+    (void)getcodecp;
+    (void)codec_p;
+}
+
+/*
+ * initialize for extzstd_codec.c
+ */
+
+void
+extzstd_init_codec(void)
+{
+    init_codec();
+}
@@ -0,0 +1,346 @@
+#include "extzstd.h"
+
+/*
+ * class Zstd::ContextPool
+ *
+ * The idle compression/decompression contexts, kept for the next
+ * Zstd::Encoder or Zstd::Decoder with the same parameters and dictionary.
+ *
+ * Each context is keyed by a frozen array of the parameters (the
+ * Zstd::Parameters and Zstd::DecodeParameters are compared by the values)
+ * and the dictionary, and returned by #close after ZSTD_reset_session_only,
+ * so the parameters and the loaded dictionary are kept as is.
+ *
+ * The pool is only touched while holding the GVL, so it can be shared by
+ * the threads.
+ * The contexts of the encoders and the decoders that are not closed are
+ * freed by GC, and not returned to the pool.
+ */
+
+static VALUE cContextPool;
+
+enum {
+    EXT_CONTEXTPOOL_DEFAULT_CAPACITY = 16,
+};
+
+struct contextpool_entry
+{
+    struct contextpool_entry *next;
+    void *context;
+    VALUE key;
+    VALUE thread_pool;          /* Zstd::ThreadPool referred by context, or nil */
+    unsigned int generation;    /* extzstd_fork_generation at made the context */
+    int kind;                   /* EXTZSTD_CONTEXTPOOL_CCTX or EXTZSTD_CONTEXTPOOL_DCTX */
+};
+
+struct contextpool
+{
+    struct contextpool_entry *idle; /* the most recently returned first */
+    size_t size;
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+};
+
+static void
+entry_free(struct contextpool_entry *e)
+{
+    if (e->kind == EXTZSTD_CONTEXTPOOL_CCTX) {
+        if (extzstd_forked_p(e->generation)) {
+            extzstd_discard_cctx((ZSTD_CCtx *)e->context);
+        } else {
+            ZSTD_freeCCtx((ZSTD_CCtx *)e->context);
+        }
+    } else {
+        ZSTD_freeDCtx((ZSTD_DCtx *)e->context);
+    }
+    xfree(e);
+}
+
+static void
+contextpool_clear(struct contextpool *p)
+{
+    struct contextpool_entry *e = p->idle;
+    p->idle = NULL;
+    p->size = 0;
+
+    while (e) {
+        struct contextpool_entry *next = e->next;
+        entry_free(e);
+        e = next;
+    }
+
+    extzstd_memory_flush();
+}
+
+static void
+contextpool_mark(void *pp)
+{
+    struct contextpool *p = (struct contextpool *)pp;
+    for (struct contextpool_entry *e = p->idle; e; e = e->next) {
+        rb_gc_mark(e->key);
+        rb_gc_mark(e->thread_pool);
+    }
+}
+
+static void
+contextpool_free(void *pp)
+{
+    struct contextpool *p = (struct contextpool *)pp;
+    contextpool_clear(p);
+    xfree(p);
+}
+
+static size_t
+contextpool_memsize(const void *pp)
+{
+    const struct contextpool *p = (const struct contextpool *)pp;
+    size_t size = sizeof(*p);
+
+    for (const struct contextpool_entry *e = p->idle; e; e = e->next) {
+        size += sizeof(*e);
+        if (e->kind == EXTZSTD_CONTEXTPOOL_CCTX) {
+            ZSTD_CCtx *ctx = (ZSTD_CCtx *)e->context;
+            if (!(extzstd_forked_p(e->generation) && extzstd_cctx_mt_p(ctx))) {
+                size += ZSTD_sizeof_CCtx(ctx);
+            }
+        } else {
+            size += ZSTD_sizeof_DCtx((ZSTD_DCtx *)e->context);
+        }
+    }
+
+    return size;
+}
+
+static const rb_data_type_t contextpool_type = {
+    .wrap_struct_name = "extzstd.Zstd::ContextPool",
+    .function.dmark = contextpool_mark,
+    .function.dfree = contextpool_free,
+    .function.dsize = contextpool_memsize,
+};
+
+static struct contextpool *
+getcontextpool(VALUE v)
+{
+    return (struct contextpool *)rb_check_typeddata(v, &contextpool_type);
+}
+
+static VALUE
+contextpool_alloc(VALUE mod)
+{
+    struct contextpool *p;
+    VALUE obj = TypedData_Make_Struct(mod, struct contextpool, &contextpool_type, p);
+    p->capacity = EXT_CONTEXTPOOL_DEFAULT_CAPACITY;
+    return obj;
+}
+
+/*
+ * Make the key of the pool from the parameters and the dictionary.
+ * Zstd::Parameters and Zstd::DecodeParameters are converted to the hashes.
+ */
+VALUE
+extzstd_contextpool_key(long argc, const VALUE argv[])
+{
+    VALUE key = rb_ary_new_capa(argc);
+
+    for (long i = 0; i < argc; i++) {
+        VALUE v = argv[i];
+        if (extzstd_params_p(v) || extzstd_dparams_p(v)) {
+            v = rb_obj_freeze(rb_funcall(v, rb_intern("to_h"), 0));
+        }
+        rb_ary_push(key, v);
+    }
+
+    return rb_obj_freeze(key);
+}
+
+/*
+ * Take the idle context of kind for key out of pool.
+ *
+ * Returns NULL if not found (the caller makes a new context), or raises
+ * TypeError if pool is not Zstd::ContextPool.
+ * *thread_pool is set to the Zstd::ThreadPool referred by the context.
+ */
+void *
+extzstd_contextpool_checkout(VALUE pool, int kind, VALUE key, VALUE *thread_pool)
+{
+    struct contextpool *p = getcontextpool(pool);
+
+    for (struct contextpool_entry **ep = &p->idle; *ep; ) {
+        struct contextpool_entry *e = *ep;
+
+        if (extzstd_forked_p(e->generation)) {
+            /* made in the parent process */
+            *ep = e->next;
+            p->size--;
+            entry_free(e);
+            extzstd_memory_flush();
+            continue;
+        }
+
+        if (e->kind == kind && rb_eql(e->key, key)) {
+            *ep = e->next;
+            p->size--;
+            p->hits++;
+
+            void *context = e->context;
+            *thread_pool = e->thread_pool;
+            xfree(e);
+
+            return context;
+        }
+
+        ep = &e->next;
+    }
+
+    p->misses++;
+    *thread_pool = Qnil;
+
+    return NULL;
+}
+
+/*
+ * Return the context to pool, or free it if it can not be reused.
+ * The least recently returned context is freed when pool is full.
+ */
+void
+extzstd_contextpool_checkin(VALUE pool, int kind, VALUE key, void *context, VALUE thread_pool, unsigned int generation)
+{
+    struct contextpool *p = getcontextpool(pool);
+    struct contextpool_entry *e = ALLOC(struct contextpool_entry);
+    e->next = NULL;
+    e->context = context;
+    e->key = key;
+    e->thread_pool = thread_pool;
+    e->generation = generation;
+    e->kind = kind;
+
+    size_t s;
+    if (kind == EXTZSTD_CONTEXTPOOL_CCTX) {
+        s = ZSTD_CCtx_reset((ZSTD_CCtx *)context, ZSTD_reset_session_only);
+    } else {
+        s = ZSTD_DCtx_reset((ZSTD_DCtx *)context, ZSTD_reset_session_only);
+    }
+
+    if (ZSTD_isError(s) || extzstd_forked_p(generation) || p->capacity == 0) {
+        entry_free(e);
+        extzstd_memory_flush();
+        return;
+    }
+
+    e->next = p->idle;
+    p->idle = e;
+    p->size++;
+
+    if (p->size > p->capacity) {
+        struct contextpool_entry **ep = &p->idle;
+        for (size_t i = 0; i < p->capacity; i++) {
+            ep = &(*ep)->next;
+        }
+        e = *ep;
+        *ep = NULL;
+        p->size--;
+        entry_free(e);
+        extzstd_memory_flush();
+    }
+}
+
+/*
+ * call-seq:
+ *  initialize(capacity = 16)
+ *
+ * [capacity = 16 (integer)]
+ *   Maximum number of the idle contexts.
+ *   The least recently returned context is freed when exceeded.
+ */
+static VALUE
+contextpool_init(int argc, VALUE argv[], VALUE self)
+{
+    VALUE capacity;
+    rb_scan_args(argc, argv, "01", &capacity);
+
+    struct contextpool *p = getcontextpool(self);
+    if (!NIL_P(capacity)) {
+        long n = NUM2LONG(capacity);
+        if (n < 0) {
+            rb_raise(rb_eArgError, "capacity must not be negative (given %ld)", n);
+        }
+        p->capacity = (size_t)n;
+    }
+
+    return self;
+}
+
+static VALUE
+contextpool_capacity(VALUE self)
+{
+    return SIZET2NUM(getcontextpool(self)->capacity);
+}
+
+/*
+ * call-seq:
+ *  size -> integer
+ *
+ * Returns the number of the idle contexts.
+ */
+static VALUE
+contextpool_size(VALUE self)
+{
+    return SIZET2NUM(getcontextpool(self)->size);
+}
+
+/*
+ * call-seq:
+ *  hits -> integer
+ *
+ * Returns the number of the encoders and the decoders that reused the idle
+ * context.
+ */
+static VALUE
+contextpool_hits(VALUE self)
+{
+    return SIZET2NUM(getcontextpool(self)->hits);
+}
+
+/*
+ * call-seq:
+ *  misses -> integer
+ *
+ * Returns the number of the encoders and the decoders that made the new
+ * context.
+ */
+static VALUE
+contextpool_misses(VALUE self)
+{
+    return SIZET2NUM(getcontextpool(self)->misses);
+}
+
+/*
+ * call-seq:
+ *  clear -> self
+ *
+ * Free all of the idle contexts.
+ */
+static VALUE
+contextpool_clear_m(VALUE self)
+{
+    contextpool_clear(getcontextpool(self));
+    return self;
+}
+
+/*
+ * initialize for extzstd_contextpool.c
+ */
+
+void
+extzstd_init_contextpool(void)
+{
+    cContextPool = rb_define_class_under(extzstd_mZstd, "ContextPool", rb_cObject);
+    rb_define_alloc_func(cContextPool, contextpool_alloc);
+    rb_define_method(cContextPool, "initialize", contextpool_init, -1);
+    rb_define_method(cContextPool, "capacity", contextpool_capacity, 0);
+    rb_define_method(cContextPool, "size", contextpool_size, 0);
+    rb_define_method(cContextPool, "hits", contextpool_hits, 0);
+    rb_define_method(cContextPool, "misses", contextpool_misses, 0);
+    rb_define_method(cContextPool, "clear", contextpool_clear_m, 0);
+}
@@ -0,0 +1,824 @@
+#include "extzstd.h"
+#include "extzstd_io.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#   ifndef O_CLOEXEC
+#       define O_CLOEXEC 0
+#   endif
+#endif
+
+enum {
+    EXT_COPY_BUFFER_SIZE = 256 * 1024, /* 256 KiB */
+};
+
+static ID id_read, id_op_lsh;
+
+/*
+ * Zstd.copy_stream
+ *
+ * The loop of read -> ZSTD_compressStream2() / ZSTD_decompressStream() ->
+ * write runs in copy_step_nogvl() without the GVL.
+ * It returns to the caller with the GVL only when:
+ *
+ * - an input chunk is read, to check the interrupts (Thread#raise and the
+ *   signals can not break the compression by RUBY_UBF_IO);
+ * - the plain IO can not be used directly (the other objects, or the IO
+ *   has the buffered data), then the port is called by duck typing;
+ * - read(2) or write(2) fails (EAGAIN and EINTR are waited or retried);
+ * - zstd reports an error.
+ */
+
+enum copy_step {
+    COPY_DONE,
+    COPY_CONTINUE,      /* a chunk is read, check the interrupts */
+    COPY_READ,          /* need src.read */
+    COPY_WRITE,         /* need dest << buf */
+    COPY_WAIT_READ,     /* read(2) failed with errno */
+    COPY_WAIT_WRITE,    /* write(2) failed with errno */
+    COPY_ZSTD_ERROR,
+};
+
+struct copy
+{
+    int decode;
+    ZSTD_CCtx *cctx;
+    ZSTD_DCtx *dctx;
+    VALUE src, dest;
+    VALUE thread_pool;  /* Zstd::ThreadPool referred by cctx, or nil */
+    int srcfd, destfd;  /* -1 if can not be used directly */
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t outoff;      /* out.dst[outoff ... out.pos] is not written yet */
+    size_t status;      /* the last returned value of zstd */
+    int eof;            /* src reached end of file */
+    int finished;       /* all data is in out */
+    int error;          /* errno */
+    uint64_t readsize, writesize;
+};
+
+static int
+copy_read_fd(struct copy *p)
+{
+#ifdef EXTZSTD_USE_FD
+    ssize_t n = read(p->srcfd, (char *)p->in.src, EXT_COPY_BUFFER_SIZE);
+    if (n < 0) {
+        p->error = errno;
+        return -1;
+    }
+
+    p->in.size = n;
+    p->in.pos = 0;
+    p->readsize += n;
+    if (n == 0) { p->eof = 1; }
+
+    return 0;
+#else
+    p->error = ENOSYS;
+    return -1;
+#endif
+}
+
+static int
+copy_write_fd(struct copy *p)
+{
+#ifdef EXTZSTD_USE_FD
+    ssize_t n = write(p->destfd, (char *)p->out.dst + p->outoff, p->out.pos - p->outoff);
+    if (n < 0) {
+        p->error = errno;
+        return -1;
+    }
+
+    p->outoff += n;
+    p->writesize += n;
+
+    return 0;
+#else
+    p->error = ENOSYS;
+    return -1;
+#endif
+}
+
+static enum copy_step
+copy_step_nogvl_0(struct copy *p)
+{
+    for (;;) {
+        if (p->outoff < p->out.pos && (p->out.pos == p->out.size || p->finished)) {
+            if (p->destfd < 0) { return COPY_WRITE; }
+            if (copy_write_fd(p) < 0) { return COPY_WAIT_WRITE; }
+            continue;
+        }
+
+        if (p->outoff == p->out.pos) {
+            p->out.pos = p->outoff = 0;
+        }
+
+        if (p->finished) {
+            return COPY_DONE;
+        }
+
+        if (p->decode) {
+            /* the decoder may keep the output, so call again while it fills out */
+            if (p->in.pos == p->in.size && p->out.pos < p->out.size) {
+                if (p->eof) {
+                    if (p->status != 0) {
+                        p->status = (size_t)-ZSTD_error_srcSize_wrong;
+                        return COPY_ZSTD_ERROR;
+                    }
+                    p->finished = 1;
+                    continue;
+                }
+
+                if (p->srcfd < 0) { return COPY_READ; }
+                if (copy_read_fd(p) < 0) { return COPY_WAIT_READ; }
+                return COPY_CONTINUE;
+            }
+
+            size_t s = ZSTD_decompressStream(p->dctx, &p->out, &p->in);
+            if (ZSTD_isError(s)) {
+                p->status = s;
+                return COPY_ZSTD_ERROR;
+            }
+            p->status = s;
+        } else {
+            if (p->in.pos == p->in.size && !p->eof) {
+                if (p->srcfd < 0) { return COPY_READ; }
+                if (copy_read_fd(p) < 0) { return COPY_WAIT_READ; }
+                return COPY_CONTINUE;
+            }
+
+            size_t s = ZSTD_compressStream2(p->cctx, &p->out, &p->in,
+                    (p->eof ? ZSTD_e_end : ZSTD_e_continue));
+            if (ZSTD_isError(s)) {
+                p->status = s;
+                return COPY_ZSTD_ERROR;
+            }
+            p->status = s;
+            if (p->eof && s == 0) {
+                p->finished = 1;
+            }
+        }
+    }
+}
+
+struct copy_step_args
+{
+    struct copy *copy;
+    enum copy_step step;
+};
+
+static void *
+copy_step_nogvl(void *pp)
+{
+    struct copy_step_args *a = (struct copy_step_args *)pp;
+    a->step = copy_step_nogvl_0(a->copy);
+    return NULL;
+}
+
+static void
+copy_read_funcall(struct copy *p)
+{
+    VALUE buf = rb_str_buf_new(0);
+    VALUE st = AUX_FUNCALL(p->src, id_read, INT2FIX(EXT_COPY_BUFFER_SIZE), buf);
+    if (NIL_P(st)) {
+        p->eof = 1;
+        p->in.size = p->in.pos = 0;
+        return;
+    }
+
+    rb_check_type(st, RUBY_T_STRING);
+    size_t n = RSTRING_LEN(st);
+    if (n > EXT_COPY_BUFFER_SIZE) {
+        rb_raise(rb_eRuntimeError,
+                 "read too much data (expected up to %d, but given %"PRIuSIZE")",
+                 EXT_COPY_BUFFER_SIZE, n);
+    }
+    memcpy((char *)p->in.src, RSTRING_PTR(st), n);
+    p->in.size = n;
+    p->in.pos = 0;
+    p->readsize += n;
+    if (n == 0) { p->eof = 1; }
+}
+
+static void
+copy_write_funcall(struct copy *p)
+{
+    size_t n = p->out.pos - p->outoff;
+    VALUE buf = rb_str_new((char *)p->out.dst + p->outoff, n);
+    AUX_FUNCALL(p->dest, id_op_lsh, buf);
+    p->outoff += n;
+    p->writesize += n;
+}
+
+static VALUE
+copy_run(VALUE pp)
+{
+    struct copy *p = (struct copy *)pp;
+    int srcfd = p->srcfd;
+
+    if (p->destfd >= 0) {
+        /* keep the order with the data written from ruby */
+        rb_io_flush(p->dest);
+    }
+
+    for (;;) {
+        /* the buffered data of the IO is read by ruby */
+        p->srcfd = (srcfd >= 0 && !aux_io_read_pending(p->src)) ? aux_io_fd(p->src) : -1;
+        if (p->destfd >= 0) { p->destfd = aux_io_fd(p->dest); }
+
+        struct copy_step_args args = { p, COPY_DONE };
+        rb_thread_call_without_gvl(copy_step_nogvl, &args, RUBY_UBF_IO, NULL);
+
+        switch (args.step) {
+        case COPY_DONE:
+            return Qnil;
+        case COPY_CONTINUE:
+            break;
+        case COPY_READ:
+            copy_read_funcall(p);
+            break;
+        case COPY_WRITE:
+            copy_write_funcall(p);
+            break;
+#ifdef EXTZSTD_USE_FD
+        case COPY_WAIT_READ:
+            if (!rb_io_maybe_wait_readable(p->error, p->src, Qnil)) {
+                rb_syserr_fail(p->error, NULL);
+            }
+            break;
+        case COPY_WAIT_WRITE:
+            if (!rb_io_maybe_wait_writable(p->error, p->dest, Qnil)) {
+                rb_syserr_fail(p->error, NULL);
+            }
+            break;
+#endif
+        case COPY_ZSTD_ERROR:
+            extzstd_error(p->status);
+        default:
+            rb_syserr_fail(p->error, NULL);
+        }
+
+        /* for Thread#raise, Thread#kill and the signal handlers */
+        rb_thread_check_ints();
+    }
+}
+
+static VALUE
+copy_cleanup(VALUE pp)
+{
+    struct copy *p = (struct copy *)pp;
+    if (p->cctx) { ZSTD_freeCCtx(p->cctx); }
+    if (p->dctx) { ZSTD_freeDCtx(p->dctx); }
+    extzstd_memory_flush();
+    xfree((void *)p->in.src);
+    xfree(p->out.dst);
+    return Qnil;
+}
+
+static void
+copy_setup_cctx(struct copy *p, VALUE level, VALUE dict, VALUE opts)
+{
+    AUX_TRY_WITH_GC(
+            p->cctx = extzstd_create_cctx(),
+            "failed ZSTD_createCCtx()");
+
+    ZSTD_CCtx *cctx = p->cctx;
+    p->cctx = NULL; /* the aux_ZSTD_* functions free cctx on error */
+
+    if (extzstd_params_p(level)) {
+        extzstd_params_setup_cctx(cctx, extzstd_getparams(level));
+    } else {
+        aux_ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                aux_num2int(level, ZSTD_CLEVEL_DEFAULT));
+    }
+    p->thread_pool = extzstd_mtopts_setup_cctx(cctx, opts);
+
+    if (extzstd_cdict_p(dict)) {
+        aux_ZSTD_CCtx_refCDict(cctx, extzstd_getcdict(dict));
+    } else if (!NIL_P(dict)) {
+        aux_ZSTD_CCtx_loadDictionary(cctx, RSTRING_PTR(dict), RSTRING_LEN(dict));
+    }
+
+    p->cctx = cctx;
+}
+
+static void
+copy_setup_dctx(struct copy *p, VALUE dict, VALUE dparams)
+{
+    AUX_TRY_WITH_GC(
+            p->dctx = extzstd_create_dctx(),
+            "failed ZSTD_createDCtx()");
+
+    ZSTD_DCtx *dctx = p->dctx;
+    p->dctx = NULL; /* extzstd_dparams_setup_dctx() frees dctx on error */
+    extzstd_dparams_setup_dctx(dctx, dparams);
+    p->dctx = dctx;
+
+    size_t s = 0;
+    if (extzstd_ddict_p(dict)) {
+        s = ZSTD_DCtx_refDDict(dctx, extzstd_getddict(dict));
+    } else if (!NIL_P(dict)) {
+        s = ZSTD_DCtx_loadDictionary(dctx, RSTRING_PTR(dict), RSTRING_LEN(dict));
+    }
+    extzstd_check_error(s);
+}
+
+/*
+ * Parse the keyword options of Zstd.copy_stream, Zstd.compress_file and
+ * Zstd.decompress_file. When *decode is negative, it is taken from +mode:+.
+ */
+static void
+copy_get_opts(VALUE opts, int *decode, VALUE *level, VALUE *dict, VALUE *zopts)
+{
+    enum { o_mode, o_dict, o_level, o_workers, o_job_size, o_overlap_log, o_thread_pool, numopts };
+    ID ids[numopts] = {
+        rb_intern("mode"), rb_intern("dict"), rb_intern("level"),
+        rb_intern("workers"), rb_intern("job_size"), rb_intern("overlap_log"),
+        rb_intern("thread_pool"),
+    };
+    VALUE v[numopts] = { Qundef, Qundef, Qundef, Qundef, Qundef, Qundef, Qundef };
+
+    opts = (NIL_P(opts) ? rb_hash_new() : rb_hash_dup(opts));
+    if (*decode < 0) {
+        rb_get_kwargs(opts, ids, 0, -1 - 2, v);
+
+        if (v[o_mode] == Qundef || NIL_P(v[o_mode]) || v[o_mode] == ID2SYM(rb_intern("compress"))) {
+            *decode = 0;
+        } else if (v[o_mode] == ID2SYM(rb_intern("decompress"))) {
+            *decode = 1;
+        } else {
+            rb_raise(rb_eArgError,
+                     "wrong mode - %" PRIsVALUE " (expected :compress or :decompress)",
+                     rb_inspect(v[o_mode]));
+        }
+    } else {
+        rb_get_kwargs(opts, ids + o_dict, 0, -1 - 1, v + o_dict);
+    }
+
+    *dict = (v[o_dict] == Qundef ? Qnil : v[o_dict]);
+    *level = Qnil;
+    if (*decode) {
+        if (!NIL_P(*dict) && !extzstd_ddict_p(*dict)) {
+            *dict = rb_str_new_frozen(StringValue(*dict));
+        }
+        *zopts = extzstd_dparams_new(RHASH_SIZE(opts) == 0 ? Qnil : opts);
+    } else {
+        if (!NIL_P(*dict) && !extzstd_cdict_p(*dict)) {
+            *dict = rb_str_new_frozen(StringValue(*dict));
+        }
+        rb_get_kwargs(opts, ids + o_level, 0, numopts - o_level, v + o_level);
+        *level = (v[o_level] == Qundef ? Qnil : v[o_level]);
+        *zopts = rb_hash_new();
+        for (int i = o_workers; i < numopts; i++) {
+            if (v[i] != Qundef) { rb_hash_aset(*zopts, ID2SYM(ids[i]), v[i]); }
+        }
+    }
+}
+
+struct copy_setup_args
+{
+    struct copy *copy;
+    VALUE level, dict, opts;
+    VALUE (*run)(VALUE arg);
+    VALUE arg;
+};
+
+static VALUE
+copy_setup_run(VALUE args)
+{
+    struct copy_setup_args *a = (struct copy_setup_args *)args;
+    struct copy *p = a->copy;
+
+    if (p->decode) {
+        copy_setup_dctx(p, a->dict, a->opts);
+    } else {
+        copy_setup_cctx(p, a->level, a->dict, a->opts);
+    }
+
+    p->in.src = ALLOC_N(char, EXT_COPY_BUFFER_SIZE);
+    p->out.dst = ALLOC_N(char, EXT_COPY_BUFFER_SIZE);
+    p->out.size = EXT_COPY_BUFFER_SIZE;
+
+    return a->run(a->arg);
+}
+
+/*
+ * call-seq:
+ *  copy_stream(src, dest, mode: :compress, level: nil, dict: nil, workers: nil, job_size: nil, overlap_log: nil, thread_pool: nil) -> [read_size, written_size]
+ *  copy_stream(src, dest, mode: :decompress, dict: nil, **decode_opts) -> [read_size, written_size]
+ *
+ * Compress or decompress all data from src into dest, like IO.copy_stream.
+ *
+ * When src and dest are the plain IO (or File) instances, the whole loop of
+ * read(2), ZSTD_compressStream2() or ZSTD_decompressStream() and write(2)
+ * runs in native code without the GVL, using the fixed buffers.
+ * No ruby objects are made for each chunk. The GVL is taken only to check
+ * the interrupts once per read chunk (256 KiB).
+ *
+ * Other objects are used by duck typing (<tt>src.read(size, buf)</tt> and
+ * <tt>dest << string</tt>).
+ *
+ * Returns the read size from src and the written size to dest.
+ *
+ * [src (io liked object)]
+ * [dest (io liked object)]
+ * [mode: :compress (:compress or :decompress)]
+ * [level: nil (nil, integer or Zstd::Parameters)]
+ *   Compression only.
+ * [dict: nil (nil, string, Zstd::Dictionary::Compressor or Zstd::Dictionary::Decompressor)]
+ * [workers: nil, job_size: nil, overlap_log: nil, thread_pool: nil]
+ *   Compression only.
+ *   The multithreaded compression of the bundled zstd.
+ *   See Zstd::Encoder#initialize for +thread_pool+.
+ * [decode_opts]
+ *   Decompression only.
+ *   Same as Zstd::DecodeParameters.new
+ *   (+window_log_max+, +ignore_checksum+, +format+, ...).
+ */
+static VALUE
+copy_s_copy_stream(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, dest, opts;
+    rb_scan_args(argc, argv, "2:", &src, &dest, &opts);
+
+    int decode = -1;
+    VALUE level, dict;
+    copy_get_opts(opts, &decode, &level, &dict, &opts);
+
+    struct copy copy = { 0 };
+    struct copy *p = &copy;
+    p->decode = decode;
+    p->src = src;
+    p->dest = dest;
+    p->srcfd = (aux_io_readable_fd_p(src) ? 0 : -1);
+    p->destfd = (aux_io_writable_fd_p(dest) ? 0 : -1);
+
+    struct copy_setup_args args = { p, level, dict, opts, copy_run, (VALUE)p };
+    rb_ensure(copy_setup_run, (VALUE)&args, copy_cleanup, (VALUE)p);
+
+    RB_GC_GUARD(dict);
+    RB_GC_GUARD(opts);
+
+    return rb_assoc_new(ULL2NUM(p->readsize), ULL2NUM(p->writesize));
+}
+
+#ifdef HAVE_SYS_MMAN_H
+
+/*
+ * Zstd.compress_file / Zstd.decompress_file
+ *
+ * The source file is mapped, and compressed by ZSTD_compress2() or
+ * decompressed by ZSTD_decompressDCtx() into the mapped destination file,
+ * in one native call without the GVL.
+ *
+ * The destination of compression is mapped by ZSTD_compressBound(), and
+ * truncated to the actual size after.
+ * When the decompressed size is not written in the frame headers (or it is
+ * larger than extzstd_decompress_block_bound()), the decompressed data is
+ * written by ZSTD_decompressStream() and write(2) through p->out.
+ */
+
+struct copy_file
+{
+    struct copy *copy;
+    const char *srcpath, *destpath;
+    const char *errpath;    /* the path of failed system call */
+};
+
+static void *
+copy_file_map(int fd, size_t size, int prot)
+{
+    void *ptr = mmap(NULL, size, prot, ((prot & PROT_WRITE) ? MAP_SHARED : MAP_PRIVATE), fd, 0);
+    return (ptr == MAP_FAILED ? NULL : ptr);
+}
+
+static int
+copy_file_syserr(struct copy_file *f, const char *path)
+{
+    f->copy->error = errno;
+    f->errpath = path;
+    return -1;
+}
+
+static int
+copy_file_zstderr(struct copy_file *f, int destfd, size_t status)
+{
+    f->copy->status = status;
+    if (ftruncate(destfd, 0) != 0) { /* ignore */ }
+    return -1;
+}
+
+static int
+copy_file_write(struct copy_file *f, int destfd, const char *buf, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(destfd, buf, size);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return copy_file_syserr(f, f->destpath);
+        }
+        buf += n;
+        size -= n;
+        f->copy->writesize += n;
+    }
+
+    return 0;
+}
+
+/*
+ * Map destfd by size, and compress or decompress src into it at once.
+ */
+static int
+copy_file_oneshot(struct copy_file *f, int destfd, size_t size, const char *src, size_t srcsize)
+{
+    struct copy *p = f->copy;
+
+    if (ftruncate(destfd, (off_t)size) != 0) {
+        return copy_file_syserr(f, f->destpath);
+    }
+
+    if (size == 0) {
+        /* the frames of empty content (compression never gives 0) */
+        p->readsize = srcsize;
+        return 0;
+    }
+
+    void *dest = copy_file_map(destfd, size, PROT_READ | PROT_WRITE);
+    if (!dest) {
+        return copy_file_syserr(f, f->destpath);
+    }
+
+    size_t s;
+    if (p->decode) {
+        s = ZSTD_decompressDCtx(p->dctx, dest, size, src, srcsize);
+        if (!ZSTD_isError(s) && s != size) {
+            s = (size_t)-ZSTD_error_corruption_detected;
+        }
+    } else {
+        s = ZSTD_compress2(p->cctx, dest, size, src, srcsize);
+    }
+    munmap(dest, size);
+
+    if (ZSTD_isError(s)) {
+        return copy_file_zstderr(f, destfd, s);
+    }
+
+    if (!p->decode && ftruncate(destfd, (off_t)s) != 0) {
+        return copy_file_syserr(f, f->destpath);
+    }
+
+    p->readsize = srcsize;
+    p->writesize = s;
+
+    return 0;
+}
+
+static int
+copy_file_decompress_stream(struct copy_file *f, int destfd, const char *src, size_t srcsize)
+{
+    struct copy *p = f->copy;
+    ZSTD_inBuffer in = { src, srcsize, 0 };
+    size_t s;
+
+    do {
+        p->out.pos = 0;
+        s = ZSTD_decompressStream(p->dctx, &p->out, &in);
+        if (ZSTD_isError(s)) {
+            return copy_file_zstderr(f, destfd, s);
+        }
+        if (copy_file_write(f, destfd, p->out.dst, p->out.pos) != 0) {
+            return -1;
+        }
+    } while (in.pos < in.size || p->out.pos == p->out.size);
+
+    if (s != 0) {
+        return copy_file_zstderr(f, destfd, (size_t)-ZSTD_error_srcSize_wrong);
+    }
+
+    /* ZSTD_decompressStream() does not check the content size for an empty last block */
+    unsigned long long size = ZSTD_findDecompressedSize(src, srcsize);
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR && size != p->writesize) {
+        return copy_file_zstderr(f, destfd, (size_t)-ZSTD_error_corruption_detected);
+    }
+
+    p->readsize = srcsize;
+
+    return 0;
+}
+
+static int
+copy_file_process(struct copy_file *f, int destfd, const char *src, size_t srcsize)
+{
+    if (!f->copy->decode) {
+        return copy_file_oneshot(f, destfd, ZSTD_compressBound(srcsize), src, srcsize);
+    }
+
+    /*
+     * The content size in the frame headers is trusted only up to the bound
+     * counted from the blocks, so a forged header can not make the huge
+     * destination file.
+     */
+    unsigned long long size = (srcsize > 0 ? ZSTD_findDecompressedSize(src, srcsize) : 0);
+    unsigned long long bound = (srcsize > 0 ? extzstd_decompress_block_bound(src, srcsize) : 0);
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN && size != ZSTD_CONTENTSIZE_ERROR &&
+            bound != ZSTD_CONTENTSIZE_ERROR && size <= bound && size <= SIZE_MAX) {
+        return copy_file_oneshot(f, destfd, (size_t)size, src, srcsize);
+    } else {
+        /* the errors are reported by ZSTD_decompressStream() */
+        return copy_file_decompress_stream(f, destfd, src, srcsize);
+    }
+}
+
+static void *
+copy_file_nogvl(void *pp)
+{
+    struct copy_file *f = (struct copy_file *)pp;
+    int srcfd = -1, destfd = -1;
+    void *src = NULL;
+    size_t srcsize = 0;
+    struct stat st;
+
+    /*
+     * O_NONBLOCK: opening a FIFO must not block without the GVL (and the
+     * ubf), and it is rejected below. No effect for the regular files.
+     */
+    srcfd = open(f->srcpath, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (srcfd < 0 || fstat(srcfd, &st) != 0) {
+        copy_file_syserr(f, f->srcpath);
+        goto end;
+    }
+
+    /* st_size of FIFOs, devices and /proc files is not the content size */
+    if (!S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        copy_file_syserr(f, f->srcpath);
+        goto end;
+    }
+
+    if ((uint64_t)st.st_size > SIZE_MAX) {
+        errno = EFBIG;
+        copy_file_syserr(f, f->srcpath);
+        goto end;
+    }
+
+    srcsize = (size_t)st.st_size;
+    if (srcsize > 0) {
+        src = copy_file_map(srcfd, srcsize, PROT_READ);
+        if (!src) {
+            copy_file_syserr(f, f->srcpath);
+            goto end;
+        }
+#ifdef MADV_SEQUENTIAL
+        madvise(src, srcsize, MADV_SEQUENTIAL);
+#endif
+    }
+
+    /* not truncated before checking that dest is not src (the same path, a symlink or a hard link) */
+    destfd = open(f->destpath, O_RDWR | O_CREAT | O_CLOEXEC | O_NONBLOCK, 0666);
+    struct stat destst;
+    if (destfd < 0 || fstat(destfd, &destst) != 0) {
+        copy_file_syserr(f, f->destpath);
+        goto end;
+    }
+
+    if (!S_ISREG(destst.st_mode) ||
+            (destst.st_dev == st.st_dev && destst.st_ino == st.st_ino)) {
+        errno = EINVAL;
+        copy_file_syserr(f, f->destpath);
+        goto end;
+    }
+
+    if (ftruncate(destfd, 0) != 0) {
+        copy_file_syserr(f, f->destpath);
+        goto end;
+    }
+
+    copy_file_process(f, destfd, (src ? (const char *)src : ""), srcsize);
+
+end:
+    if (src) { munmap(src, srcsize); }
+    if (destfd >= 0) { close(destfd); }
+    if (srcfd >= 0) { close(srcfd); }
+
+    return NULL;
+}
+
+static VALUE
+copy_file_run(VALUE pp)
+{
+    struct copy_file *f = (struct copy_file *)pp;
+
+    /* can not be interrupted until done, same as ZSTD_compress2() in Zstd::Codec */
+    rb_thread_call_without_gvl(copy_file_nogvl, f, NULL, NULL);
+
+    if (f->copy->error) {
+        rb_syserr_fail(f->copy->error, f->errpath);
+    }
+
+    if (ZSTD_isError(f->copy->status)) {
+        extzstd_error(f->copy->status);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+copy_file(int argc, VALUE argv[], int decode)
+{
+    VALUE src, dest, opts;
+    rb_scan_args(argc, argv, "2:", &src, &dest, &opts);
+
+    VALUE level, dict;
+    copy_get_opts(opts, &decode, &level, &dict, &opts);
+
+    /* referenced without the GVL */
+    src = rb_str_new_frozen(rb_str_encode_ospath(FilePathValue(src)));
+    dest = rb_str_new_frozen(rb_str_encode_ospath(FilePathValue(dest)));
+
+    struct copy copy = { 0 };
+    struct copy *p = &copy;
+    p->decode = decode;
+    p->src = src;
+    p->dest = dest;
+    p->srcfd = p->destfd = -1;
+
+    struct copy_file f = { p, StringValueCStr(src), StringValueCStr(dest), NULL };
+    struct copy_setup_args args = { p, level, dict, opts, copy_file_run, (VALUE)&f };
+    rb_ensure(copy_setup_run, (VALUE)&args, copy_cleanup, (VALUE)p);
+
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(dest);
+    RB_GC_GUARD(dict);
+    RB_GC_GUARD(opts);
+
+    return rb_assoc_new(ULL2NUM(p->readsize), ULL2NUM(p->writesize));
+}
+
+/*
+ * call-seq:
+ *  compress_file(src_path, dest_path, level: nil, dict: nil, workers: nil, job_size: nil, overlap_log: nil, thread_pool: nil) -> [read_size, written_size]
+ *
+ * Compress the regular file at src_path into dest_path as one frame.
+ * When either path is not a regular file (such as a FIFO or a device), or
+ * dest_path is the same file as src_path, Errno::EINVAL is raised and the
+ * file is not modified. Use Zstd.copy_stream for them.
+ *
+ * Both files are mapped to the memory, and ZSTD_compress2() runs over them
+ * without the GVL. It can not be interrupted until done.
+ *
+ * The options are same as Zstd.copy_stream.
+ */
+static VALUE
+copy_s_compress_file(int argc, VALUE argv[], VALUE mod)
+{
+    return copy_file(argc, argv, 0);
+}
+
+/*
+ * call-seq:
+ *  decompress_file(src_path, dest_path, dict: nil, **decode_opts) -> [read_size, written_size]
+ *
+ * Decompress the regular file at src_path into dest_path.
+ * When either path is not a regular file (such as a FIFO or a device), or
+ * dest_path is the same file as src_path, Errno::EINVAL is raised and the
+ * file is not modified. Use Zstd.copy_stream for them.
+ *
+ * src_path is mapped to the memory. When the decompressed size is written
+ * in all frame headers (and it is within the bound of the blocks in the
+ * frames, 128 KiB each), dest_path is also mapped by that size and
+ * ZSTD_decompressDCtx() runs over them without the GVL. Otherwise the
+ * decompressed data is written by ZSTD_decompressStream() and write(2).
+ * It can not be interrupted until done.
+ *
+ * The options are same as Zstd.copy_stream.
+ */
+static VALUE
+copy_s_decompress_file(int argc, VALUE argv[], VALUE mod)
+{
+    return copy_file(argc, argv, 1);
+}
+
+#endif /* HAVE_SYS_MMAN_H */
+
+/*
+ * initialize for extzstd_copy.c
+ */
+
+void
+extzstd_init_copy(void)
+{
+    id_read = rb_intern("read");
+    id_op_lsh = rb_intern("<<");
+
+    rb_define_singleton_method(extzstd_mZstd, "copy_stream", copy_s_copy_stream, -1);
+#ifdef HAVE_SYS_MMAN_H
+    rb_define_singleton_method(extzstd_mZstd, "compress_file", copy_s_compress_file, -1);
+    rb_define_singleton_method(extzstd_mZstd, "decompress_file", copy_s_decompress_file, -1);
+#else
+    rb_define_singleton_method(extzstd_mZstd, "compress_file", rb_f_notimplement, -1);
+    rb_define_singleton_method(extzstd_mZstd, "decompress_file", rb_f_notimplement, -1);
+#endif
+}
@@ -0,0 +1,228 @@
+#include "extzstd.h"
+
+/*
+ * class Zstd::Dictionary::Compressor
+ */
+
+static VALUE cCDict;
+
+static void
+cdict_free(void *pp)
+{
+    if (pp) {
+        ZSTD_freeCDict((ZSTD_CDict *)pp);
+    }
+}
+
+static size_t
+cdict_size(const void *pp)
+{
+    return (pp ? ZSTD_sizeof_CDict((const ZSTD_CDict *)pp) : 0);
+}
+
+/*
+ * The digested dictionary is only read by the contexts after initialize,
+ * so the frozen instance is shareable between Ractors.
+ */
+AUX_IMPLEMENT_CONTEXT_FLAGS(
+        ZSTD_CDict, cdict_type, "extzstd.Zstd::Dictionary::Compressor",
+        cdict_alloc, NULL, cdict_free, cdict_size, AUX_FROZEN_SHAREABLE,
+        getcdictp, getcdict, cdict_p);
+
+int
+extzstd_cdict_p(VALUE v)
+{
+    return cdict_p(v);
+}
+
+ZSTD_CDict *
+extzstd_getcdict(VALUE v)
+{
+    return getcdict(v);
+}
+
+/*
+ * call-seq:
+ *  initialize(dict, compression_parameters = nil)
+ *
+ * Digest the dictionary for compression.
+ *
+ * The digested dictionary can be shared by many Zstd::Encoder instances and
+ * Zstd.encode calls, instead of rebuilding the dictionary tables each time.
+ * The instance is frozen and can be shared by Ractors.
+ *
+ * [dict (string)]
+ * [compression_parameters = nil (nil, integer or Zstd::Parameters)]
+ *   Compression level (or parameters) to use with this dictionary.
+ */
+static VALUE
+cdict_init(int argc, VALUE argv[], VALUE self)
+{
+    /*
+     * ZSTDLIB_API ZSTD_CDict* ZSTD_createCDict(const void* dictBuffer, size_t dictSize,
+     *                                          int compressionLevel);
+     * ZSTDLIB_API ZSTD_CDict* ZSTD_createCDict_advanced2(const void* dict, size_t dictSize,
+     *                                                    ZSTD_dictLoadMethod_e dictLoadMethod,
+     *                                                    ZSTD_dictContentType_e dictContentType,
+     *                                                    const ZSTD_CCtx_params* cctxParams,
+     *                                                    ZSTD_customMem customMem);
+     */
+
+    VALUE dict, params;
+    rb_scan_args(argc, argv, "11", &dict, &params);
+
+    if (getcdictp(self)) { reiniterror(self); }
+
+    const char *dictp;
+    size_t dictsize;
+    aux_string_pointer(dict, &dictp, &dictsize);
+
+    ZSTD_CDict *cdict;
+    if (extzstd_params_p(params)) {
+        const ZSTD_CCtx_params *p = extzstd_getparams(params);
+        AUX_TRY_WITH_GC(
+                cdict = ZSTD_createCDict_advanced2(dictp, dictsize,
+                        ZSTD_dlm_byCopy, ZSTD_dct_auto,
+                        p, ZSTD_defaultCMem),
+                "failed ZSTD_createCDict_advanced2()");
+    } else {
+        int level = aux_num2int(params, ZSTD_CLEVEL_DEFAULT);
+        AUX_TRY_WITH_GC(
+                cdict = ZSTD_createCDict(dictp, dictsize, level),
+                "failed ZSTD_createCDict()");
+    }
+
+    DATA_PTR(self) = cdict;
+    rb_obj_freeze(self);
+
+    return self;
+}
+
+static VALUE
+cdict_dictid(VALUE self)
+{
+    return UINT2NUM(ZSTD_getDictID_fromCDict(getcdict(self)));
+}
+
+static VALUE
+cdict_sizeof(VALUE self)
+{
+    return SIZET2NUM(ZSTD_sizeof_CDict(getcdict(self)));
+}
+
+static void
+init_cdict(void)
+{
+    cCDict = rb_define_class_under(extzstd_mDictionary, "Compressor", rb_cObject);
+    rb_define_alloc_func(cCDict, cdict_alloc);
+    rb_define_method(cCDict, "initialize", cdict_init, -1);
+    rb_define_method(cCDict, "dictid", cdict_dictid, 0);
+    rb_define_method(cCDict, "sizeof", cdict_sizeof, 0);
+
+    (void)getcdictp;
+}
+
+/*
+ * class Zstd::Dictionary::Decompressor
+ */
+
+static VALUE cDDict;
+
+static void
+ddict_free(void *pp)
+{
+    if (pp) {
+        ZSTD_freeDDict((ZSTD_DDict *)pp);
+    }
+}
+
+static size_t
+ddict_size(const void *pp)
+{
+    return (pp ? ZSTD_sizeof_DDict((const ZSTD_DDict *)pp) : 0);
+}
+
+AUX_IMPLEMENT_CONTEXT_FLAGS(
+        ZSTD_DDict, ddict_type, "extzstd.Zstd::Dictionary::Decompressor",
+        ddict_alloc, NULL, ddict_free, ddict_size, AUX_FROZEN_SHAREABLE,
+        getddictp, getddict, ddict_p);
+
+int
+extzstd_ddict_p(VALUE v)
+{
+    return ddict_p(v);
+}
+
+ZSTD_DDict *
+extzstd_getddict(VALUE v)
+{
+    return getddict(v);
+}
+
+/*
+ * call-seq:
+ *  initialize(dict)
+ *
+ * Digest the dictionary for decompression.
+ * The instance is frozen and can be shared by Ractors.
+ *
+ * [dict (string)]
+ */
+static VALUE
+ddict_init(VALUE self, VALUE dict)
+{
+    /*
+     * ZSTDLIB_API ZSTD_DDict* ZSTD_createDDict(const void* dictBuffer, size_t dictSize);
+     */
+
+    if (getddictp(self)) { reiniterror(self); }
+
+    const char *dictp;
+    size_t dictsize;
+    aux_string_pointer(dict, &dictp, &dictsize);
+
+    ZSTD_DDict *ddict;
+    AUX_TRY_WITH_GC(
+            ddict = ZSTD_createDDict(dictp, dictsize),
+            "failed ZSTD_createDDict()");
+
+    DATA_PTR(self) = ddict;
+    rb_obj_freeze(self);
+
+    return self;
+}
+
+static VALUE
+ddict_dictid(VALUE self)
+{
+    return UINT2NUM(ZSTD_getDictID_fromDDict(getddict(self)));
+}
+
+static VALUE
+ddict_sizeof(VALUE self)
+{
+    return SIZET2NUM(ZSTD_sizeof_DDict(getddict(self)));
+}
+
+static void
+init_ddict(void)
+{
+    cDDict = rb_define_class_under(extzstd_mDictionary, "Decompressor", rb_cObject);
+    rb_define_alloc_func(cDDict, ddict_alloc);
+    rb_define_method(cDDict, "initialize", ddict_init, 1);
+    rb_define_method(cDDict, "dictid", ddict_dictid, 0);
+    rb_define_method(cDDict, "sizeof", ddict_sizeof, 0);
+
+    (void)getddictp;
+}
+
+/*
+ * initialize for extzstd_dict.c
+ */
+
+void
+extzstd_init_dict(void)
+{
+    init_cdict();
+    init_ddict();
+}
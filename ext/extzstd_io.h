@@ -0,0 +1,218 @@
+#ifndef EXTZSTD_IO_H
+#define EXTZSTD_IO_H 1
+
+/*
+ * Native I/O for the plain IO (and File) instances.
+ *
+ * read(2) and write(2) are called directly with the file descriptor
+ * without the GVL, instead of ``inport.read'' and ``outport << buf''.
+ * The other objects are used by duck typing as before.
+ */
+
+#include "extzstd.h"
+#include <ruby/io.h>
+#include <errno.h>
+
+#if defined(HAVE_RB_IO_DESCRIPTOR) && defined(HAVE_RB_IO_MAYBE_WAIT_READABLE) && !defined(_WIN32)
+#   define EXTZSTD_USE_FD 1
+#   include <unistd.h>
+#endif
+
+/*
+ * Returns true if io can be used by aux_io_read_str().
+ * The subclasses of IO that redefine +read+ are not.
+ */
+static inline int
+aux_io_readable_fd_p(VALUE io)
+{
+#ifdef EXTZSTD_USE_FD
+    return RB_TYPE_P(io, RUBY_T_FILE) &&
+           rb_method_basic_definition_p(CLASS_OF(io), rb_intern("read"));
+#else
+    (void)io;
+    return 0;
+#endif
+}
+
+/*
+ * Returns true if io can be used by aux_io_write_str().
+ * The subclasses of IO that redefine +<<+ or +write+ are not.
+ */
+static inline int
+aux_io_writable_fd_p(VALUE io)
+{
+#ifdef EXTZSTD_USE_FD
+    return RB_TYPE_P(io, RUBY_T_FILE) &&
+           rb_method_basic_definition_p(CLASS_OF(io), rb_intern("<<")) &&
+           rb_method_basic_definition_p(CLASS_OF(io), rb_intern("write"));
+#else
+    (void)io;
+    return 0;
+#endif
+}
+
+#ifdef EXTZSTD_USE_FD
+
+/*
+ * Returns the file descriptor of io. Raises IOError if closed.
+ */
+static inline int
+aux_io_fd(VALUE io)
+{
+    return rb_io_descriptor(io);
+}
+
+/*
+ * Returns true if the read buffer of the IO has data.
+ * In this case, reading the descriptor directly loses them.
+ */
+static inline int
+aux_io_read_pending(VALUE io)
+{
+    rb_io_t *fptr;
+    GetOpenFile(io, fptr);
+    return rb_io_read_pending(fptr);
+}
+
+struct aux_io_args
+{
+    VALUE io;
+    int fd;
+    char *buf;
+    size_t size;
+    ssize_t result;
+    int error;
+};
+
+static void *
+aux_io_read_nogvl(void *pp)
+{
+    struct aux_io_args *a = (struct aux_io_args *)pp;
+    a->result = read(a->fd, a->buf, a->size);
+    a->error = errno;
+    return NULL;
+}
+
+static void *
+aux_io_write_nogvl(void *pp)
+{
+    struct aux_io_args *a = (struct aux_io_args *)pp;
+    a->result = write(a->fd, a->buf, a->size);
+    a->error = errno;
+    return NULL;
+}
+
+static VALUE
+aux_io_read_body(VALUE args)
+{
+    struct aux_io_args *a = (struct aux_io_args *)args;
+
+    for (;;) {
+        a->fd = rb_io_descriptor(a->io); /* raise IOError if closed */
+        rb_thread_call_without_gvl(aux_io_read_nogvl, a, RUBY_UBF_IO, NULL);
+        if (a->result >= 0) {
+            return Qnil;
+        }
+
+        /* waits for the nonblocking descriptor, and checks the interrupts */
+        if (!rb_io_maybe_wait_readable(a->error, a->io, Qnil)) {
+            rb_syserr_fail(a->error, NULL);
+        }
+    }
+}
+
+static VALUE
+aux_io_write_body(VALUE args)
+{
+    struct aux_io_args *a = (struct aux_io_args *)args;
+
+    while (a->size > 0) {
+        a->fd = rb_io_descriptor(a->io); /* raise IOError if closed */
+        rb_thread_call_without_gvl(aux_io_write_nogvl, a, RUBY_UBF_IO, NULL);
+        if (a->result >= 0) {
+            a->buf += a->result;
+            a->size -= a->result;
+            continue;
+        }
+
+        if (!rb_io_maybe_wait_writable(a->error, a->io, Qnil)) {
+            rb_syserr_fail(a->error, NULL);
+        }
+    }
+
+    return Qnil;
+}
+
+/*
+ * Read up to size bytes into str[off, size] by read(2).
+ * Returns the read size (0 at end of file).
+ *
+ * str is locked while reading.
+ */
+static inline size_t
+aux_io_read_str(VALUE io, VALUE str, size_t off, size_t size)
+{
+    struct aux_io_args a = { io, -1, RSTRING_PTR(str) + off, size, 0, 0 };
+    rb_str_locktmp(str);
+    rb_ensure(aux_io_read_body, (VALUE)&a, rb_str_unlocktmp, str);
+    return (size_t)a.result;
+}
+
+/*
+ * Write the whole of str by write(2).
+ *
+ * The write buffer of the IO is flushed before, to keep the order with
+ * the data written from ruby.
+ * str is locked while writing.
+ */
+static inline void
+aux_io_write_str(VALUE io, VALUE str)
+{
+    rb_io_flush(io);
+
+    struct aux_io_args a = { io, -1, RSTRING_PTR(str), RSTRING_LEN(str), 0, 0 };
+    rb_str_locktmp(str);
+    rb_ensure(aux_io_write_body, (VALUE)&a, rb_str_unlocktmp, str);
+}
+
+/*
+ * Read-ahead by the native helper thread (extzstd_readahead.c).
+ */
+struct extzstd_readahead;
+extern struct extzstd_readahead *extzstd_readahead_new(int fd, size_t chunk_size, size_t depth);
+extern void extzstd_readahead_free(struct extzstd_readahead *ra, int gvl);
+extern size_t extzstd_readahead_read(struct extzstd_readahead *ra, VALUE str);
+
+#else /* !EXTZSTD_USE_FD */
+
+static inline int
+aux_io_fd(VALUE io)
+{
+    (void)io;
+    rb_notimplement();
+}
+
+static inline int
+aux_io_read_pending(VALUE io)
+{
+    (void)io;
+    return 1;
+}
+
+static inline size_t
+aux_io_read_str(VALUE io, VALUE str, size_t off, size_t size)
+{
+    (void)io; (void)str; (void)off; (void)size;
+    rb_notimplement();
+}
+
+static inline void
+aux_io_write_str(VALUE io, VALUE str)
+{
+    (void)io; (void)str;
+    rb_notimplement();
+}
+
+#endif /* EXTZSTD_USE_FD */
+
+#endif /* EXTZSTD_IO_H */
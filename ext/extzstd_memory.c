@@ -0,0 +1,200 @@
+#include "extzstd.h"
+
+#ifdef HAVE_RUBY_ATOMIC_H
+#   include <ruby/atomic.h>
+#   ifndef RUBY_ATOMIC_LOAD
+#       define RUBY_ATOMIC_LOAD(var) RUBY_ATOMIC_CAS(var, 0, 0)
+#   endif
+#endif
+
+/*
+ * The allocator of the compression/decompression contexts.
+ *
+ * libzstd allocates the window and the match tables by itself, so the GC
+ * of ruby does not know the memory pressure of the contexts.
+ * The contexts made by extzstd_create_cctx() and extzstd_create_dctx()
+ * allocate through ZSTD_customMem, which counts the allocated and freed
+ * sizes. The worker threads of libzstd also allocate without the GVL, so
+ * the counts are kept atomically, and given to rb_gc_adjust_memory_usage()
+ * by extzstd_memory_flush() while holding the GVL.
+ *
+ * The accounting switch is shared by all of the Ractors in the process,
+ * so it is also kept atomically.
+ */
+
+#ifdef HAVE_RUBY_ATOMIC_H
+
+union memory_header
+{
+    size_t size;
+    /* keep the alignment of malloc() for the returned pointer */
+    long double ld;
+    long long ll;
+    void *ptr;
+};
+
+static rb_atomic_t accounting = 1;
+static size_t allocated_pending;
+static size_t freed_pending;
+static size_t allocated_live;
+
+static void *
+memory_alloc(void *opaque, size_t size)
+{
+    (void)opaque;
+
+    union memory_header *h = (union memory_header *)malloc(sizeof(*h) + size);
+    if (!h) { return NULL; }
+    h->size = size;
+    RUBY_ATOMIC_SIZE_ADD(allocated_pending, size);
+    RUBY_ATOMIC_SIZE_ADD(allocated_live, size);
+
+    return h + 1;
+}
+
+static void
+memory_free(void *opaque, void *address)
+{
+    (void)opaque;
+
+    if (!address) { return; }
+    union memory_header *h = (union memory_header *)address - 1;
+    RUBY_ATOMIC_SIZE_ADD(freed_pending, h->size);
+    RUBY_ATOMIC_SIZE_SUB(allocated_live, h->size);
+    free(h);
+}
+
+static ZSTD_customMem
+memory_custommem(void)
+{
+    if (RUBY_ATOMIC_LOAD(accounting)) {
+        ZSTD_customMem mem = { memory_alloc, memory_free, NULL };
+        return mem;
+    } else {
+        return ZSTD_defaultCMem;
+    }
+}
+
+/*
+ * Report the allocated and freed sizes since the last call to the GC.
+ * The GVL must be held.
+ */
+void
+extzstd_memory_flush(void)
+{
+    size_t allocated = RUBY_ATOMIC_SIZE_EXCHANGE(allocated_pending, 0);
+    size_t freed = RUBY_ATOMIC_SIZE_EXCHANGE(freed_pending, 0);
+
+    if (allocated != freed) {
+        rb_gc_adjust_memory_usage((ssize_t)(allocated - freed));
+    }
+}
+
+#else
+
+static ZSTD_customMem
+memory_custommem(void)
+{
+    return ZSTD_defaultCMem;
+}
+
+void
+extzstd_memory_flush(void)
+{
+}
+
+#endif /* HAVE_RUBY_ATOMIC_H */
+
+/*
+ * Same as ZSTD_createCCtx(), with the allocator of the GC accounting.
+ * Returns NULL if failed.
+ */
+ZSTD_CCtx *
+extzstd_create_cctx(void)
+{
+    ZSTD_CCtx *ctx = ZSTD_createCCtx_advanced(memory_custommem());
+    extzstd_memory_flush();
+    return ctx;
+}
+
+/*
+ * Same as ZSTD_createDCtx(), with the allocator of the GC accounting.
+ * Returns NULL if failed.
+ */
+ZSTD_DCtx *
+extzstd_create_dctx(void)
+{
+    ZSTD_DCtx *ctx = ZSTD_createDCtx_advanced(memory_custommem());
+    extzstd_memory_flush();
+    return ctx;
+}
+
+/*
+ * call-seq:
+ *  gc_memory_accounting -> true or false
+ *
+ * Returns true if the contexts made after now report their memory to the
+ * GC of ruby.
+ */
+static VALUE
+memory_s_accounting(VALUE mod)
+{
+#ifdef HAVE_RUBY_ATOMIC_H
+    return (RUBY_ATOMIC_LOAD(accounting) ? Qtrue : Qfalse);
+#else
+    return Qfalse;
+#endif
+}
+
+/*
+ * call-seq:
+ *  gc_memory_accounting = true or false
+ *
+ * Enable (by default) or disable the allocator of the GC accounting for
+ * the contexts made after now.
+ * Zstd::Encoder, Zstd::Decoder, Zstd::Codec and the other contexts
+ * allocate through ZSTD_customMem, and rb_gc_adjust_memory_usage() is
+ * told the sizes, so that the GC runs for the large unreachable contexts.
+ *
+ * This is the process-wide setting, and changes the contexts made by the
+ * other Ractors too.
+ */
+static VALUE
+memory_s_set_accounting(VALUE mod, VALUE enable)
+{
+#ifdef HAVE_RUBY_ATOMIC_H
+    RUBY_ATOMIC_SET(accounting, RTEST(enable) ? 1 : 0);
+#else
+    if (RTEST(enable)) { rb_notimplement(); }
+#endif
+    return enable;
+}
+
+/*
+ * call-seq:
+ *  gc_memory_allocated -> integer
+ *
+ * Returns the allocated size in bytes by the contexts with the GC
+ * accounting, that are not freed yet.
+ */
+static VALUE
+memory_s_allocated(VALUE mod)
+{
+#ifdef HAVE_RUBY_ATOMIC_H
+    return SIZET2NUM(RUBY_ATOMIC_SIZE_CAS(allocated_live, 0, 0)); /* atomic load */
+#else
+    return INT2FIX(0);
+#endif
+}
+
+/*
+ * initialize for extzstd_memory.c
+ */
+
+void
+extzstd_init_memory(void)
+{
+    rb_define_singleton_method(extzstd_mZstd, "gc_memory_accounting", memory_s_accounting, 0);
+    rb_define_singleton_method(extzstd_mZstd, "gc_memory_accounting=", memory_s_set_accounting, 1);
+    rb_define_singleton_method(extzstd_mZstd, "gc_memory_allocated", memory_s_allocated, 0);
+}
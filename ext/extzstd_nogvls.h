@@ -54,4 +54,77 @@ aux_ZSTD_decompress(char *dest, size_t destsize, const char *src, size_t srcsize
             dest, destsize, src, srcsize);
 }
 
+static void *
+aux_ZSTD_compressStream2_nogvl(va_list *vp)
+{
+    ZSTD_CCtx *zcs = va_arg(*vp, ZSTD_CCtx *);
+    ZSTD_outBuffer *output = va_arg(*vp, ZSTD_outBuffer *);
+    ZSTD_inBuffer *input = va_arg(*vp, ZSTD_inBuffer *);
+    ZSTD_EndDirective endop = (ZSTD_EndDirective)va_arg(*vp, int);
+    return (void *)ZSTD_compressStream2(zcs, output, input, endop);
+}
+
+static inline size_t
+aux_ZSTD_compressStream2(ZSTD_CCtx *zcs, ZSTD_outBuffer *output, ZSTD_inBuffer *input, ZSTD_EndDirective endop)
+{
+    return (size_t)aux_thread_call_without_gvl(
+            aux_ZSTD_compressStream2_nogvl, NULL,
+            zcs, output, input, (int)endop);
+}
+
+static void *
+aux_ZSTD_decompressStream_nogvl(va_list *vp)
+{
+    ZSTD_DCtx *zds = va_arg(*vp, ZSTD_DCtx *);
+    ZSTD_outBuffer *output = va_arg(*vp, ZSTD_outBuffer *);
+    ZSTD_inBuffer *input = va_arg(*vp, ZSTD_inBuffer *);
+    return (void *)ZSTD_decompressStream(zds, output, input);
+}
+
+static inline size_t
+aux_ZSTD_decompressStream(ZSTD_DCtx *zds, ZSTD_outBuffer *output, ZSTD_inBuffer *input)
+{
+    return (size_t)aux_thread_call_without_gvl(
+            aux_ZSTD_decompressStream_nogvl, NULL,
+            zds, output, input);
+}
+
+static void *
+aux_ZSTD_compress2_nogvl(va_list *vp)
+{
+    ZSTD_CCtx *cctx = va_arg(*vp, ZSTD_CCtx *);
+    char *dest = va_arg(*vp, char *);
+    size_t destsize = va_arg(*vp, size_t);
+    const char *src = va_arg(*vp, const char *);
+    size_t srcsize = va_arg(*vp, size_t);
+    return (void *)ZSTD_compress2(cctx, dest, destsize, src, srcsize);
+}
+
+static inline size_t
+aux_ZSTD_compress2(ZSTD_CCtx *cctx, char *dest, size_t destsize, const char *src, size_t srcsize)
+{
+    return (size_t)aux_thread_call_without_gvl(
+            aux_ZSTD_compress2_nogvl, NULL,
+            cctx, dest, destsize, src, srcsize);
+}
+
+static void *
+aux_ZSTD_decompressDCtx_nogvl(va_list *vp)
+{
+    ZSTD_DCtx *dctx = va_arg(*vp, ZSTD_DCtx *);
+    char *dest = va_arg(*vp, char *);
+    size_t destsize = va_arg(*vp, size_t);
+    const char *src = va_arg(*vp, const char *);
+    size_t srcsize = va_arg(*vp, size_t);
+    return (void *)ZSTD_decompressDCtx(dctx, dest, destsize, src, srcsize);
+}
+
+static inline size_t
+aux_ZSTD_decompressDCtx(ZSTD_DCtx *dctx, char *dest, size_t destsize, const char *src, size_t srcsize)
+{
+    return (size_t)aux_thread_call_without_gvl(
+            aux_ZSTD_decompressDCtx_nogvl, NULL,
+            dctx, dest, destsize, src, srcsize);
+}
+
 #endif /* EXTZSTD_NOGVLS_H */
@@ -0,0 +1,299 @@
+#include "extzstd.h"
+#include "extzstd_io.h"
+
+#ifdef EXTZSTD_USE_FD
+
+#include <common/threading.h>
+#include <poll.h>
+
+/*
+ * Read-ahead of Zstd::Decoder for the plain IO.
+ *
+ * A native helper thread fills the ring of +depth+ buffers by read(2),
+ * while the caller decompresses the previous chunk.
+ * The helper thread waits by poll(2) with the timeout, to notice the stop
+ * request even when the descriptor has no data.
+ *
+ * The helper thread reads its own duplicate of the descriptor, because the
+ * IO may be closed by another Ruby thread, and the number may be reused by
+ * another file while the thread is running.
+ *
+ * The helper thread does not exist in the child process after fork(2), so
+ * the read-ahead made before fork is not used nor joined there.
+ */
+
+enum {
+    EXT_READAHEAD_POLL_MSEC = 100,
+};
+
+struct extzstd_readahead
+{
+    int fd;             /* duplicated for the helper thread */
+    size_t chunk_size;
+    size_t depth;
+    char **slots;
+    size_t *sizes;
+    size_t head;        /* the slot to read by the caller */
+    size_t count;       /* the filled slots from head */
+    int eof;            /* the helper thread is finished (end of file or error) */
+    int error;          /* errno of read(2) */
+    int stop;           /* requested to finish the helper thread */
+    int interrupted;    /* the waiting of the caller is interrupted */
+    int running;        /* the helper thread is created */
+    unsigned int generation;    /* extzstd_fork_generation at created the thread */
+    ZSTD_pthread_t thread;
+    ZSTD_pthread_mutex_t mutex;
+    ZSTD_pthread_cond_t cond;
+};
+
+static int
+readahead_stopped(struct extzstd_readahead *ra)
+{
+    ZSTD_pthread_mutex_lock(&ra->mutex);
+    int stop = ra->stop;
+    ZSTD_pthread_mutex_unlock(&ra->mutex);
+    return stop;
+}
+
+/*
+ * Returns the read size, or -1 with errno, or -2 if stopped.
+ */
+static ssize_t
+readahead_read(struct extzstd_readahead *ra, char *buf)
+{
+    for (;;) {
+        if (readahead_stopped(ra)) { return -2; }
+
+        struct pollfd pfd = { ra->fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, EXT_READAHEAD_POLL_MSEC);
+        if (r < 0) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        if (r == 0) { continue; }
+
+        ssize_t n = read(ra->fd, buf, ra->chunk_size);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) { continue; }
+            return -1;
+        }
+
+        return n;
+    }
+}
+
+static void *
+readahead_work(void *opaque)
+{
+    struct extzstd_readahead *ra = (struct extzstd_readahead *)opaque;
+
+    for (;;) {
+        ZSTD_pthread_mutex_lock(&ra->mutex);
+        while (!ra->stop && ra->count >= ra->depth) {
+            ZSTD_pthread_cond_wait(&ra->cond, &ra->mutex);
+        }
+        size_t tail = (ra->head + ra->count) % ra->depth;
+        int stop = ra->stop;
+        ZSTD_pthread_mutex_unlock(&ra->mutex);
+
+        /* the slot at tail is not touched by the caller */
+        ssize_t n = (stop ? -2 : readahead_read(ra, ra->slots[tail]));
+        int err = errno;
+
+        ZSTD_pthread_mutex_lock(&ra->mutex);
+        if (n > 0) {
+            ra->sizes[tail] = n;
+            ra->count++;
+        } else {
+            ra->error = (n == -1 ? err : 0);
+            ra->eof = 1;
+        }
+        ZSTD_pthread_cond_broadcast(&ra->cond);
+        ZSTD_pthread_mutex_unlock(&ra->mutex);
+
+        if (n <= 0) { break; }
+    }
+
+    return NULL;
+}
+
+static void
+readahead_free_buffers(struct extzstd_readahead *ra)
+{
+    if (ra->slots) {
+        for (size_t i = 0; i < ra->depth; i++) {
+            free(ra->slots[i]);
+        }
+    }
+    free(ra->slots);
+    free(ra->sizes);
+    if (ra->fd >= 0) { close(ra->fd); }
+    free(ra);
+}
+
+/*
+ * Start the helper thread for a duplicate of fd.
+ * Returns NULL if the thread, the buffers or the descriptor can not be
+ * created.
+ */
+struct extzstd_readahead *
+extzstd_readahead_new(int fd, size_t chunk_size, size_t depth)
+{
+    struct extzstd_readahead *ra = (struct extzstd_readahead *)calloc(1, sizeof(*ra));
+    if (!ra) { return NULL; }
+
+    ra->fd = rb_cloexec_dup(fd);
+    if (ra->fd < 0) {
+        readahead_free_buffers(ra);
+        return NULL;
+    }
+    rb_update_max_fd(ra->fd);
+    ra->generation = extzstd_fork_generation;
+    ra->chunk_size = chunk_size;
+    ra->depth = depth;
+    ra->slots = (char **)calloc(depth, sizeof(char *));
+    ra->sizes = (size_t *)calloc(depth, sizeof(size_t));
+    if (!ra->slots || !ra->sizes) {
+        readahead_free_buffers(ra);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < depth; i++) {
+        ra->slots[i] = (char *)malloc(chunk_size);
+        if (!ra->slots[i]) {
+            readahead_free_buffers(ra);
+            return NULL;
+        }
+    }
+
+    ZSTD_pthread_mutex_init(&ra->mutex, NULL);
+    ZSTD_pthread_cond_init(&ra->cond, NULL);
+
+    if (ZSTD_pthread_create(&ra->thread, NULL, readahead_work, ra) != 0) {
+        ZSTD_pthread_cond_destroy(&ra->cond);
+        ZSTD_pthread_mutex_destroy(&ra->mutex);
+        readahead_free_buffers(ra);
+        return NULL;
+    }
+    ra->running = 1;
+
+    return ra;
+}
+
+static void *
+readahead_stop_nogvl(void *pp)
+{
+    struct extzstd_readahead *ra = (struct extzstd_readahead *)pp;
+
+    ZSTD_pthread_mutex_lock(&ra->mutex);
+    ra->stop = 1;
+    ZSTD_pthread_cond_broadcast(&ra->cond);
+    ZSTD_pthread_mutex_unlock(&ra->mutex);
+
+    ZSTD_pthread_join(ra->thread);
+
+    return NULL;
+}
+
+/*
+ * Stop the helper thread and free ra.
+ * The waiting for the thread is at most EXT_READAHEAD_POLL_MSEC.
+ *
+ * When gvl is true, the GVL is released while waiting.
+ * (false for the dfree function of GC)
+ */
+void
+extzstd_readahead_free(struct extzstd_readahead *ra, int gvl)
+{
+    if (!ra) { return; }
+
+    if (extzstd_forked_p(ra->generation)) {
+        /* the mutex may be locked by the lost thread */
+        readahead_free_buffers(ra);
+        return;
+    }
+
+    if (ra->running) {
+        if (gvl) {
+            rb_thread_call_without_gvl(readahead_stop_nogvl, ra, NULL, NULL);
+        } else {
+            readahead_stop_nogvl(ra);
+        }
+    }
+
+    ZSTD_pthread_cond_destroy(&ra->cond);
+    ZSTD_pthread_mutex_destroy(&ra->mutex);
+    readahead_free_buffers(ra);
+}
+
+static void *
+readahead_wait_nogvl(void *pp)
+{
+    struct extzstd_readahead *ra = (struct extzstd_readahead *)pp;
+
+    ZSTD_pthread_mutex_lock(&ra->mutex);
+    while (ra->count == 0 && !ra->eof && !ra->interrupted) {
+        ZSTD_pthread_cond_wait(&ra->cond, &ra->mutex);
+    }
+    ZSTD_pthread_mutex_unlock(&ra->mutex);
+
+    return NULL;
+}
+
+static void
+readahead_wait_ubf(void *pp)
+{
+    struct extzstd_readahead *ra = (struct extzstd_readahead *)pp;
+
+    ZSTD_pthread_mutex_lock(&ra->mutex);
+    ra->interrupted = 1;
+    ZSTD_pthread_cond_broadcast(&ra->cond);
+    ZSTD_pthread_mutex_unlock(&ra->mutex);
+}
+
+/*
+ * Copy the next chunk into str (the capacity must be chunk_size or more).
+ * Returns the size, or 0 at end of file.
+ *
+ * Raises SystemCallError if read(2) failed in the helper thread, or
+ * RuntimeError in the child process of fork.
+ */
+size_t
+extzstd_readahead_read(struct extzstd_readahead *ra, VALUE str)
+{
+    if (extzstd_forked_p(ra->generation)) {
+        rb_raise(rb_eRuntimeError, "read-ahead thread is lost by fork");
+    }
+
+    for (;;) {
+        ZSTD_pthread_mutex_lock(&ra->mutex);
+        size_t count = ra->count;
+        int eof = ra->eof, error = ra->error;
+        ra->interrupted = 0;
+        ZSTD_pthread_mutex_unlock(&ra->mutex);
+
+        if (count > 0) {
+            /* the slot at head is not touched by the helper thread */
+            size_t n = ra->sizes[ra->head];
+            memcpy(RSTRING_PTR(str), ra->slots[ra->head], n);
+
+            ZSTD_pthread_mutex_lock(&ra->mutex);
+            ra->head = (ra->head + 1) % ra->depth;
+            ra->count--;
+            ZSTD_pthread_cond_broadcast(&ra->cond);
+            ZSTD_pthread_mutex_unlock(&ra->mutex);
+
+            return n;
+        }
+
+        if (eof) {
+            if (error) { rb_syserr_fail(error, "read-ahead"); }
+            return 0;
+        }
+
+        rb_thread_call_without_gvl(readahead_wait_nogvl, ra, readahead_wait_ubf, ra);
+        rb_thread_check_ints();
+    }
+}
+
+#endif /* EXTZSTD_USE_FD */
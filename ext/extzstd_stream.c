@@ -1,11 +1,14 @@
 #include "extzstd.h"
 #include "extzstd_nogvls.h"
+#include "extzstd_io.h"
 #include <errno.h>
 
 enum {
     EXT_PARTIAL_READ_SIZE = 256 * 1024, /* 256 KiB */
+    EXT_PARTIAL_WRITE_SIZE = 256 * 1024, /* 256 KiB */
     EXT_READ_GROWUP_SIZE = 256 * 1024, /* 256 KiB */
     EXT_READ_DOUBLE_GROWUP_LIMIT_SIZE = 4 * 1024 * 1024, /* 4 MiB */
+    EXT_READ_AHEAD_MAX = 64, /* chunks */
 };
 
 static inline VALUE
@@ -21,6 +24,17 @@ aux_str_buf_recycle(VALUE *str, size_t capacity)
 
 static ID id_op_lsh, id_read;
 
+static size_t
+aux_chunk_size(VALUE size)
+{
+    size_t n = NUM2SIZET(size);
+    if (n < 1 || n > INT_MAX) {
+        rb_raise(rb_eArgError,
+                 "chunk size is out of range (given %"PRIuSIZE")", n);
+    }
+    return n;
+}
+
 /*
  * class Zstd::Encoder
  */
@@ -33,7 +47,18 @@ struct encoder
     VALUE outport;
     VALUE predict;
     VALUE destbuf;
+    VALUE thread_pool;  /* Zstd::ThreadPool referred by context, or nil */
+    struct extzstd_workspace *arena;    /* context is made in the leased Zstd::Workspace */
+    VALUE pool;         /* Zstd::ContextPool to return context by #close, or nil */
+    VALUE pool_key;
+    size_t write_chunk_size;
+    uint64_t outport_calls;
+    unsigned int generation;    /* extzstd_fork_generation at made the context */
+    int native_io;      /* outport is a plain IO, so write(2) directly */
     int reached_eof;
+    int in_frame;       /* a frame is started by #write */
+    int frame_written;  /* any frame is finished */
+    int busy;           /* the context is used by enc_call() */
 };
 
 static void
@@ -44,6 +69,9 @@ enc_gc_mark(void *pp)
         rb_gc_mark(p->outport);
         rb_gc_mark(p->predict);
         rb_gc_mark(p->destbuf);
+        rb_gc_mark(p->thread_pool);
+        rb_gc_mark(p->pool);
+        rb_gc_mark(p->pool_key);
     }
 }
 
@@ -52,17 +80,38 @@ enc_free(void *pp)
 {
     if (pp) {
         struct encoder *p = (struct encoder *)pp;
-        if (p->context) {
-            ZSTD_freeCStream(p->context);
+        if (p->arena) {
+            extzstd_workspace_release(p->arena);
+            p->arena = NULL;
             p->context = NULL;
+        } else if (p->context) {
+            if (extzstd_forked_p(p->generation)) {
+                extzstd_discard_cctx(p->context);
+            } else {
+                ZSTD_freeCStream(p->context);
+            }
+            p->context = NULL;
+            extzstd_memory_flush();
         }
         xfree(p);
     }
 }
 
+static size_t
+enc_memsize(const void *pp)
+{
+    const struct encoder *p = (const struct encoder *)pp;
+    size_t size = sizeof(*p);
+    /* the workspace is counted by Zstd::Workspace */
+    if (p->context && !p->arena && !(extzstd_forked_p(p->generation) && extzstd_cctx_mt_p(p->context))) {
+        size += ZSTD_sizeof_CStream(p->context);
+    }
+    return size;
+}
+
 AUX_IMPLEMENT_CONTEXT(
         struct encoder, encoder_type, "extzstd.Zstd::Encoder",
-        encoder_alloc_dummy, enc_gc_mark, enc_free, NULL,
+        encoder_alloc_dummy, enc_gc_mark, enc_free, enc_memsize,
         getencoderp, getencoder, encoder_p);
 
 static VALUE
@@ -72,10 +121,18 @@ enc_alloc(VALUE mod)
     VALUE obj = TypedData_Make_Struct(mod, struct encoder, &encoder_type, p);
     p->outport = Qnil;
     p->predict = Qnil;
+    p->thread_pool = Qnil;
+    p->pool = Qnil;
+    p->pool_key = Qnil;
     p->destbuf = Qnil;
+    p->write_chunk_size = EXT_PARTIAL_WRITE_SIZE;
     return obj;
 }
 
+/*
+ * Returns the encoder of self, that is initialized and is not used by
+ * another call (see enc_call()).
+ */
 static struct encoder *
 encoder_context(VALUE self)
 {
@@ -85,12 +142,130 @@ encoder_context(VALUE self)
                 "wrong initialized context - #<%s:%p>",
                 rb_obj_classname(self), (void *)self);
     }
+    if (p->busy) {
+        rb_raise(rb_eRuntimeError,
+                "encoder is in use by another thread - #<%s:%p>",
+                rb_obj_classname(self), (void *)self);
+    }
     return p;
 }
 
+/*
+ * Same as encoder_context(), and checks that the context can compress.
+ * The multithreaded context made before fork waits for the lost worker
+ * threads forever in the child process.
+ */
+static struct encoder *
+encoder_compressor(VALUE self)
+{
+    struct encoder *p = encoder_context(self);
+    if (extzstd_forked_p(p->generation) && extzstd_cctx_mt_p(p->context)) {
+        rb_raise(rb_eRuntimeError,
+                "compression worker threads are lost by fork - #<%s:%p>",
+                rb_obj_classname(self), (void *)self);
+    }
+    return p;
+}
+
+struct enc_setup_args
+{
+    ZSTD_CCtx *context;
+    VALUE params;
+    VALUE predict;
+    const void *predictp;
+    size_t predictsize;
+    VALUE opts;
+    VALUE thread_pool;
+};
+
+/*
+ * Apply the parameters and the dictionary to the new context.
+ * When an error occurs, the context is released and an exception is raised.
+ */
+static void
+enc_setup(struct enc_setup_args *a)
+{
+    ZSTD_CCtx *zstd = a->context;
+
+    aux_ZSTD_CCtx_reset(zstd, ZSTD_reset_session_and_parameters);
+    if (extzstd_params_p(a->params)) {
+        extzstd_params_setup_cctx(zstd, extzstd_getparams(a->params));
+    } else {
+        int clevel = aux_num2int(a->params, ZSTD_CLEVEL_DEFAULT);
+        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, clevel);
+    }
+    a->thread_pool = extzstd_mtopts_setup_cctx(zstd, a->opts);
+    if (extzstd_cdict_p(a->predict)) {
+        aux_ZSTD_CCtx_refCDict(zstd, extzstd_getcdict(a->predict));
+    } else {
+        aux_ZSTD_CCtx_loadDictionary(zstd, a->predictp, a->predictsize);
+    }
+}
+
+static VALUE
+enc_setup_protected(VALUE args)
+{
+    enc_setup((struct enc_setup_args *)args);
+    return Qnil;
+}
+
+/*
+ * The key of Zstd::ContextPool for the settings of the context.
+ */
+static VALUE
+enc_pool_key(VALUE params, VALUE predict, VALUE opts)
+{
+    VALUE key[6] = { params, predict, Qnil, Qnil, Qnil, Qnil };
+    if (!extzstd_params_p(params)) {
+        key[0] = INT2NUM(aux_num2int(params, ZSTD_CLEVEL_DEFAULT));
+    }
+    if (!NIL_P(opts)) {
+        static const char *const names[] = { "workers", "job_size", "overlap_log", "thread_pool" };
+        for (size_t i = 0; i < ELEMENTOF(names); i++) {
+            key[2 + i] = rb_hash_lookup(opts, ID2SYM(rb_intern(names[i])));
+        }
+    }
+    return extzstd_contextpool_key(ELEMENTOF(key), key);
+}
+
 /*
  * call-seq:
- *  initialize(outport, compression_parameters = nil, predict = nil)
+ *  initialize(outport, compression_parameters = nil, predict = nil, opts = {})
+ *
+ * [outport]
+ *   Object that have +<<+ method.
+ *
+ *   When given the plain IO (or File) instance, the compressed data is
+ *   written by write(2) on the file descriptor without the GVL.
+ * [compression_parameters = nil (nil, integer or Zstd::Parameters)]
+ * [predict = nil (nil, string or Zstd::Dictionary::Compressor)]
+ *   When given Zstd::Dictionary::Compressor, the compression level is taken
+ *   from the digested dictionary.
+ * [opts workers: nil]
+ *   Number of compression worker threads.
+ *   Overrides the value of compression_parameters.
+ * [opts job_size: nil]
+ * [opts overlap_log: nil]
+ * [opts thread_pool: nil (nil, true, false or Zstd::ThreadPool)]
+ *   The worker threads used by the multithreaded compression.
+ *   nil and true mean Zstd::ThreadPool.default, and false means the own
+ *   threads of the encoder.
+ * [opts write_chunk_size: 256 KiB]
+ *   The compressed data is coalesced up to this size before
+ *   <tt>outport << chunk</tt>, except for #sync and #close.
+ * [opts workspace: nil (nil or Zstd::Workspace)]
+ *   Make the context in the workspace instead of allocating, and lease it
+ *   until #close.
+ *   predict must be nil or Zstd::Dictionary::Compressor, and +workers+ can
+ *   not be used.
+ *   The encoder can not be used after #close, except for #eof? and
+ *   #outport_calls.
+ * [opts pool: nil (nil or Zstd::ContextPool)]
+ *   Reuse the idle context of the same parameters and predict in the pool,
+ *   and return the context to the pool by #close.
+ *   The encoder can not be used after #close, as same as +workspace+.
+ *
+ * Unknown keyword options are rejected by ArgumentError.
  */
 static VALUE
 enc_init(int argc, VALUE argv[], VALUE self)
@@ -102,25 +277,8 @@ enc_init(int argc, VALUE argv[], VALUE self)
      *                                              ZSTD_parameters params, unsigned long long pledgedSrcSize);
      */
 
-    VALUE outport, params, predict;
-    switch (argc) {
-    case 1:
-        outport = argv[0];
-        params = predict = Qnil;
-        break;
-    case 2:
-        outport = argv[0];
-        params = argv[1];
-        predict = Qnil;
-        break;
-    case 3:
-        outport = argv[0];
-        params = argv[1];
-        predict = argv[2];
-        break;
-    default:
-        rb_error_arity(argc, 1, 3);
-    }
+    VALUE outport, params, predict, opts;
+    rb_scan_args(argc, argv, "12:", &outport, &params, &predict, &opts);
 
     struct encoder *p = getencoder(self);
     if (p->context) {
@@ -129,9 +287,31 @@ enc_init(int argc, VALUE argv[], VALUE self)
                 rb_obj_classname(self), (void *)self);
     }
 
+    /* the arguments are checked before the context is made */
+    if (!NIL_P(params) && !extzstd_params_p(params)) {
+        params = INT2NUM(NUM2INT(params));
+    }
+
+    size_t write_chunk_size = EXT_PARTIAL_WRITE_SIZE;
+    VALUE workspace = Qnil, pool = Qnil;
+    if (!NIL_P(opts)) {
+        enum { o_workers, o_job_size, o_overlap_log, o_thread_pool, o_write_chunk_size, o_workspace, o_pool, numopts };
+        ID ids[numopts] = {
+            rb_intern("workers"), rb_intern("job_size"), rb_intern("overlap_log"), rb_intern("thread_pool"),
+            rb_intern("write_chunk_size"), rb_intern("workspace"), rb_intern("pool"),
+        };
+        VALUE v[numopts];
+        rb_get_kwargs(rb_hash_dup(opts), ids, 0, numopts, v); /* the others are read by extzstd_mtopts_setup_cctx() */
+        if (v[o_write_chunk_size] != Qundef && !NIL_P(v[o_write_chunk_size])) {
+            write_chunk_size = aux_chunk_size(v[o_write_chunk_size]);
+        }
+        if (v[o_workspace] != Qundef) { workspace = v[o_workspace]; }
+        if (v[o_pool] != Qundef) { pool = v[o_pool]; }
+    }
+
     const void *predictp;
     size_t predictsize;
-    if (NIL_P(predict)) {
+    if (NIL_P(predict) || extzstd_cdict_p(predict)) {
         predictp = NULL;
         predictsize = 0;
     } else {
@@ -140,124 +320,404 @@ enc_init(int argc, VALUE argv[], VALUE self)
         RSTRING_GETMEM(predict, predictp, predictsize);
     }
 
-    AUX_TRY_WITH_GC(
-            p->context = ZSTD_createCStream(),
-            "failed ZSTD_createCStream()");
-
-    if (extzstd_params_p(params)) {
-        ZSTD_parameters *paramsp = extzstd_getparams(params);
-        ZSTD_CCtx *zstd = p->context;
-        p->context = NULL; // 一時的に無効化する
-
-        aux_ZSTD_CCtx_reset(zstd, ZSTD_reset_session_and_parameters);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_windowLog, paramsp->cParams.windowLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_chainLog, paramsp->cParams.chainLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_hashLog, paramsp->cParams.hashLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_searchLog, paramsp->cParams.searchLog);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_minMatch, paramsp->cParams.minMatch);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_targetLength, paramsp->cParams.targetLength);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_strategy, paramsp->cParams.strategy);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_contentSizeFlag, paramsp->fParams.contentSizeFlag);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_checksumFlag, paramsp->fParams.checksumFlag);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_dictIDFlag, !paramsp->fParams.noDictIDFlag);
-        aux_ZSTD_CCtx_loadDictionary(zstd, predictp, predictsize);
-
-        p->context = zstd;
-    } else {
-        int clevel = aux_num2int(params, ZSTD_CLEVEL_DEFAULT);
-        ZSTD_CCtx *zstd = p->context;
-        p->context = NULL; // 一時的に無効化する
-
-        aux_ZSTD_CCtx_reset(zstd, ZSTD_reset_session_and_parameters);
-        aux_ZSTD_CCtx_setParameter(zstd, ZSTD_c_compressionLevel, clevel);
-        aux_ZSTD_CCtx_loadDictionary(zstd, predictp, predictsize);
+    VALUE pool_key = Qnil;
+    struct enc_setup_args args = { NULL, params, predict, predictp, predictsize, opts, Qnil };
+    if (!NIL_P(pool)) {
+        if (!NIL_P(workspace)) {
+            rb_raise(rb_eArgError, "workspace and pool are given together");
+        }
+        pool_key = enc_pool_key(params, predict, opts);
+        args.context = (ZSTD_CCtx *)extzstd_contextpool_checkout(pool, EXTZSTD_CONTEXTPOOL_CCTX, pool_key, &args.thread_pool);
+    }
 
-        p->context = zstd;
+    if (args.context) {
+        /* reused the context of the pool */
+    } else if (NIL_P(workspace)) {
+        AUX_TRY_WITH_GC(
+                args.context = extzstd_create_cctx(),
+                "failed ZSTD_createCStream()");
+        enc_setup(&args);
+    } else {
+        struct extzstd_workspace *arena;
+        args.context = extzstd_workspace_cctx(workspace, params, predict, opts, &arena);
+
+        int state;
+        rb_protect(enc_setup_protected, (VALUE)&args, &state);
+        if (state) {
+            extzstd_workspace_release(arena);
+            rb_jump_tag(state);
+        }
+        p->arena = arena;
     }
+    p->context = args.context;
+    p->thread_pool = args.thread_pool;
+    p->pool = pool;
+    p->pool_key = pool_key;
+    p->write_chunk_size = write_chunk_size;
 
     p->predict = predict;
     p->outport = outport;
+    p->native_io = aux_io_writable_fd_p(outport);
+    p->generation = extzstd_fork_generation;
 
     return self;
 }
 
+struct enc_compress_args
+{
+    struct encoder *encoder;
+    ZSTD_outBuffer *output;
+    ZSTD_inBuffer *input;
+    ZSTD_EndDirective endop;
+    size_t status;
+};
+
 static VALUE
-enc_write(VALUE self, VALUE src)
+enc_compress_nogvl(VALUE args)
 {
-    /*
-     * ZSTDLIB_API size_t ZSTD_compressStream(ZSTD_CStream* zcs, ZSTD_outBuffer* output, ZSTD_inBuffer* input);
-     */
+    struct enc_compress_args *a = (struct enc_compress_args *)args;
+    a->status = aux_ZSTD_compressStream2(a->encoder->context, a->output, a->input, a->endop);
+    return Qnil;
+}
 
-    struct encoder *p = encoder_context(self);
-    src = rb_String(src);
-    ZSTD_inBuffer input = { RSTRING_PTR(src), RSTRING_LEN(src), 0 };
+/*
+ * Run ZSTD_compressStream2() without the GVL.
+ *
+ * p->destbuf is locked while the GVL is released, so other threads can not
+ * modify (or realloc) it.
+ * It must be called in enc_call(), that rejects another call on the same
+ * encoder from other threads.
+ *
+ * The input buffer must belong to a frozen string.
+ */
+static size_t
+enc_compress(struct encoder *p, ZSTD_outBuffer *output, ZSTD_inBuffer *input, ZSTD_EndDirective endop)
+{
+    struct enc_compress_args args = { p, output, input, endop, 0 };
+    VALUE destbuf = p->destbuf;
+    rb_str_locktmp(destbuf);
+    rb_ensure(enc_compress_nogvl, (VALUE)&args, rb_str_unlocktmp, destbuf);
+    extzstd_memory_flush();
+    return args.status;
+}
 
-    while (input.pos < input.size) {
-        aux_str_buf_recycle(&p->destbuf, ZSTD_CStreamOutSize() * 2);
+struct enc_call_args
+{
+    VALUE self;
+    struct encoder *encoder;
+    VALUE src;
+};
+
+static VALUE
+enc_unbusy(VALUE pp)
+{
+    ((struct encoder *)pp)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * Call func(args) with marking the encoder as busy.
+ *
+ * func uses the context without the GVL and across the outport calls, so
+ * the other methods on the same encoder are rejected by encoder_context()
+ * until func is finished.
+ */
+static void
+enc_call(struct encoder *p, VALUE (*func)(VALUE), struct enc_call_args *args)
+{
+    p->busy = 1;
+    rb_ensure(func, (VALUE)args, enc_unbusy, (VALUE)p);
+}
+
+/*
+ * Prepare p->destbuf to append the compressed data up to write_chunk_size.
+ * The pending data (not passed to outport yet) is kept.
+ */
+static ZSTD_outBuffer
+enc_destbuf(VALUE self, struct encoder *p)
+{
+    int renew = NIL_P(p->destbuf) || RSTRING_LEN(p->destbuf) == 0;
+    aux_str_buf_recycle(&p->destbuf, p->write_chunk_size);
+    if (renew) {
         rb_str_set_len(p->destbuf, 0);
-        rb_obj_infect(self, src);
-        rb_obj_infect(p->destbuf, self);
-        ZSTD_outBuffer output = { RSTRING_PTR(p->destbuf), rb_str_capacity(p->destbuf), 0 };
-        size_t s = ZSTD_compressStream(p->context, &output, &input);
+    }
+    rb_obj_infect(p->destbuf, self);
+
+    ZSTD_outBuffer output = { RSTRING_PTR(p->destbuf), p->write_chunk_size, RSTRING_LEN(p->destbuf) };
+    return output;
+}
+
+/*
+ * Pass buf to outport.
+ */
+static void
+enc_output(struct encoder *p, VALUE buf)
+{
+    if (p->native_io) {
+        aux_io_write_str(p->outport, buf);
+    } else {
+        AUX_FUNCALL(p->outport, id_op_lsh, buf);
+    }
+    p->outport_calls++;
+}
+
+/*
+ * Pass the pending data to outport. Empty data is not passed.
+ */
+static void
+enc_push(struct encoder *p)
+{
+    if (NIL_P(p->destbuf) || RSTRING_LEN(p->destbuf) == 0) {
+        return;
+    }
+
+    enc_output(p, p->destbuf);
+
+    if (rb_obj_frozen_p(p->destbuf)) {
+        p->destbuf = Qnil;
+    } else {
+        rb_str_set_len(p->destbuf, 0);
+    }
+}
+
+static VALUE
+enc_write_body(VALUE args)
+{
+    struct enc_call_args *a = (struct enc_call_args *)args;
+    struct encoder *p = a->encoder;
+    ZSTD_inBuffer input = { RSTRING_PTR(a->src), RSTRING_LEN(a->src), 0 };
+
+    while (input.pos < input.size) {
+        ZSTD_outBuffer output = enc_destbuf(a->self, p);
+        size_t s = enc_compress(p, &output, &input, ZSTD_e_continue);
         extzstd_check_error(s);
         rb_str_set_len(p->destbuf, output.pos);
 
+        p->in_frame = 1;
+
         // TODO: 例外や帯域脱出した場合の挙動は?
         // TODO: src の途中経過状態を保存するべきか?
-        AUX_FUNCALL(p->outport, id_op_lsh, p->destbuf);
+        if (output.pos >= output.size) {
+            enc_push(p);
+        }
     }
 
+    return Qnil;
+}
+
+static VALUE
+enc_write(VALUE self, VALUE src)
+{
+    /*
+     * ZSTDLIB_API size_t ZSTD_compressStream2(ZSTD_CCtx* cctx, ZSTD_outBuffer* output, ZSTD_inBuffer* input, ZSTD_EndDirective endOp);
+     */
+
+    /* the source is referenced without the GVL, so take a frozen (shared) copy */
+    src = rb_str_new_frozen(rb_String(src));
+    struct encoder *p = encoder_compressor(self);
+
+    rb_obj_infect(self, src);
+
+    struct enc_call_args args = { self, p, src };
+    enc_call(p, enc_write_body, &args);
+
+    RB_GC_GUARD(src);
+
     return self;
 }
 
+struct enc_write_frame_args
+{
+    struct encoder *encoder;
+    VALUE dest;
+    VALUE src;
+    size_t status;
+};
+
 static VALUE
-enc_sync(VALUE self)
+enc_write_frame_nogvl(VALUE args)
+{
+    struct enc_write_frame_args *a = (struct enc_write_frame_args *)args;
+    a->status = aux_ZSTD_compress2(a->encoder->context,
+            RSTRING_PTR(a->dest), rb_str_capacity(a->dest),
+            RSTRING_PTR(a->src), RSTRING_LEN(a->src));
+    return Qnil;
+}
+
+static void enc_end_frame(VALUE self, struct encoder *p);
+
+static VALUE
+enc_write_frame_body(VALUE args)
+{
+    struct enc_call_args *a = (struct enc_call_args *)args;
+    struct encoder *p = a->encoder;
+
+    size_t bound = ZSTD_compressBound(RSTRING_LEN(a->src));
+    extzstd_check_error(bound);
+
+    if (p->in_frame) {
+        enc_end_frame(a->self, p);
+    }
+
+    VALUE dest = rb_str_buf_new(bound);
+    rb_obj_infect(dest, a->self);
+    rb_obj_infect(dest, a->src);
+
+    struct enc_write_frame_args wargs = { p, dest, a->src, 0 };
+    rb_str_locktmp(dest);
+    rb_ensure(enc_write_frame_nogvl, (VALUE)&wargs, rb_str_unlocktmp, dest);
+    extzstd_memory_flush();
+    extzstd_check_error(wargs.status);
+    /* shrink from ZSTD_compressBound(), because outport may keep the string */
+    rb_str_resize(dest, wargs.status);
+
+    p->frame_written = 1;
+    enc_output(p, dest);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  write_frame(src) -> self
+ *
+ * Compress the whole of src as one independent frame, and call
+ * <tt>outport << frame</tt> once.
+ *
+ * The destination is allocated by ZSTD_compressBound(), and
+ * ZSTD_compress2() compresses directly from src into it with the stable
+ * input/output buffers, instead of staging through the internal buffers
+ * and the output chunks of #write.
+ * It is suitable for the large input.
+ *
+ * When the frame written by #write is not finished, it is finished before.
+ */
+static VALUE
+enc_write_frame(VALUE self, VALUE src)
+{
+    /* the source is referenced without the GVL, so take a frozen (shared) copy */
+    src = rb_str_new_frozen(rb_String(src));
+    struct encoder *p = encoder_compressor(self);
+
+    struct enc_call_args args = { self, p, src };
+    enc_call(p, enc_write_frame_body, &args);
+
+    RB_GC_GUARD(src);
+
+    return self;
+}
+
+static VALUE
+enc_sync_body(VALUE args)
 {
     /*
      * ZSTDLIB_API size_t ZSTD_flushStream(ZSTD_CStream* zcs, ZSTD_outBuffer* output);
      */
 
-    struct encoder *p = encoder_context(self);
-    aux_str_buf_recycle(&p->destbuf, ZSTD_CStreamOutSize());
-    rb_str_set_len(p->destbuf, 0);
-    rb_obj_infect(p->destbuf, self);
-    ZSTD_outBuffer output = { RSTRING_PTR(p->destbuf), rb_str_capacity(p->destbuf), 0 };
-    size_t s = ZSTD_flushStream(p->context, &output);
-    extzstd_check_error(s);
-    rb_str_set_len(p->destbuf, output.pos);
+    struct enc_call_args *a = (struct enc_call_args *)args;
+    struct encoder *p = a->encoder;
+    ZSTD_inBuffer input = { NULL, 0, 0 };
+    size_t s;
 
-    AUX_FUNCALL(p->outport, id_op_lsh, p->destbuf);
+    /*
+     * In multithreaded mode, the flush may need to be repeated many times
+     * until all of the jobs are completed.
+     */
+    do {
+        ZSTD_outBuffer output = enc_destbuf(a->self, p);
+        s = enc_compress(p, &output, &input, ZSTD_e_flush);
+        extzstd_check_error(s);
+        rb_str_set_len(p->destbuf, output.pos);
 
-    return self;
+        if (output.pos >= output.size) {
+            enc_push(p);
+        }
+    } while (s > 0);
+
+    enc_push(p);
+
+    return Qnil;
 }
 
 static VALUE
-enc_close(VALUE self)
+enc_sync(VALUE self)
+{
+    struct encoder *p = encoder_compressor(self);
+    struct enc_call_args args = { self, p, Qnil };
+    enc_call(p, enc_sync_body, &args);
+    return self;
+}
+
+static void
+enc_end_frame(VALUE self, struct encoder *p)
 {
     /*
      * ZSTDLIB_API size_t ZSTD_endStream(ZSTD_CStream* zcs, ZSTD_outBuffer* output);
      */
 
-    struct encoder *p = encoder_context(self);
-    aux_str_buf_recycle(&p->destbuf, ZSTD_CStreamOutSize());
-    rb_str_set_len(p->destbuf, 0);
-    rb_obj_infect(p->destbuf, self);
-    ZSTD_outBuffer output = { RSTRING_PTR(p->destbuf), rb_str_capacity(p->destbuf), 0 };
-    size_t s = ZSTD_endStream(p->context, &output);
-    extzstd_check_error(s);
-    rb_str_set_len(p->destbuf, output.pos);
+    ZSTD_inBuffer input = { NULL, 0, 0 };
+    size_t s;
+
+    do {
+        ZSTD_outBuffer output = enc_destbuf(self, p);
+        s = enc_compress(p, &output, &input, ZSTD_e_end);
+        extzstd_check_error(s);
+        rb_str_set_len(p->destbuf, output.pos);
+
+        if (output.pos >= output.size) {
+            enc_push(p);
+        }
+    } while (s > 0);
+
+    enc_push(p);
+
+    p->in_frame = 0;
+    p->frame_written = 1;
+}
+
+static VALUE
+enc_end_frame_body(VALUE args)
+{
+    struct enc_call_args *a = (struct enc_call_args *)args;
+    enc_end_frame(a->self, a->encoder);
+    return Qnil;
+}
+
+static VALUE
+enc_close(VALUE self)
+{
+    struct encoder *p = getencoder(self);
+    if (!p->context && p->reached_eof) {
+        return Qnil; /* the workspace is released already */
+    }
 
-    AUX_FUNCALL(p->outport, id_op_lsh, p->destbuf);
+    p = encoder_compressor(self);
+
+    /* an empty frame is written when nothing is written */
+    if (p->in_frame || !p->frame_written) {
+        struct enc_call_args args = { self, p, Qnil };
+        enc_call(p, enc_end_frame_body, &args);
+    }
 
     p->reached_eof = 1;
 
+    if (p->arena) {
+        extzstd_workspace_release(p->arena);
+        p->arena = NULL;
+        p->context = NULL;
+    } else if (!NIL_P(p->pool)) {
+        ZSTD_CCtx *ctx = p->context;
+        p->context = NULL;
+        extzstd_contextpool_checkin(p->pool, EXTZSTD_CONTEXTPOOL_CCTX, p->pool_key, ctx, p->thread_pool, p->generation);
+    }
+
     return Qnil;
 }
 
 static VALUE
 enc_eof(VALUE self)
 {
-    return (encoder_context(self)->reached_eof == 0 ? Qfalse : Qtrue);
+    return (getencoder(self)->reached_eof == 0 ? Qfalse : Qtrue);
 }
 
 static VALUE
@@ -267,14 +727,14 @@ enc_reset(VALUE self, VALUE pledged_srcsize)
      * ZSTDLIB_API size_t ZSTD_CCtx_reset(ZSTD_CCtx* cctx, ZSTD_ResetDirective reset);
      */
 
-    size_t s = ZSTD_CCtx_reset(encoder_context(self)->context, ZSTD_reset_session_only);
+    unsigned long long srcsize = (NIL_P(pledged_srcsize) ? ZSTD_CONTENTSIZE_UNKNOWN : NUM2ULL(pledged_srcsize));
+    struct encoder *p = encoder_context(self);
+
+    size_t s = ZSTD_CCtx_reset(p->context, ZSTD_reset_session_only);
     extzstd_check_error(s);
+    p->in_frame = 0;
 
-    if (pledged_srcsize == Qnil) {
-        ZSTD_CCtx_setPledgedSrcSize(encoder_context(self)->context, ZSTD_CONTENTSIZE_UNKNOWN);
-    } else {
-        ZSTD_CCtx_setPledgedSrcSize(encoder_context(self)->context, NUM2ULL(pledged_srcsize));
-    }
+    ZSTD_CCtx_setPledgedSrcSize(p->context, srcsize);
 
     return self;
 }
@@ -291,6 +751,18 @@ enc_sizeof(VALUE self)
     return SIZET2NUM(s);
 }
 
+/*
+ * call-seq:
+ *  outport_calls -> integer
+ *
+ * Returns the number of <tt>outport << chunk</tt> calls.
+ */
+static VALUE
+enc_outport_calls(VALUE self)
+{
+    return ULL2NUM(getencoder(self)->outport_calls);
+}
+
 static void
 init_encoder(void)
 {
@@ -300,12 +772,14 @@ init_encoder(void)
     rb_define_const(cStreamEncoder, "OUTSIZE", SIZET2NUM(ZSTD_CStreamOutSize()));
     rb_define_method(cStreamEncoder, "initialize", enc_init, -1);
     rb_define_method(cStreamEncoder, "write", enc_write, 1);
+    rb_define_method(cStreamEncoder, "write_frame", enc_write_frame, 1);
     rb_define_method(cStreamEncoder, "sync", enc_sync, 0);
     rb_define_method(cStreamEncoder, "close", enc_close, 0);
     rb_define_method(cStreamEncoder, "eof", enc_eof, 0);
     rb_define_alias(cStreamEncoder, "eof?", "eof");
     rb_define_method(cStreamEncoder, "reset", enc_reset, 1);
     rb_define_method(cStreamEncoder, "sizeof", enc_sizeof, 0);
+    rb_define_method(cStreamEncoder, "outport_calls", enc_outport_calls, 0);
     rb_define_alias(cStreamEncoder, "<<", "write");
     rb_define_alias(cStreamEncoder, "update", "write");
     rb_define_alias(cStreamEncoder, "flush", "sync");
@@ -329,8 +803,20 @@ struct decoder
     VALUE inport;
     VALUE readbuf;
     VALUE predict;
+    struct extzstd_workspace *arena;    /* context is made in the leased Zstd::Workspace */
+    VALUE pool;         /* Zstd::ContextPool to return context by #close, or nil */
+    VALUE pool_key;
     ZSTD_inBuffer inbuf;
+    uint64_t pos;
+    size_t read_chunk_size;
+    uint64_t inport_calls;
+    int native_io;      /* inport is a plain IO, so read(2) directly */
     int reached_eof;
+    size_t read_ahead;  /* prefetch depth (0 is disabled) */
+    int busy;           /* the context is used by #read */
+#ifdef EXTZSTD_USE_FD
+    struct extzstd_readahead *readahead;
+#endif
 };
 
 static void
@@ -340,24 +826,68 @@ dec_mark(void *pp)
     rb_gc_mark(p->inport);
     rb_gc_mark(p->readbuf);
     rb_gc_mark(p->predict);
+    rb_gc_mark(p->pool);
+    rb_gc_mark(p->pool_key);
+}
+
+/*
+ * Stop the read-ahead thread, if running.
+ */
+static void
+dec_stop_readahead(struct decoder *p, int gvl)
+{
+#ifdef EXTZSTD_USE_FD
+    struct extzstd_readahead *ra = p->readahead;
+    p->readahead = NULL;
+    extzstd_readahead_free(ra, gvl);
+#else
+    (void)p; (void)gvl;
+#endif
 }
 
 static void
 dec_free(void *pp)
 {
     struct decoder *p = (struct decoder *)pp;
-    if (p->context) {
+    dec_stop_readahead(p, 0);
+    if (p->arena) {
+        extzstd_workspace_release(p->arena);
+        p->arena = NULL;
+        p->context = NULL;
+    } else if (p->context) {
         ZSTD_freeDCtx(p->context);
         p->context = NULL;
+        extzstd_memory_flush();
     }
     xfree(p);
 }
 
+static size_t
+dec_memsize(const void *pp)
+{
+    const struct decoder *p = (const struct decoder *)pp;
+    size_t size = sizeof(*p);
+    /* the workspace is counted by Zstd::Workspace */
+    if (p->context && !p->arena) {
+        size += ZSTD_sizeof_DStream(p->context);
+    }
+#ifdef EXTZSTD_USE_FD
+    if (p->readahead) {
+        size += p->read_ahead * p->read_chunk_size;
+    }
+#endif
+    return size;
+}
+
 AUX_IMPLEMENT_CONTEXT(
         struct decoder, decoder_type, "extzstd.Zstd::Decoder",
-        decoder_alloc_dummy, dec_mark, dec_free, NULL,
+        decoder_alloc_dummy, dec_mark, dec_free, dec_memsize,
         getdecoderp, getdecoder, decoder_p);
 
+/*
+ * Returns the decoder of self, that is initialized and is not used by
+ * #read of another thread.
+ */
 static struct decoder *
 decoder_context(VALUE self)
 {
@@ -367,6 +897,11 @@ decoder_context(VALUE self)
                 "uninitialized context - #<%s:%p>",
                 rb_obj_classname(self), (void *)self);
     }
+    if (p->busy) {
+        rb_raise(rb_eRuntimeError,
+                "decoder is in use by another thread - #<%s:%p>",
+                rb_obj_classname(self), (void *)self);
+    }
     return p;
 }
 
@@ -375,12 +910,56 @@ dec_alloc(VALUE mod)
 {
     struct decoder *p;
     VALUE obj = TypedData_Make_Struct(mod, struct decoder, &decoder_type, p);
+    p->pool = Qnil;
+    p->pool_key = Qnil;
+    p->read_chunk_size = EXT_PARTIAL_READ_SIZE;
     return obj;
 }
 
 /*
  * call-seq:
- *  initialize(inport, predict = Qnil)
+ *  initialize(inport, predict = nil, decode_params = nil)
+ *  initialize(inport, predict = nil, **opts)
+ *
+ * [inport]
+ *   Object that have +read+ method.
+ *
+ *   When given the plain IO (or File) instance, the compressed data is
+ *   read by read(2) on the file descriptor without the GVL, except while
+ *   the IO has the buffered data.
+ * [predict = nil (nil, string or Zstd::Dictionary::Decompressor)]
+ * [decode_params = nil (nil or Zstd::DecodeParameters)]
+ * [opts read_chunk_size: 256 KiB]
+ *   Size of each <tt>inport.read(size, buf)</tt>.
+ * [opts read_ahead: nil (nil or integer)]
+ *   Number of chunks to read ahead by a native helper thread, while the
+ *   current chunk is decompressed.
+ *   It is effective for the plain IO (or File) instance only, and is ignored
+ *   for the other objects.
+ *
+ *   The helper thread reads inport until end of file or #close, regardless
+ *   of the end of the frame. Do not use inport until #close.
+ * [opts workspace: nil (nil or Zstd::Workspace)]
+ *   Make the context in the workspace instead of allocating, and lease it
+ *   until #close.
+ *   predict must be nil or Zstd::Dictionary::Decompressor.
+ *   When +window_log_max+ is not given, the largest window that the
+ *   workspace can hold is used.
+ *   The decoder can not be used after #close, except for #eof?, #pos and
+ *   #inport_calls.
+ *   #close raises RuntimeError while another thread is in #read.
+ * [opts pool: nil (nil or Zstd::ContextPool)]
+ *   Reuse the idle context of the same decode parameters and predict in the
+ *   pool, and return the context to the pool by #close.
+ *   The decoder can not be used after #close, as same as +workspace+.
+ *   The context is not returned while another thread is in #read (#close
+ *   raises RuntimeError).
+ * [opts]
+ *   Other options are same as Zstd::DecodeParameters.new
+ *   (+window_log_max+, +ignore_checksum+, +format+, ...).
+ *
+ *   +stable_out_buffer+ can not be used, because each +read+ decodes into
+ *   the different buffer.
  */
 static VALUE
 dec_init(int argc, VALUE argv[], VALUE self)
@@ -392,20 +971,47 @@ dec_init(int argc, VALUE argv[], VALUE self)
      * ZSTDLIB_API size_t ZSTD_initDStream_usingDict(ZSTD_DStream* zds, const void* dict, size_t dictSize);
      */
 
-    VALUE inport, predict;
+    VALUE inport, predict, dparams, opts;
+    rb_scan_args(argc, argv, "12:", &inport, &predict, &dparams, &opts);
+
+    size_t read_chunk_size = EXT_PARTIAL_READ_SIZE;
+    size_t read_ahead = 0;
+    VALUE workspace = Qnil, pool = Qnil;
+    if (!NIL_P(opts)) {
+        ID ids[4] = { rb_intern("read_chunk_size"), rb_intern("read_ahead"), rb_intern("workspace"), rb_intern("pool") };
+        VALUE v[4] = { Qundef, Qundef, Qundef, Qundef };
+        opts = rb_hash_dup(opts);
+        rb_get_kwargs(opts, ids, 0, -1 - 4, v);
+        if (v[0] != Qundef && !NIL_P(v[0])) {
+            read_chunk_size = aux_chunk_size(v[0]);
+        }
+        if (v[1] != Qundef && !NIL_P(v[1])) {
+            long n = NUM2LONG(v[1]);
+            if (n < 0 || n > EXT_READ_AHEAD_MAX) {
+                rb_raise(rb_eArgError,
+                         "read_ahead is out of range (given %ld, expected 0..%d)",
+                         n, EXT_READ_AHEAD_MAX);
+            }
+            read_ahead = (size_t)n;
+        }
+        if (v[2] != Qundef) {
+            workspace = v[2];
+        }
+        if (v[3] != Qundef) {
+            pool = v[3];
+        }
+        if (RHASH_SIZE(opts) == 0) {
+            opts = Qnil;
+        }
+    }
 
-    switch (argc) {
-    case 1:
-        inport = argv[0];
-        predict = Qnil;
-        break;
-    case 2:
-        inport = argv[0];
-        predict = argv[1];
-        break;
-    default:
-        rb_error_arity(argc, 1, 2);
+    if (!NIL_P(opts)) {
+        if (!NIL_P(dparams)) {
+            rb_raise(rb_eArgError, "decode_params and keyword options are given together");
+        }
+        dparams = opts;
     }
+    dparams = extzstd_dparams_new(dparams);
 
     struct decoder *p = getdecoder(self);
     if (p->context) {
@@ -414,25 +1020,63 @@ dec_init(int argc, VALUE argv[], VALUE self)
                 rb_obj_classname(self), (void *)self);
     }
 
-    AUX_TRY_WITH_GC(
-            p->context = ZSTD_createDCtx(),
-            "failed ZSTD_createDCtx()");
-
-    //ZSTD_DCtx_reset
-    //ZSTD_DCtx_loadDictionary
-    if (NIL_P(predict)) {
-        //size_t s = ZSTD_initDStream(p->context);
-        //extzstd_check_error(s);
-    } else {
+    if (!NIL_P(predict) && !extzstd_ddict_p(predict)) {
         rb_check_type(predict, RUBY_T_STRING);
         predict = rb_str_new_frozen(predict);
-        //size_t s = ZSTD_initDStream_usingDict(p->context, RSTRING_PTR(predict), RSTRING_LEN(predict));
-        size_t s = ZSTD_DCtx_loadDictionary(p->context, RSTRING_PTR(predict), RSTRING_LEN(predict));
-        extzstd_check_error(s);
+    }
+
+    VALUE pool_key = Qnil;
+    if (!NIL_P(pool)) {
+        if (!NIL_P(workspace)) {
+            rb_raise(rb_eArgError, "workspace and pool are given together");
+        }
+        VALUE key[2] = { dparams, predict };
+        VALUE thread_pool;
+        pool_key = extzstd_contextpool_key(ELEMENTOF(key), key);
+        p->context = (ZSTD_DCtx *)extzstd_contextpool_checkout(pool, EXTZSTD_CONTEXTPOOL_DCTX, pool_key, &thread_pool);
+    }
+
+    if (p->context) {
+        /* reused the context of the pool */
+    } else {
+        ZSTD_DCtx *dctx;
+        if (NIL_P(workspace)) {
+            AUX_TRY_WITH_GC(
+                    dctx = extzstd_create_dctx(),
+                    "failed ZSTD_createDCtx()");
+            extzstd_dparams_setup_dctx(dctx, dparams);
+        } else {
+            dctx = extzstd_workspace_dctx(workspace, dparams, predict, &p->arena);
+        }
+        p->context = dctx;
+
+        //ZSTD_DCtx_reset
+        //ZSTD_DCtx_loadDictionary
+        if (NIL_P(predict)) {
+            //size_t s = ZSTD_initDStream(p->context);
+            //extzstd_check_error(s);
+        } else if (extzstd_ddict_p(predict)) {
+            size_t s = ZSTD_DCtx_refDDict(p->context, extzstd_getddict(predict));
+            if (ZSTD_isError(s) && p->arena) {
+                extzstd_workspace_release(p->arena);
+                p->arena = NULL;
+                p->context = NULL;
+            }
+            extzstd_check_error(s);
+        } else {
+            //size_t s = ZSTD_initDStream_usingDict(p->context, RSTRING_PTR(predict), RSTRING_LEN(predict));
+            size_t s = ZSTD_DCtx_loadDictionary(p->context, RSTRING_PTR(predict), RSTRING_LEN(predict));
+            extzstd_check_error(s);
+        }
     }
 
     p->inport = inport;
     p->predict = predict;
+    p->pool = pool;
+    p->pool_key = pool_key;
+    p->read_chunk_size = read_chunk_size;
+    p->native_io = aux_io_readable_fd_p(inport);
+    p->read_ahead = read_ahead;
 
     return self;
 }
@@ -441,11 +1085,36 @@ static int
 dec_read_fetch(VALUE o, struct decoder *p)
 {
     if (!p->inbuf.src || NIL_P(p->readbuf) || p->inbuf.pos >= (size_t)RSTRING_LEN(p->readbuf)) {
-        aux_str_buf_recycle(&p->readbuf, EXT_PARTIAL_READ_SIZE);
-        VALUE st = AUX_FUNCALL(p->inport, id_read, INT2FIX(EXT_PARTIAL_READ_SIZE), p->readbuf);
-        if (NIL_P(st)) { return -1; }
-        rb_check_type(st, RUBY_T_STRING);
-        p->readbuf = st;
+        aux_str_buf_recycle(&p->readbuf, p->read_chunk_size);
+#ifdef EXTZSTD_USE_FD
+        if (p->native_io && p->read_ahead > 0 && !p->readahead && !aux_io_read_pending(p->inport)) {
+            /* started after the buffered data of the IO is read */
+            AUX_TRY_WITH_GC(
+                    p->readahead = extzstd_readahead_new(aux_io_fd(p->inport), p->read_chunk_size, p->read_ahead),
+                    "failed to start the read-ahead thread");
+        }
+        if (p->readahead) {
+            size_t n = extzstd_readahead_read(p->readahead, p->readbuf);
+            p->inport_calls++;
+            if (n == 0) {
+                dec_stop_readahead(p, 1);
+                return -1;
+            }
+            rb_str_set_len(p->readbuf, n);
+        } else
+#endif
+        if (p->native_io && !aux_io_read_pending(p->inport)) {
+            size_t n = aux_io_read_str(p->inport, p->readbuf, 0, p->read_chunk_size);
+            p->inport_calls++;
+            if (n == 0) { return -1; }
+            rb_str_set_len(p->readbuf, n);
+        } else {
+            VALUE st = AUX_FUNCALL(p->inport, id_read, SIZET2NUM(p->read_chunk_size), p->readbuf);
+            p->inport_calls++;
+            if (NIL_P(st)) { return -1; }
+            rb_check_type(st, RUBY_T_STRING);
+            p->readbuf = st;
+        }
         rb_obj_infect(o, p->readbuf);
         p->inbuf.size = RSTRING_LEN(p->readbuf);
         p->inbuf.pos = 0;
@@ -456,18 +1125,57 @@ dec_read_fetch(VALUE o, struct decoder *p)
     return 0;
 }
 
+struct dec_decompress_args
+{
+    struct decoder *decoder;
+    ZSTD_outBuffer *output;
+    size_t status;
+};
+
+static VALUE
+dec_decompress_nogvl(VALUE args)
+{
+    struct dec_decompress_args *a = (struct dec_decompress_args *)args;
+    a->status = aux_ZSTD_decompressStream(a->decoder->context, a->output, &a->decoder->inbuf);
+    return Qnil;
+}
+
+/*
+ * Run ZSTD_decompressStream() without the GVL.
+ *
+ * p->readbuf is locked while the GVL is released.
+ * The destination string must be locked by the caller.
+ */
 static size_t
-dec_read_decode(VALUE o, struct decoder *p, char *buf, ssize_t size)
+dec_decompress(struct decoder *p, ZSTD_outBuffer *output)
 {
+    struct dec_decompress_args args = { p, output, 0 };
+    VALUE readbuf = p->readbuf;
+    rb_str_locktmp(readbuf);
+    rb_ensure(dec_decompress_nogvl, (VALUE)&args, rb_str_unlocktmp, readbuf);
+    extzstd_memory_flush();
+    return args.status;
+}
 
-    if (p->reached_eof != 0) {
-        return 0;
-    }
+struct dec_read_decode_args
+{
+    VALUE decoder;
+    struct decoder *p;
+    VALUE dest;
+    size_t off;
+    ssize_t size;
+    size_t pos;
+};
 
-    ZSTD_outBuffer output = { buf, size, 0 };
+static VALUE
+dec_read_decode_loop(VALUE args)
+{
+    struct dec_read_decode_args *a = (struct dec_read_decode_args *)args;
+    struct decoder *p = a->p;
+    ZSTD_outBuffer output = { NULL, a->size, 0 };
 
-    while (size < 0 || output.pos < (size_t)size) {
-        if (dec_read_fetch(o, p) != 0) {
+    while (a->size < 0 || output.pos < (size_t)a->size) {
+        if (dec_read_fetch(a->decoder, p) != 0) {
             if (p->reached_eof == 0) {
                 rb_raise(rb_eRuntimeError,
                          "unexpected EOF - #<%s:%p>",
@@ -477,16 +1185,40 @@ dec_read_decode(VALUE o, struct decoder *p, char *buf, ssize_t size)
             break;
         }
 
-        rb_thread_check_ints();
-        size_t s = ZSTD_decompressStream(p->context, &output, &p->inbuf);
+        output.dst = RSTRING_PTR(a->dest) + a->off;
+        size_t s = dec_decompress(p, &output);
+        a->pos = output.pos;
         extzstd_check_error(s);
         if (s == 0) {
             p->reached_eof = 1;
+            dec_stop_readahead(p, 1);
             break;
         }
     }
 
-    return output.pos;
+    return Qnil;
+}
+
+/*
+ * Decompress into dest[off, size].
+ *
+ * dest is locked while decompressing, so the ``inport.read'' called between
+ * each steps can not modify it.
+ */
+static size_t
+dec_read_decode(VALUE o, struct decoder *p, VALUE dest, size_t off, ssize_t size)
+{
+
+    if (p->reached_eof != 0) {
+        return 0;
+    }
+
+    struct dec_read_decode_args args = { o, p, dest, off, size, 0 };
+    rb_str_locktmp(dest);
+    rb_ensure(dec_read_decode_loop, (VALUE)&args, rb_str_unlocktmp, dest);
+    extzstd_memory_flush();
+
+    return args.pos;
 }
 
 static void
@@ -534,29 +1266,25 @@ dec_read_args(int argc, VALUE argv[], VALUE self, VALUE *buf, ssize_t *size)
     }
 }
 
-/*
- * call-seq:
- *  read -> read_data
- *  read(readsize, buf = "".b) -> buf
- */
-static VALUE
-dec_read(int argc, VALUE argv[], VALUE self)
+struct dec_read_args
 {
-    /*
-     * ZSTDLIB_API size_t ZSTD_decompressStream(ZSTD_DStream* zds, ZSTD_outBuffer* output, ZSTD_inBuffer* input);
-     */
-
-    ssize_t size;
+    VALUE self;
+    struct decoder *decoder;
     VALUE buf;
-    dec_read_args(argc, argv, self, &buf, &size);
-
-    struct decoder *p = decoder_context(self);
+    ssize_t size;
+};
 
-    if (size == 0) {
-        rb_str_set_len(buf, 0);
-        return buf;
-    } else if (size > 0) {
-        size = dec_read_decode(self, p, RSTRING_PTR(buf), size);
+static VALUE
+dec_read_body(VALUE args)
+{
+    struct dec_read_args *a = (struct dec_read_args *)args;
+    VALUE self = a->self;
+    struct decoder *p = a->decoder;
+    VALUE buf = a->buf;
+    ssize_t size = a->size;
+
+    if (size > 0) {
+        size = dec_read_decode(self, p, buf, 0, size);
         rb_str_set_len(buf, size);
     } else {
         /* if (size < 0) */
@@ -565,7 +1293,7 @@ dec_read(int argc, VALUE argv[], VALUE self)
 
         for (;;) {
             aux_str_modify_expand(buf, capa);
-            size = dec_read_decode(self, p, RSTRING_PTR(buf) + RSTRING_LEN(buf), capa - RSTRING_LEN(buf));
+            size = dec_read_decode(self, p, buf, RSTRING_LEN(buf), capa - RSTRING_LEN(buf));
             rb_str_set_len(buf, RSTRING_LEN(buf) + size);
             if (size == 0) { break; }
             size = rb_str_capacity(buf);
@@ -578,8 +1306,54 @@ dec_read(int argc, VALUE argv[], VALUE self)
         }
     }
 
+    return Qnil;
+}
+
+static VALUE
+dec_unbusy(VALUE pp)
+{
+    ((struct decoder *)pp)->busy = 0;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  read -> read_data
+ *  read(readsize, buf = "".b) -> buf
+ *
+ * The other methods on the decoder (including #close) are rejected by
+ * RuntimeError while another thread is in #read.
+ */
+static VALUE
+dec_read(int argc, VALUE argv[], VALUE self)
+{
+    /*
+     * ZSTDLIB_API size_t ZSTD_decompressStream(ZSTD_DStream* zds, ZSTD_outBuffer* output, ZSTD_inBuffer* input);
+     */
+
+    ssize_t size;
+    VALUE buf;
+    dec_read_args(argc, argv, self, &buf, &size);
+
+    struct decoder *p = decoder_context(self);
+
+    if (size == 0) {
+        rb_str_set_len(buf, 0);
+        return buf;
+    }
+
+    /*
+     * the context and the read-ahead ring are used without the GVL and
+     * across the inport calls until the end of the read
+     */
+    struct dec_read_args args = { self, p, buf, size };
+    p->busy = 1;
+    rb_ensure(dec_read_body, (VALUE)&args, dec_unbusy, (VALUE)p);
+
     rb_obj_infect(buf, self);
 
+    p->pos += RSTRING_LEN(buf);
+
     if (RSTRING_LEN(buf) == 0) {
         return Qnil;
     } else {
@@ -590,13 +1364,39 @@ dec_read(int argc, VALUE argv[], VALUE self)
 static VALUE
 dec_eof(VALUE self)
 {
-    return (decoder_context(self)->reached_eof == 0 ? Qfalse : Qtrue);
+    return (getdecoder(self)->reached_eof == 0 ? Qfalse : Qtrue);
 }
 
 static VALUE
 dec_close(VALUE self)
 {
-    decoder_context(self)->reached_eof = 1;
+    struct decoder *p = getdecoder(self);
+    if (!p->context && p->reached_eof) {
+        return Qnil; /* the workspace is released already */
+    }
+
+    /*
+     * raises while #read of another thread uses the context (in the
+     * workspace) and the read-ahead ring, and #read is rejected while the
+     * GVL is released to join the read-ahead thread
+     */
+    p = decoder_context(self);
+    p->reached_eof = 1;
+    p->busy = 1;
+    dec_stop_readahead(p, 1);
+    p->busy = 0;
+
+    if (p->arena) {
+        extzstd_workspace_release(p->arena);
+        p->arena = NULL;
+        p->context = NULL;
+    } else if (!NIL_P(p->pool)) {
+        /* not used by #read of another thread (checked above) */
+        ZSTD_DCtx *ctx = p->context;
+        p->context = NULL;
+        extzstd_contextpool_checkin(p->pool, EXTZSTD_CONTEXTPOOL_DCTX, p->pool_key, ctx, Qnil, extzstd_fork_generation);
+    }
+
     return Qnil;
 }
 
@@ -622,11 +1422,29 @@ dec_sizeof(VALUE self)
     return SIZET2NUM(s);
 }
 
+/*
+ * call-seq:
+ *  pos -> integer
+ *
+ * Returns the number of decoded bytes read from the decoder.
+ */
 static VALUE
 dec_pos(VALUE self)
 {
-    decoder_context(self); /* check only */
-    return INT2FIX(0);
+    return ULL2NUM(getdecoder(self)->pos);
+}
+
+/*
+ * call-seq:
+ *  inport_calls -> integer
+ *
+ * Returns the number of <tt>inport.read</tt> calls
+ * (the read chunks for the plain IO).
+ */
+static VALUE
+dec_inport_calls(VALUE self)
+{
+    return ULL2NUM(getdecoder(self)->inport_calls);
 }
 
 static void
@@ -644,6 +1462,7 @@ init_decoder(void)
     rb_define_method(cStreamDecoder, "reset", dec_reset, 0);
     rb_define_method(cStreamDecoder, "sizeof", dec_sizeof, 0);
     rb_define_method(cStreamDecoder, "pos", dec_pos, 0);
+    rb_define_method(cStreamDecoder, "inport_calls", dec_inport_calls, 0);
 
     (void)decoder_alloc_dummy;
     (void)getdecoderp;
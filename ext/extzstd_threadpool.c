@@ -0,0 +1,382 @@
+#include "extzstd.h"
+#include <common/threading.h>
+#ifdef HAVE_PTHREAD_ATFORK
+#   include <pthread.h>
+#endif
+
+/*
+ * class Zstd::ThreadPool
+ *
+ * The worker threads for the multithreaded compression, shared by the
+ * compression contexts through ZSTD_CCtx_refThreadPool().
+ *
+ * The pool must outlive the contexts that refer it, so the users keep the
+ * ThreadPool object (marked by GC) as long as their context.
+ * The process-wide default pool is never freed.
+ *
+ * NOTE: zstdmt resizes the referred pool when the workers of a used context
+ * are changed, so the contexts here set ZSTD_c_nbWorkers only once.
+ *
+ * After fork(2), the worker threads do not exist in the child process.
+ * The pools made before fork are left (freeing them waits for the lost
+ * threads forever), and are made again by the first use in the child.
+ */
+
+static VALUE cThreadPool;
+
+struct threadpool
+{
+    ZSTD_threadPool *pool;
+    size_t size;
+    unsigned int generation;    /* extzstd_fork_generation at made the pool */
+    int shared;                 /* the default pool, not freed */
+};
+
+unsigned int extzstd_fork_generation;
+
+static ZSTD_threadPool *default_pool;
+static size_t default_pool_size;
+static ZSTD_pthread_mutex_t threadpool_mutex; /* for default_pool and remaking after fork */
+
+static void
+threadpool_free(void *pp)
+{
+    struct threadpool *p = (struct threadpool *)pp;
+    if (p->pool && !p->shared && !extzstd_forked_p(p->generation)) {
+        ZSTD_freeThreadPool(p->pool);
+    }
+    xfree(p);
+}
+
+static size_t
+threadpool_memsize(const void *pp)
+{
+    return sizeof(struct threadpool);
+}
+
+static const rb_data_type_t threadpool_type = {
+    .wrap_struct_name = "extzstd.Zstd::ThreadPool",
+    .function.dfree = threadpool_free,
+    .function.dsize = threadpool_memsize,
+#ifdef RUBY_TYPED_FROZEN_SHAREABLE
+    .flags = RUBY_TYPED_FROZEN_SHAREABLE,
+#endif
+};
+
+static struct threadpool *
+getthreadpool(VALUE v)
+{
+    struct threadpool *p = (struct threadpool *)rb_check_typeddata(v, &threadpool_type);
+    if (!p->pool) {
+        rb_raise(rb_eTypeError,
+                 "uninitialized thread pool - #<%s:%p>",
+                 rb_obj_classname(v), (void *)v);
+    }
+    return p;
+}
+
+static ZSTD_threadPool *threadpool_default(size_t *size);
+
+/*
+ * Returns the pool for the current process.
+ * The pool made before fork is replaced with the new one.
+ */
+static ZSTD_threadPool *
+threadpool_get(VALUE v)
+{
+    struct threadpool *p = getthreadpool(v);
+
+    if (p->shared) {
+        return threadpool_default(NULL);
+    }
+
+    ZSTD_pthread_mutex_lock(&threadpool_mutex);
+    if (extzstd_forked_p(p->generation)) {
+        ZSTD_threadPool *pool = ZSTD_createThreadPool(p->size);
+        if (pool) {
+            p->pool = pool;
+            p->generation = extzstd_fork_generation;
+        }
+    }
+    int forked = extzstd_forked_p(p->generation);
+    ZSTD_threadPool *pool = p->pool;
+    ZSTD_pthread_mutex_unlock(&threadpool_mutex);
+
+    if (forked) {
+        errno = ENOMEM;
+        rb_sys_fail("failed ZSTD_createThreadPool()");
+    }
+
+    return pool;
+}
+
+static VALUE
+threadpool_alloc(VALUE mod)
+{
+    struct threadpool *p;
+    return TypedData_Make_Struct(mod, struct threadpool, &threadpool_type, p);
+}
+
+static size_t
+threadpool_size_arg(VALUE size)
+{
+    ZSTD_bounds b = ZSTD_cParam_getBounds(ZSTD_c_nbWorkers);
+    long n = (NIL_P(size) ? extzstd_cpu_count() : NUM2LONG(size));
+
+    if (NIL_P(size) && n > b.upperBound) { n = b.upperBound; }
+    if (n < 1 || n > b.upperBound) {
+        rb_raise(rb_eArgError,
+                 "thread pool size is out of range (given %ld, expected 1..%d)",
+                 n, b.upperBound);
+    }
+
+    return (size_t)n;
+}
+
+/*
+ * Returns the process-wide default pool, created by the first call.
+ */
+static ZSTD_threadPool *
+threadpool_default(size_t *size)
+{
+    size_t n = threadpool_size_arg(Qnil);
+
+    ZSTD_pthread_mutex_lock(&threadpool_mutex);
+    if (!default_pool) {
+        default_pool_size = n;
+        default_pool = ZSTD_createThreadPool(n);
+    }
+    ZSTD_threadPool *pool = default_pool;
+    if (size) { *size = default_pool_size; }
+    ZSTD_pthread_mutex_unlock(&threadpool_mutex);
+
+    if (!pool) {
+        errno = ENOMEM;
+        rb_sys_fail("failed ZSTD_createThreadPool()");
+    }
+
+    return pool;
+}
+
+static VALUE
+threadpool_default_protected(VALUE pp)
+{
+    *(ZSTD_threadPool **)pp = threadpool_default(NULL);
+    return Qnil;
+}
+
+struct threadpool_get_args
+{
+    VALUE pool;
+    ZSTD_threadPool **tp;
+};
+
+static VALUE
+threadpool_get_protected(VALUE args)
+{
+    struct threadpool_get_args *a = (struct threadpool_get_args *)args;
+    *a->tp = threadpool_get(a->pool);
+    return Qnil;
+}
+
+/*
+ * Refer the thread pool from the compression context.
+ *
+ * [pool]
+ *   Zstd::ThreadPool, true (the default pool), false (the context creates
+ *   own workers), or nil (the default pool only if ZSTD_c_nbWorkers is set).
+ *
+ * Returns the ThreadPool object that the caller must keep with ctx, or nil.
+ * When an error occurs, +ctx+ is released and an exception is raised.
+ */
+VALUE
+extzstd_threadpool_setup_cctx(ZSTD_CCtx *ctx, VALUE pool)
+{
+    if (pool == Qfalse) {
+        return Qnil;
+    }
+
+    if (NIL_P(pool) || pool == Qtrue) {
+        if (NIL_P(pool)) {
+            int workers = 0;
+            ZSTD_CCtx_getParameter(ctx, ZSTD_c_nbWorkers, &workers);
+            if (workers < 1) {
+                return Qnil;
+            }
+        }
+
+        ZSTD_threadPool *tp = NULL;
+        int state;
+        rb_protect(threadpool_default_protected, (VALUE)&tp, &state);
+        if (state) {
+            ZSTD_freeCCtx(ctx);
+            rb_jump_tag(state);
+        }
+        aux_ZSTD_CCtx_refThreadPool(ctx, tp);
+
+        return Qnil;
+    }
+
+    if (!rb_typeddata_is_kind_of(pool, &threadpool_type)) {
+        ZSTD_freeCCtx(ctx);
+        rb_raise(rb_eTypeError,
+                 "wrong thread_pool - %" PRIsVALUE " (expected Zstd::ThreadPool, true, false or nil)",
+                 rb_inspect(pool));
+    }
+
+    ZSTD_threadPool *tp = NULL;
+    int state;
+    rb_protect(threadpool_get_protected, (VALUE)&(struct threadpool_get_args){ pool, &tp }, &state);
+    if (state) {
+        ZSTD_freeCCtx(ctx);
+        rb_jump_tag(state);
+    }
+    aux_ZSTD_CCtx_refThreadPool(ctx, tp);
+
+    return pool;
+}
+
+/*
+ * call-seq:
+ *  initialize(size = nil)
+ *
+ * Create the worker threads.
+ *
+ * The instance is frozen and can be shared by Ractors.
+ *
+ * [size = nil (nil or positive integer)]
+ *   Number of worker threads.
+ *   nil means the number of online processors.
+ */
+static VALUE
+threadpool_init(int argc, VALUE argv[], VALUE self)
+{
+    VALUE size;
+    rb_scan_args(argc, argv, "01", &size);
+
+    struct threadpool *p = (struct threadpool *)rb_check_typeddata(self, &threadpool_type);
+    if (p->pool) { reiniterror(self); }
+
+    size_t n = threadpool_size_arg(size);
+    AUX_TRY_WITH_GC(
+            p->pool = ZSTD_createThreadPool(n),
+            "failed ZSTD_createThreadPool()");
+    p->size = n;
+    p->generation = extzstd_fork_generation;
+
+    rb_obj_freeze(self);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  default -> thread pool
+ *
+ * Returns the process-wide default pool.
+ * It has the threads as many as the online processors, and is used by the
+ * compression contexts that have +workers+ without +thread_pool+ option.
+ */
+static VALUE
+threadpool_s_default(VALUE mod)
+{
+    size_t size;
+    ZSTD_threadPool *pool = threadpool_default(&size);
+
+    struct threadpool *p;
+    VALUE obj = TypedData_Make_Struct(cThreadPool, struct threadpool, &threadpool_type, p);
+    p->pool = pool;
+    p->size = size;
+    p->shared = 1;
+
+    return rb_obj_freeze(obj);
+}
+
+static VALUE
+threadpool_size(VALUE self)
+{
+    return SIZET2NUM(getthreadpool(self)->size);
+}
+
+/*
+ * call-seq:
+ *  default? -> true or false
+ */
+static VALUE
+threadpool_default_p(VALUE self)
+{
+    return (getthreadpool(self)->shared ? Qtrue : Qfalse);
+}
+
+#ifdef HAVE_PTHREAD_ATFORK
+/*
+ * Stop another thread in the middle of threadpool_mutex while fork.
+ */
+static void
+threadpool_atfork_prepare(void)
+{
+    ZSTD_pthread_mutex_lock(&threadpool_mutex);
+}
+
+static void
+threadpool_atfork_parent(void)
+{
+    ZSTD_pthread_mutex_unlock(&threadpool_mutex);
+}
+
+/*
+ * Forget the threads of the parent process.
+ * The default pool is made again by the next use.
+ */
+static void
+threadpool_atfork_child(void)
+{
+    extzstd_fork_generation++;
+    default_pool = NULL;
+    default_pool_size = 0;
+    ZSTD_pthread_mutex_init(&threadpool_mutex, NULL);
+}
+#endif /* HAVE_PTHREAD_ATFORK */
+
+/*
+ * Returns true if ctx may have the worker threads (and is unusable after fork).
+ */
+int
+extzstd_cctx_mt_p(ZSTD_CCtx *ctx)
+{
+    int workers = 0;
+    ZSTD_CCtx_getParameter(ctx, ZSTD_c_nbWorkers, &workers);
+    return workers > 0;
+}
+
+/*
+ * Release the compression context that is made in the parent process.
+ * The multithreaded context is left, because its threads are lost.
+ */
+void
+extzstd_discard_cctx(ZSTD_CCtx *ctx)
+{
+    if (ctx && !extzstd_cctx_mt_p(ctx)) {
+        ZSTD_freeCCtx(ctx);
+    }
+}
+
+/*
+ * initialize for extzstd_threadpool.c
+ */
+
+void
+extzstd_init_threadpool(void)
+{
+    ZSTD_pthread_mutex_init(&threadpool_mutex, NULL);
+#ifdef HAVE_PTHREAD_ATFORK
+    pthread_atfork(threadpool_atfork_prepare, threadpool_atfork_parent, threadpool_atfork_child);
+#endif
+
+    cThreadPool = rb_define_class_under(extzstd_mZstd, "ThreadPool", rb_cObject);
+    rb_define_alloc_func(cThreadPool, threadpool_alloc);
+    rb_define_singleton_method(cThreadPool, "default", threadpool_s_default, 0);
+    rb_define_method(cThreadPool, "initialize", threadpool_init, -1);
+    rb_define_method(cThreadPool, "size", threadpool_size, 0);
+    rb_define_method(cThreadPool, "default?", threadpool_default_p, 0);
+}
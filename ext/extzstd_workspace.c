@@ -0,0 +1,357 @@
+#include "extzstd.h"
+
+/*
+ * class Zstd::Workspace
+ *
+ * The preallocated memory for one compression or decompression context
+ * (ZSTD_initStaticCCtx() and ZSTD_initStaticDCtx()).
+ *
+ * Zstd::Encoder and Zstd::Decoder lease the workspace by the +workspace+
+ * option until #close, and libzstd does not allocate any memory for the
+ * context in the meantime.
+ *
+ * The memory is shared by the Workspace object and the leasing context
+ * with the reference count, because they may be freed by GC in any order.
+ */
+
+static VALUE cWorkspace;
+
+struct extzstd_workspace
+{
+    void *memory;
+    size_t capacity;
+    int refs;
+    int busy;           /* leased by a context */
+};
+
+static void
+arena_unref(struct extzstd_workspace *arena)
+{
+    if (--arena->refs == 0) {
+        xfree(arena->memory);
+        xfree(arena);
+    }
+}
+
+static void
+workspace_free(void *pp)
+{
+    if (pp) {
+        arena_unref((struct extzstd_workspace *)pp);
+    }
+}
+
+static size_t
+workspace_memsize(const void *pp)
+{
+    const struct extzstd_workspace *arena = (const struct extzstd_workspace *)pp;
+    return (arena ? sizeof(*arena) + arena->capacity : 0);
+}
+
+AUX_IMPLEMENT_CONTEXT(
+        struct extzstd_workspace, workspace_type, "extzstd.Zstd::Workspace",
+        workspace_alloc, NULL, workspace_free, workspace_memsize,
+        getworkspacep, getworkspace, workspace_p);
+
+static void
+workspace_check_capacity(struct extzstd_workspace *arena, size_t needs, const char *purpose)
+{
+    if (arena->capacity < needs) {
+        rb_raise(rb_eArgError,
+                 "workspace is too small for %s (capacity %" PRIuSIZE " bytes, needs %" PRIuSIZE " bytes)",
+                 purpose, arena->capacity, needs);
+    }
+}
+
+static struct extzstd_workspace *
+workspace_lease(VALUE workspace)
+{
+    struct extzstd_workspace *arena = getworkspace(workspace);
+    if (arena->busy) {
+        rb_raise(rb_eRuntimeError,
+                 "workspace is in use by another context - #<%s:%p>",
+                 rb_obj_classname(workspace), (void *)workspace);
+    }
+    return arena;
+}
+
+static size_t
+estimate_cstream_size(VALUE params)
+{
+    size_t s;
+    if (extzstd_params_p(params)) {
+        s = ZSTD_estimateCStreamSize_usingCCtxParams(extzstd_getparams(params));
+    } else {
+        s = ZSTD_estimateCStreamSize(aux_num2int(params, ZSTD_CLEVEL_DEFAULT));
+    }
+    extzstd_check_error(s);
+    return s;
+}
+
+static size_t
+estimate_cctx_size(VALUE params)
+{
+    size_t s;
+    if (extzstd_params_p(params)) {
+        s = ZSTD_estimateCCtxSize_usingCCtxParams(extzstd_getparams(params));
+    } else {
+        s = ZSTD_estimateCCtxSize(aux_num2int(params, ZSTD_CLEVEL_DEFAULT));
+    }
+    extzstd_check_error(s);
+    return s;
+}
+
+/*
+ * Make the static compression context in workspace for params (nil,
+ * integer or Zstd::Parameters), and lease workspace until
+ * extzstd_workspace_release(*arena).
+ *
+ * Raises ArgumentError if workspace is smaller than
+ * ZSTD_estimateCStreamSize() of params, or if the multithreaded
+ * compression or the raw dictionary is requested (they allocate the
+ * memory).
+ */
+ZSTD_CCtx *
+extzstd_workspace_cctx(VALUE workspace, VALUE params, VALUE predict, VALUE opts, struct extzstd_workspace **arena)
+{
+    struct extzstd_workspace *a = workspace_lease(workspace);
+
+    if (!NIL_P(predict) && !extzstd_cdict_p(predict)) {
+        rb_raise(rb_eArgError,
+                 "workspace needs Zstd::Dictionary::Compressor instead of the raw dictionary");
+    }
+
+    VALUE workers = (NIL_P(opts) ? Qnil : rb_hash_lookup(opts, ID2SYM(rb_intern("workers"))));
+    int nworkers = 0;
+    if (extzstd_params_p(params)) {
+        ZSTD_CCtxParams_getParameter(extzstd_getparams(params), ZSTD_c_nbWorkers, &nworkers);
+    }
+    if (aux_num2int(workers, nworkers) > 0) {
+        rb_raise(rb_eArgError, "workspace can not be used with workers");
+    }
+
+    workspace_check_capacity(a, estimate_cstream_size(params), "the compression parameters");
+
+    ZSTD_CCtx *ctx = ZSTD_initStaticCCtx(a->memory, a->capacity);
+    if (!ctx) {
+        workspace_check_capacity(a, SIZE_MAX, "the compression context");
+    }
+
+    a->busy = 1;
+    a->refs++;
+    *arena = a;
+
+    return ctx;
+}
+
+/*
+ * Make the static decompression context in workspace, and lease workspace
+ * until extzstd_workspace_release(*arena).
+ *
+ * When +window_log_max+ of dparams is not set, the largest window log that
+ * workspace can hold is set to the context, so that the frames with the
+ * larger window are rejected by Zstd::Error.
+ *
+ * Raises ArgumentError if workspace is smaller than
+ * ZSTD_estimateDStreamSize(), or if the raw dictionary is given.
+ */
+ZSTD_DCtx *
+extzstd_workspace_dctx(VALUE workspace, VALUE dparams, VALUE predict, struct extzstd_workspace **arena)
+{
+    struct extzstd_workspace *a = workspace_lease(workspace);
+
+    if (!NIL_P(predict) && !extzstd_ddict_p(predict)) {
+        rb_raise(rb_eArgError,
+                 "workspace needs Zstd::Dictionary::Decompressor instead of the raw dictionary");
+    }
+
+    int wlog = extzstd_dparams_get(dparams, ZSTD_d_windowLogMax);
+    if (wlog > 0) {
+        workspace_check_capacity(a, ZSTD_estimateDStreamSize((size_t)1 << wlog), "window_log_max");
+    } else {
+        ZSTD_bounds b = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+        for (wlog = b.upperBound; wlog > b.lowerBound; wlog--) {
+            if (ZSTD_estimateDStreamSize((size_t)1 << wlog) <= a->capacity) { break; }
+        }
+        workspace_check_capacity(a, ZSTD_estimateDStreamSize((size_t)1 << wlog), "the minimum window");
+    }
+
+    ZSTD_DCtx *ctx = ZSTD_initStaticDCtx(a->memory, a->capacity);
+    if (!ctx) {
+        workspace_check_capacity(a, SIZE_MAX, "the decompression context");
+    }
+
+    /* the static context is not freed by an error of these */
+    extzstd_dparams_setup_dctx(ctx, dparams);
+    extzstd_check_error(ZSTD_DCtx_setParameter(ctx, ZSTD_d_windowLogMax, wlog));
+
+    a->busy = 1;
+    a->refs++;
+    *arena = a;
+
+    return ctx;
+}
+
+/*
+ * Finish the lease of extzstd_workspace_cctx() or extzstd_workspace_dctx().
+ * The context in the workspace must not be used after this.
+ */
+void
+extzstd_workspace_release(struct extzstd_workspace *arena)
+{
+    if (arena) {
+        arena->busy = 0;
+        arena_unref(arena);
+    }
+}
+
+/*
+ * call-seq:
+ *  initialize(capacity)
+ *
+ * Allocate the memory of capacity bytes.
+ *
+ * [capacity (integer)]
+ *   Use Zstd.estimate_cstream_size or Zstd.estimate_dstream_size for the
+ *   parameters of the context.
+ */
+static VALUE
+workspace_init(VALUE self, VALUE capacity)
+{
+    if (getworkspacep(self)) { reiniterror(self); }
+
+    size_t n = NUM2SIZET(capacity);
+    if (n < 1) {
+        rb_raise(rb_eArgError, "capacity must be positive");
+    }
+
+    struct extzstd_workspace *arena = ALLOC(struct extzstd_workspace);
+    arena->memory = NULL;
+    arena->capacity = 0;
+    arena->refs = 1;
+    arena->busy = 0;
+    DATA_PTR(self) = arena;
+
+    /* the memory of malloc() is aligned for ZSTD_initStaticCCtx() */
+    arena->memory = xmalloc(n);
+    arena->capacity = n;
+
+    return self;
+}
+
+static VALUE
+workspace_capacity(VALUE self)
+{
+    return SIZET2NUM(getworkspace(self)->capacity);
+}
+
+/*
+ * call-seq:
+ *  busy? -> true or false
+ *
+ * Returns true while a context leases the workspace.
+ */
+static VALUE
+workspace_busy_p(VALUE self)
+{
+    return (getworkspace(self)->busy ? Qtrue : Qfalse);
+}
+
+/*
+ * call-seq:
+ *  estimate_cstream_size(params = nil) -> integer
+ *
+ * Returns the size of the streaming compression context (Zstd::Encoder) for
+ * params (nil, integer or Zstd::Parameters without +workers+).
+ * (ZSTD_estimateCStreamSize(), ZSTD_estimateCStreamSize_usingCCtxParams())
+ */
+static VALUE
+workspace_s_estimate_cstream_size(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE params;
+    rb_scan_args(argc, argv, "01", &params);
+    return SIZET2NUM(estimate_cstream_size(params));
+}
+
+/*
+ * call-seq:
+ *  estimate_cctx_size(params = nil) -> integer
+ *
+ * Returns the size of the one-shot compression context for params.
+ * (ZSTD_estimateCCtxSize(), ZSTD_estimateCCtxSize_usingCCtxParams())
+ */
+static VALUE
+workspace_s_estimate_cctx_size(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE params;
+    rb_scan_args(argc, argv, "01", &params);
+    return SIZET2NUM(estimate_cctx_size(params));
+}
+
+/*
+ * call-seq:
+ *  estimate_dstream_size(window_log_max = nil) -> integer
+ *  estimate_dstream_size(zstd_frame) -> integer
+ *
+ * Returns the size of the streaming decompression context (Zstd::Decoder)
+ * for the window size, or for the frame header of the string.
+ * nil means the default +window_log_max+ of libzstd.
+ * (ZSTD_estimateDStreamSize(), ZSTD_estimateDStreamSize_fromFrame())
+ */
+static VALUE
+workspace_s_estimate_dstream_size(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE arg;
+    rb_scan_args(argc, argv, "01", &arg);
+
+    size_t s;
+    if (RB_TYPE_P(arg, RUBY_T_STRING)) {
+        s = ZSTD_estimateDStreamSize_fromFrame(RSTRING_PTR(arg), RSTRING_LEN(arg));
+    } else {
+        int wlog = aux_num2int(arg, ZSTD_WINDOWLOG_LIMIT_DEFAULT);
+        ZSTD_bounds b = ZSTD_dParam_getBounds(ZSTD_d_windowLogMax);
+        if (wlog < b.lowerBound || wlog > b.upperBound) {
+            rb_raise(rb_eArgError,
+                     "window_log_max is out of range (given %d, expected %d..%d)",
+                     wlog, b.lowerBound, b.upperBound);
+        }
+        s = ZSTD_estimateDStreamSize((size_t)1 << wlog);
+    }
+    extzstd_check_error(s);
+
+    return SIZET2NUM(s);
+}
+
+/*
+ * call-seq:
+ *  estimate_dctx_size -> integer
+ *
+ * Returns the size of the one-shot decompression context.
+ * (ZSTD_estimateDCtxSize())
+ */
+static VALUE
+workspace_s_estimate_dctx_size(VALUE mod)
+{
+    return SIZET2NUM(ZSTD_estimateDCtxSize());
+}
+
+/*
+ * initialize for extzstd_workspace.c
+ */
+
+void
+extzstd_init_workspace(void)
+{
+    cWorkspace = rb_define_class_under(extzstd_mZstd, "Workspace", rb_cObject);
+    rb_define_alloc_func(cWorkspace, workspace_alloc);
+    rb_define_method(cWorkspace, "initialize", workspace_init, 1);
+    rb_define_method(cWorkspace, "capacity", workspace_capacity, 0);
+    rb_define_method(cWorkspace, "busy?", workspace_busy_p, 0);
+
+    rb_define_singleton_method(extzstd_mZstd, "estimate_cstream_size", workspace_s_estimate_cstream_size, -1);
+    rb_define_singleton_method(extzstd_mZstd, "estimate_cctx_size", workspace_s_estimate_cctx_size, -1);
+    rb_define_singleton_method(extzstd_mZstd, "estimate_dstream_size", workspace_s_estimate_dstream_size, -1);
+    rb_define_singleton_method(extzstd_mZstd, "estimate_dctx_size", workspace_s_estimate_dctx_size, 0);
+
+    (void)workspace_p;
+}
@@ -2,6 +2,7 @@
 #define RUBY_ZSTD_LIBZSTD_CONF_H 1
 
 #define ZSTD_LEGACY_SUPPORT 1
+#define ZSTD_MULTITHREAD 1
 #define visibility(v) visibility("hidden")
 
 #endif /* RUBY_ZSTD_LIBZSTD_CONF_H */
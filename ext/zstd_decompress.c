@@ -4,3 +4,40 @@
 #include "../contrib/zstd/lib/decompress/zstd_decompress_block.c"
 #include "../contrib/zstd/lib/decompress/huf_decompress.c"
 #include "../contrib/zstd/lib/decompress/zstd_ddict.c"
+
+/*
+ * Upper bound of the decompressed size, computed from the number of blocks
+ * only. Unlike ZSTD_decompressBound(), the content size field in the frame
+ * headers is not trusted, since each block regenerates at most
+ * ZSTD_BLOCKSIZE_MAX bytes.
+ *
+ * Returns ZSTD_CONTENTSIZE_ERROR if src is not a sequence of complete frames.
+ */
+unsigned long long
+extzstd_decompress_block_bound(const void *src, size_t srcsize)
+{
+    unsigned long long bound = 0;
+
+    while (srcsize > 0) {
+        ZSTD_frameSizeInfo const info = ZSTD_findFrameSizeInfo(src, srcsize, ZSTD_f_zstd1);
+        if (ZSTD_isError(info.compressedSize) || info.decompressedBound == ZSTD_CONTENTSIZE_ERROR) {
+            return ZSTD_CONTENTSIZE_ERROR;
+        }
+
+#if defined(ZSTD_LEGACY_SUPPORT) && (ZSTD_LEGACY_SUPPORT >= 1)
+        if (ZSTD_isLegacy(src, srcsize)) {
+            /* legacy frames have no content size; the bound already counts the blocks */
+            bound += info.decompressedBound;
+        } else
+#endif
+        {
+            /* skippable frames have no blocks */
+            bound += (unsigned long long)info.nbBlocks * ZSTD_BLOCKSIZE_MAX;
+        }
+
+        src = (const BYTE *)src + info.compressedSize;
+        srcsize -= info.compressedSize;
+    }
+
+    return bound;
+}
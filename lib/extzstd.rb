@@ -24,21 +24,29 @@ module Zstd
 
   refine String do
     def to_zstd(params = nil, dict: nil)
-      ContextLess.encode(self, "".b, nil, dict, params)
+      if dict.nil? && (params.nil? || params.kind_of?(Integer))
+        Codec.default(params).encode(self)
+      else
+        ContextLess.encode(self, "".b, nil, dict, params)
+      end
     end
 
-    def unzstd(size = nil, dict: nil)
-      Decoder.open(self, dict) { |d| return d.read(size) }
+    def unzstd(size = nil, dict: nil, **opts)
+      if dict.nil? && opts.empty?
+        Codec.default.decode(self, size)
+      else
+        Codec.new(nil, dict, **opts).decode(self, size)
+      end
     end
   end
 
   refine Object do
-    def to_zstd(params = nil, dict: nil, &block)
-      Encoder.open(self, params, dict, &block)
+    def to_zstd(params = nil, dict: nil, **opts, &block)
+      Encoder.open(self, params, dict, **opts, &block)
     end
 
-    def unzstd(dict: nil, &block)
-      Decoder.open(self, dict, &block)
+    def unzstd(dict: nil, **opts, &block)
+      Decoder.open(self, dict, **opts, &block)
     end
   end
 
@@ -64,9 +72,12 @@ module Zstd
 
   #
   # call-seq:
-  #   decode(zstd_string, maxsize = nil, dict: nil) -> string
-  #   decode(zstd_stream, dict: nil) -> zstd decoder
-  #   decode(zstd_stream, dict: nil) { |decoder| ... } -> yield returned value
+  #   decode(zstd_string, maxsize = nil, dict: nil, **opts) -> string
+  #   decode(zstd_stream, dict: nil, **opts) -> zstd decoder
+  #   decode(zstd_stream, dict: nil, **opts) { |decoder| ... } -> yield returned value
+  #
+  # [opts]
+  #   Same as Zstd::DecodeParameters.new (+window_log_max+, +ignore_checksum+, +format+, ...).
   #
   def self.decode(src, *args, **opts, &block)
     src.unzstd(*args, **opts, &block)
@@ -78,17 +89,41 @@ module Zstd
     alias uncompress decode
   end
 
+  class Codec
+    #
+    # call-seq:
+    #   default(level = nil) -> codec
+    #
+    # Returns the codec for the current thread (and Ractor).
+    # Zstd.encode and Zstd.decode use it, instead of creating the
+    # contexts for each call.
+    #
+    def self.default(level = nil)
+      codecs = Thread.current.thread_variable_get(:extzstd_default_codecs) ||
+               Thread.current.thread_variable_set(:extzstd_default_codecs, {})
+      codecs[level] ||= new(level)
+    end
+  end
+
   Compressor = Encoder
   StreamEncoder = Encoder
 
   class Encoder
     #
     # call-seq:
-    #   open(outport, level = nil, dict = nil) -> zstd encoder
-    #   open(outport, encode_params, dict = nil) { |encoder| ... } -> yield returned value
+    #   open(outport, level = nil, dict = nil, opts = {}) -> zstd encoder
+    #   open(outport, encode_params, dict = nil, opts = {}) { |encoder| ... } -> yield returned value
+    #
+    # [opts workers: nil]
+    # [opts job_size: nil]
+    # [opts overlap_log: nil]
+    # [opts thread_pool: nil]
+    # [opts write_chunk_size: 256 KiB]
+    # [opts workspace: nil]
+    # [opts pool: nil]
     #
-    def self.open(outport, *args)
-      e = new(outport, *args)
+    def self.open(outport, *args, **opts)
+      e = new(outport, *args, **opts)
 
       return e unless block_given?
 
@@ -115,16 +150,21 @@ module Zstd
   class Decoder
     #
     # call-seq:
-    #   open(inport, dict = nil) -> decoder
-    #   open(inport, dict = nil) { |decoder| ... } -> yield returned value
+    #   open(inport, dict = nil, opts = {}) -> decoder
+    #   open(inport, dict = nil, opts = {}) { |decoder| ... } -> yield returned value
     #
     # [inport]
     #   String instance or +read+ method haved Object.
+    # [opts read_chunk_size: 256 KiB]
+    # [opts workspace: nil]
+    # [opts pool: nil]
+    # [opts]
+    #   Other options are same as Zstd::DecodeParameters.new.
     #
-    def self.open(inport, dict = nil)
+    def self.open(inport, dict = nil, *args, **opts)
       inport = StringIO.new(inport) if inport.kind_of?(String)
 
-      dec = new(inport, dict)
+      dec = new(inport, dict, *args, **opts)
 
       return dec unless block_given?
 
@@ -135,11 +175,15 @@ module Zstd
       end
     end
 
-    def self.decode(src, dest: nil, dict: nil)
+    def self.decode(src, dest: nil, dict: nil, **opts)
       # NOTE: ContextLess.decode は伸長時のサイズが必要なため、常に利用できるわけではない
       # ContextLess.decode(src, dest || "".b, nil, dict)
 
-      new(StringIO.new(src), dict).read(nil, dest)
+      if dict.nil? && opts.empty?
+        Codec.default.decode(src, nil, dest)
+      else
+        Codec.new(nil, dict, **opts).decode(src, nil, dest)
+      end
     end
 
     class << Decoder
@@ -148,11 +192,29 @@ module Zstd
     end
   end
 
+  class DecodeParameters
+    keys.each do |key|
+      define_method(key) { self[key] }
+      define_method("#{key}=") { |value| self[key] = value }
+    end
+  end
+
   class Parameters
+    #
+    # Define accessors for each parameter name (windowlog, windowlog=,
+    # long_distance_matching, long_distance_matching=, ...).
+    #
+    # Same as Zstd::Parameters#[] and Zstd::Parameters#[]=.
+    #
+    keys.each do |key|
+      define_method(key) { self[key] }
+      define_method("#{key}=") { |value| self[key] = value }
+    end
+
     def inspect
       "#<#{self.class} windowlog=#{windowlog}, chainlog=#{chainlog}, " \
         "hashlog=#{hashlog}, searchlog=#{searchlog}, " \
-        "searchlength=#{searchlength}, strategy=#{strategy}>"
+        "minmatch=#{minmatch}, targetlength=#{targetlength}, strategy=#{strategy}>"
     end
 
     def pretty_print(q)
@@ -166,7 +228,7 @@ module Zstd
         q.breakable " "
         q.text "searchlog=#{searchlog},"
         q.breakable " "
-        q.text "searchlength=#{searchlength},"
+        q.text "minmatch=#{minmatch},"
         q.breakable " "
         q.text "targetlength=#{targetlength},"
         q.breakable " "
@@ -175,3 +237,5 @@ module Zstd
     end
   end
 end
+
+require_relative "extzstd/seekable"
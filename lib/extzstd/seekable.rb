@@ -0,0 +1,386 @@
+#!ruby
+
+module Zstd
+  #
+  # Constants of the seekable format.
+  #
+  # <https://github.com/facebook/zstd/blob/dev/contrib/seekable_format/zstd_seekable_compression_format.md>
+  #
+  module Seekable
+    SKIPPABLE_MAGIC = 0x184D2A5E
+    SEEKABLE_MAGIC = 0x8F92EAB1
+    FOOTER_SIZE = 9
+    SKIPPABLE_HEADER_SIZE = 8
+    MAX_FRAMES = 0x08000000
+    MAX_FRAME_DECOMPRESSED_SIZE = 0x40000000
+    DEFAULT_FRAME_SIZE = 1 << 20
+
+    # ZSTD_error_corruption_detected (the value of zstd_errors.h is stable)
+    ERROR_CORRUPTION_DETECTED = 20
+  end
+
+  #
+  # Write the seekable format.
+  #
+  # The input is cut into independent frames at +frame_size+, and the seek
+  # table is appended as a skippable frame by #close.
+  # The output can be decoded by Zstd::Decoder as usual, and can be read
+  # randomly by Zstd::SeekableReader.
+  #
+  class SeekableWriter
+    include Seekable
+
+    #
+    # call-seq:
+    #   open(outport, level = nil, dict = nil, frame_size: 1 MiB) -> writer
+    #   open(outport, level = nil, dict = nil, frame_size: 1 MiB) { |writer| ... } -> yield returned value
+    #
+    def self.open(outport, *args, **opts)
+      w = new(outport, *args, **opts)
+
+      return w unless block_given?
+
+      begin
+        yield w
+      ensure
+        w.close unless w.closed?
+      end
+    end
+
+    attr_reader :outport, :frame_size
+
+    #
+    # call-seq:
+    #   initialize(outport, level = nil, dict = nil, frame_size: 1 MiB)
+    #
+    # [outport (io liked object)]
+    #   +outport << string+ is called for each frame.
+    # [level = nil (nil, integer or Zstd::Parameters)]
+    # [dict = nil (nil, string or Zstd::Dictionary::Compressor)]
+    # [frame_size: 1 MiB (integer)]
+    #   Decompressed size of each frame (up to 1 GiB).
+    #
+    def initialize(outport, params = nil, dict = nil, frame_size: DEFAULT_FRAME_SIZE)
+      frame_size = Integer(frame_size)
+      unless frame_size > 0 && frame_size <= MAX_FRAME_DECOMPRESSED_SIZE
+        raise ArgumentError, "frame_size is out of range (given #{frame_size})"
+      end
+
+      @outport = outport
+      @frame_size = frame_size
+      @codec = Codec.new(params, dict)
+      @buf = "".b
+      @entries = []
+      @closed = false
+    end
+
+    def write(*bufs)
+      raise IOError, "closed stream" if @closed
+
+      bufs.sum do |buf|
+        buf = String(buf)
+        off = 0
+        while off < buf.bytesize
+          n = [@frame_size - @buf.bytesize, buf.bytesize - off].min
+          if @buf.empty? && n == @frame_size
+            write_frame(buf.byteslice(off, n))
+          else
+            @buf << buf.byteslice(off, n)
+            write_frame(@buf) if @buf.bytesize >= @frame_size
+          end
+          off += n
+        end
+        buf.bytesize
+      end
+    end
+
+    def <<(buf)
+      write(buf)
+      self
+    end
+
+    #
+    # Write the buffered data as a frame (even if it is shorter than
+    # frame_size) and flush outport.
+    #
+    def flush
+      raise IOError, "closed stream" if @closed
+
+      write_frame(@buf) unless @buf.empty?
+      @outport.flush if @outport.respond_to?(:flush)
+      self
+    end
+
+    #
+    # Write the last frame and the seek table.
+    # outport is not closed.
+    #
+    def close
+      return nil if @closed
+
+      write_frame(@buf) unless @buf.empty?
+      @outport << seek_table
+      @closed = true
+      nil
+    end
+
+    def closed?
+      @closed
+    end
+
+    alias eof? closed?
+    alias eof closed?
+
+    def frame_count
+      @entries.size / 2
+    end
+
+    private
+
+    def write_frame(src)
+      if @entries.size >= MAX_FRAMES
+        raise RangeError, "too many frames for the seek table (limit #{MAX_FRAMES})"
+      end
+
+      frame = @codec.encode(src)
+      @outport << frame
+      @entries << frame.bytesize << src.bytesize
+      src.clear if src.equal?(@buf)
+      nil
+    end
+
+    def seek_table
+      nframes = @entries.size / 2
+      [SKIPPABLE_MAGIC, nframes * 8 + FOOTER_SIZE].pack("VV") <<
+        @entries.pack("V*") <<
+        [nframes, 0, SEEKABLE_MAGIC].pack("VCV")
+    end
+  end
+
+  #
+  # Random access reader for the seekable format.
+  #
+  # Only the frames of the requested range are read and decoded.
+  # The last decoded frame is cached for sequential reading.
+  #
+  class SeekableReader
+    include Seekable
+
+    #
+    # call-seq:
+    #   open(inport, dict = nil) -> reader
+    #   open(inport, dict = nil) { |reader| ... } -> yield returned value
+    #
+    def self.open(inport, dict = nil)
+      r = new(inport, dict)
+
+      return r unless block_given?
+
+      yield r
+    end
+
+    attr_reader :inport, :size, :pos
+
+    #
+    # call-seq:
+    #   initialize(inport, dict = nil)
+    #
+    # [inport]
+    #   String instance, or IO liked object that have +pread+ or +seek+ and +read+ methods.
+    # [dict = nil (nil, string or Zstd::Dictionary::Decompressor)]
+    #
+    def initialize(inport, dict = nil)
+      @inport = inport
+      @codec = Codec.new(nil, dict)
+      @pos = 0
+      @cache_index = nil
+      @cache = nil
+      load_seek_table
+    end
+
+    def frame_count
+      @doffsets.size - 1
+    end
+
+    #
+    # call-seq:
+    #   pread(offset, length) -> string or nil
+    #
+    # Read length bytes at offset of the decompressed data.
+    # The position is not changed.
+    #
+    # Returns nil if offset is at the end of data.
+    #
+    def pread(offset, length, buf = "".b)
+      offset = Integer(offset)
+      length = Integer(length)
+      raise ArgumentError, "negative offset (given #{offset})" if offset < 0
+      raise ArgumentError, "negative length (given #{length})" if length < 0
+
+      buf.clear
+      return buf if length == 0
+      return nil if offset >= @size
+
+      last = [offset + length, @size].min
+      index = frame_index(offset)
+      while offset < last
+        frame = decode_frame(index)
+        off = offset - @doffsets[index]
+        n = [frame.bytesize - off, last - offset].min
+        buf << frame.byteslice(off, n)
+        offset += n
+        index += 1
+      end
+
+      buf
+    end
+
+    #
+    # call-seq:
+    #   read(length = nil, buf = "".b) -> string or nil
+    #
+    # Same as IO#read.
+    #
+    def read(length = nil, buf = "".b)
+      if length.nil?
+        s = pread(@pos, [@size - @pos, 0].max, buf) || buf.clear
+      else
+        s = pread(@pos, length, buf)
+      end
+
+      @pos += s.bytesize if s
+      s
+    end
+
+    def seek(offset, whence = IO::SEEK_SET)
+      case whence
+      when IO::SEEK_SET, :SET
+        base = 0
+      when IO::SEEK_CUR, :CUR
+        base = @pos
+      when IO::SEEK_END, :END
+        base = @size
+      else
+        raise ArgumentError, "unknown whence - #{whence.inspect}"
+      end
+
+      pos = base + Integer(offset)
+      raise Errno::EINVAL, "negative position (#{pos})" if pos < 0
+      @pos = pos
+      0
+    end
+
+    def pos=(pos)
+      seek(pos, IO::SEEK_SET)
+      @pos
+    end
+
+    alias tell pos
+
+    def rewind
+      @pos = 0
+    end
+
+    def eof?
+      @pos >= @size
+    end
+
+    alias eof eof?
+
+    private
+
+    def frame_index(offset)
+      # the last index that @doffsets[index] <= offset
+      (0 ... frame_count).bsearch { |i| @doffsets[i + 1] > offset }
+    end
+
+    def decode_frame(index)
+      return @cache if @cache_index == index
+
+      csize = @coffsets[index + 1] - @coffsets[index]
+      dsize = @doffsets[index + 1] - @doffsets[index]
+      frame = read_source(@coffsets[index], csize)
+      @cache = @codec.decode(frame, dsize)
+      unless @cache.bytesize == dsize
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "frame size mismatch (frame #{index})")
+      end
+      @cache_index = index
+      @cache
+    end
+
+    def source_size
+      case
+      when @inport.kind_of?(String)
+        @inport.bytesize
+      when @inport.respond_to?(:size)
+        @inport.size
+      else
+        @inport.seek(0, IO::SEEK_END)
+        @inport.pos
+      end
+    end
+
+    def read_source(offset, length)
+      case
+      when @inport.kind_of?(String)
+        s = @inport.byteslice(offset, length)
+      when @inport.respond_to?(:pread)
+        s = @inport.pread(length, offset)
+      else
+        @inport.seek(offset, IO::SEEK_SET)
+        s = @inport.read(length)
+      end
+
+      unless s && s.bytesize == length
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "unexpected end of seekable data")
+      end
+
+      s
+    end
+
+    def load_seek_table
+      total = source_size
+      if total < SKIPPABLE_HEADER_SIZE + FOOTER_SIZE
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "seek table is not found")
+      end
+
+      nframes, desc, magic = read_source(total - FOOTER_SIZE, FOOTER_SIZE).unpack("VCV")
+      unless magic == SEEKABLE_MAGIC && (desc & 0x7c) == 0
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "seek table is not found")
+      end
+
+      entsize = (desc & 0x80) == 0 ? 8 : 12
+      tablesize = nframes * entsize + FOOTER_SIZE
+      tableoff = total - tablesize - SKIPPABLE_HEADER_SIZE
+      if nframes > MAX_FRAMES || tableoff < 0
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "broken seek table")
+      end
+
+      table = read_source(tableoff, SKIPPABLE_HEADER_SIZE + nframes * entsize)
+      skipmagic, skipsize = table.unpack("VV")
+      unless skipmagic == SKIPPABLE_MAGIC && skipsize == tablesize
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "broken seek table")
+      end
+
+      @coffsets = Array.new(nframes + 1)
+      @doffsets = Array.new(nframes + 1)
+      @coffsets[0] = @doffsets[0] = 0
+      if entsize == 8
+        entries = table.unpack("@#{SKIPPABLE_HEADER_SIZE}V#{nframes * 2}")
+      else
+        # the checksums are not verified
+        entries = nframes.times.flat_map { |i| table.unpack("@#{SKIPPABLE_HEADER_SIZE + i * entsize}VV") }
+      end
+      nframes.times do |i|
+        @coffsets[i + 1] = @coffsets[i] + entries[i * 2]
+        @doffsets[i + 1] = @doffsets[i] + entries[i * 2 + 1]
+      end
+
+      if @coffsets[-1] != tableoff
+        raise Zstd::Error.new(ERROR_CORRUPTION_DETECTED, "broken seek table")
+      end
+
+      @size = @doffsets[-1]
+    end
+  end
+end
@@ -4,5 +4,5 @@ module Zstd
     raise "``version'' is not defined or bad syntax in ``README.md''"
   end
 
-  VERSION = String($1)
+  VERSION = String($1).freeze
 end
@@ -3,8 +3,13 @@
 require "test-unit"
 require "extzstd"
 require "digest"
+require "tmpdir"
+require "timeout"
 
 class TestZstd < Test::Unit::TestCase
+  # compressible text, not too repetitive
+  SAMPLE = 20000.times.map { |i| "#{i}:#{i * 7919 % 1000003}," }.join.freeze
+
   def test_encode_decode
     src = "ABCDEFGabcdefg" * 50
     assert_equal(src, Zstd.decode(Zstd.encode(src), src.bytesize))
@@ -46,4 +51,909 @@ class TestZstd < Test::Unit::TestCase
     src = "ABCDEFGabcdefg" * 50
     assert_equal(src, Zstd.decode(Zstd.encode(src, dict: dict), src.bytesize, dict: dict))
   end
+
+  def test_workers
+    src = "abcdefghijklmnopqrstuvwxyz" * 100000
+    d = StringIO.new("".b)
+    Zstd.encode(d, 3, workers: 2, job_size: 1 << 20) { |z| 4.times { z << src } }
+    assert_equal(src * 4, Zstd.decode(d.string))
+
+    params = Zstd::Parameters.new(3, workers: 2, overlap_log: 6)
+    assert_equal(2, params.workers)
+    assert_equal(6, params.overlap_log)
+    assert_equal(src, Zstd.decode(Zstd.encode(src, params)))
+
+    assert_raise(ArgumentError) { Zstd::Encoder.new("".b, 3, worker: 4) }
+    assert_raise(TypeError) { Zstd::Encoder.new("".b, 3, workers: "4") }
+    assert_raise(TypeError) { Zstd::Encoder.new("".b, "3") }
+  end
+
+  def test_encode_threads
+    srcs = 4.times.map { |i| ("#{i}abcdefghijklmnopqrstuvwxyz" * 100000).freeze }
+    dests = srcs.map { |src|
+      Thread.new {
+        d = StringIO.new("".b)
+        Zstd.encode(d, 1) { |z| z << src; z.sync; z << src }
+        d.string
+      }
+    }.map(&:value)
+    srcs.zip(dests) { |src, dest| assert_equal(src * 2, Zstd.decode(dest)) }
+
+    # the context is not touched by another thread while it is used
+    q = Queue.new
+    out = Object.new
+    out.define_singleton_method(:<<) { |buf| q.pop; self }
+    enc = Zstd::Encoder.new(out, 1)
+    th = Thread.new { enc.write_frame(srcs[0]) }
+    Thread.pass until th.stop?
+    assert_raise(RuntimeError) { enc.reset(nil) }
+    assert_raise(RuntimeError) { enc.sizeof }
+    assert_raise(RuntimeError) { enc << "abc" }
+    assert_raise(RuntimeError) { enc.close }
+    q.close
+    th.join
+    enc.close
+    assert_true(enc.eof?)
+  end
+
+  def test_decode_threads
+    srcs = 4.times.map { |i| "#{i}abcdefghijklmnopqrstuvwxyz" * 100000 }
+    encs = srcs.map { |src| Zstd.encode(src) }
+    decs = encs.map { |enc|
+      Thread.new {
+        Zstd.decode(StringIO.new(enc)) { |z| z.read }
+      }
+    }.map(&:value)
+    assert_equal(srcs, decs)
+
+    # the context is not touched by another thread while it is used
+    q = Queue.new
+    inport = Object.new
+    inport.define_singleton_method(:read) { |size, buf = nil| q.pop }
+    dec = Zstd::Decoder.new(inport)
+    th = Thread.new { dec.read }
+    Thread.pass until th.stop?
+    assert_raise(RuntimeError) { dec.reset }
+    assert_raise(RuntimeError) { dec.sizeof }
+    assert_raise(RuntimeError) { dec.read(1) }
+    q << encs[0]
+    q.close
+    assert_equal(srcs[0], th.value)
+    assert_operator(dec.sizeof, :>, 0)
+  end
+
+  def test_digested_dictionary
+    dictsrc = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_-" * 5
+    dict = Zstd::Dictionary.train_from_buffer(dictsrc, 10000)
+    cdict = Zstd::Dictionary::Compressor.new(dict, 3)
+    ddict = Zstd::Dictionary::Decompressor.new(dict)
+    assert_equal(Zstd::Dictionary.getid(dict), cdict.dictid)
+    assert_equal(Zstd::Dictionary.getid(dict), ddict.dictid)
+
+    src = "ABCDEFGabcdefg" * 50
+    enc = Zstd.encode(src, dict: cdict)
+    assert_equal(src, Zstd.decode(enc, src.bytesize, dict: dict))
+    assert_equal(src, Zstd.decode(enc, src.bytesize, dict: ddict))
+    assert_equal(src, Zstd::ContextLess.decode(enc, "".b, src.bytesize, ddict))
+
+    d = StringIO.new("".b)
+    Zstd.encode(d, nil, dict: cdict) { |z| z << src }
+    assert_equal(src, Zstd.decode(d.string, dict: ddict))
+  end
+
+  def test_codec
+    src = "ABCDEFGabcdefg" * 50
+    codec = Zstd::Codec.new(3)
+    3.times do
+      enc = codec.encode(src)
+      assert_equal(src, codec.decode(enc))
+      assert_equal(src[0, 10], codec.decode(enc, 10))
+    end
+    assert_equal(src * 2, codec.decode(codec.encode(src) + codec.encode(src)))
+
+    huge = "abcdefghijklmnopqrstuvwxyz" * 100000
+    assert_equal(huge, Zstd::Codec.new.decode(Zstd.encode(huge)))
+    assert_raise(RuntimeError) { codec.decode(codec.encode(huge).byteslice(0, 100)) }
+
+    dict = Zstd::Dictionary.train_from_buffer("0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz_-" * 5, 10000)
+    codec = Zstd::Codec.new(nil, dict)
+    assert_equal(src, codec.decode(codec.encode(src)))
+    assert_equal(src, Zstd.decode(codec.encode(src), dict: dict))
+
+    # the context is not reset by another thread in the middle of a decode
+    parts = 8.times.map { |i| SAMPLE * 4 + i.to_s }
+    big = "".b
+    Zstd::Encoder.open(big, 1) { |e| parts.each { |s| e << s } } # without the content size
+    codec = Zstd::Codec.new
+    th = Thread.new { 4.times.map { codec.decode(big) } }
+    errors = []
+    until th.join(0)
+      begin
+        codec.decode(Zstd.encode(src))
+      rescue RuntimeError => e
+        errors << e.message
+      end
+    end
+    th.value.each { |d| assert_equal(parts.join, d) }
+    assert_equal([], errors.grep_v(/in use/))
+
+    assert_same(Zstd::Codec.default, Zstd::Codec.default)
+    assert_not_same(Zstd::Codec.default, Thread.new { Zstd::Codec.default }.value)
+  end
+
+  def test_decode_fast_path
+    src = "ABCDEFGabcdefg" * 100000
+    sized = Zstd.encode(src)
+    unsized = "".b
+    Zstd::Encoder.open(unsized) { |z| z << src }
+    assert_equal(src, Zstd.decode(sized))
+    assert_equal(src, Zstd.decode(unsized))
+    assert_equal(src * 2, Zstd.decode(sized + unsized))
+    assert_equal(src * 2, Zstd::Decoder.decode(sized + sized))
+
+    dest = "".b
+    assert_same(dest, Zstd::Decoder.decode(sized, dest: dest))
+    assert_equal(src, dest)
+
+    # allocated once for the content size, not for the bound of 11 blocks (1408 KiB)
+    require "objspace"
+    dest = "".b
+    assert_same(dest, Zstd::Codec.new.decode(sized, nil, dest))
+    assert_equal(src, dest)
+    assert_operator(ObjectSpace.memsize_of(dest), :<, src.bytesize + 4096)
+
+    assert_raise(RuntimeError) { Zstd.decode(sized.byteslice(0, sized.bytesize - 1)) }
+    assert_raise(Zstd::Error) { Zstd.decode(sized + "garbage") }
+  end
+
+  # single segment frame header that claims the content size, and an empty last block
+  def forged_frame(content_size)
+    [0xFD2FB528, 0xE0, content_size, 1, 0].pack("VCQ<Cv")
+  end
+
+  def test_decode_forged_content_size
+    [64 << 30, 100 << 20].each do |size|
+      assert_raise(Zstd::Error) { Zstd.decode(forged_frame(size)) }
+      assert_raise(Zstd::Error) { Zstd::Codec.new.decode(forged_frame(size)) }
+      assert_raise(Zstd::Error) { Zstd.decode_batch([forged_frame(size), Zstd.encode("abc")]) }
+      assert_raise(Zstd::Error) { Zstd::Decoder.decode_parallel(forged_frame(size)) }
+      assert_raise(Zstd::Error) { Zstd::Decoder.decode_parallel(StringIO.new(forged_frame(size))) }
+    end
+  end
+
+  def test_batch
+    srcs = 200.times.map { |i| "abcdefg#{i}" * (i * 37) }
+    encoded = Zstd.encode_batch(srcs, level: 3, threads: 4)
+    assert_equal(srcs.size, encoded.size)
+    assert_equal(srcs, encoded.map { |e| Zstd.decode(e) })
+    assert_equal(srcs, Zstd.decode_batch(encoded, threads: 4))
+
+    unsized = srcs.map { |s| d = "".b; Zstd::Encoder.open(d) { |z| z << s }; d }
+    assert_equal(srcs, Zstd.decode_batch(unsized, threads: 3))
+
+    dict = Zstd::Dictionary.train_from_buffer(srcs.first(20).join, 10000)
+    encoded = Zstd.encode_batch(srcs, dict: Zstd::Dictionary::Compressor.new(dict))
+    assert_equal(srcs, Zstd.decode_batch(encoded, dict: dict))
+
+    assert_equal([], Zstd.encode_batch([]))
+    assert_raise(Zstd::Error) { Zstd.decode_batch([encoded[1], "garbage"]) }
+
+    # the worker threads are kept for the next batch
+    if File.directory?("/proc/self/task")
+      assert_equal(srcs, Zstd.decode_batch(Zstd.encode_batch(srcs, threads: 4), threads: 4))
+      nthreads = Dir.children("/proc/self/task").size
+      10.times { assert_equal(srcs, Zstd.decode_batch(Zstd.encode_batch(srcs, threads: 4), threads: 4)) }
+      assert_equal(nthreads, Dir.children("/proc/self/task").size)
+    end
+  end
+
+  def test_decode_parallel
+    srcs = 100.times.map { |i| "abcdefg#{i}" * (i * 200) }
+    frames = Zstd.encode_batch(srcs)
+    frames += srcs.first(10).map { |s| d = "".b; Zstd::Encoder.open(d) { |z| z << s }; d }
+    expect = (srcs + srcs.first(10)).join
+    assert_equal(expect, Zstd::Decoder.decode_parallel(frames.join, threads: 3))
+
+    out = StringIO.new("".b)
+    assert_same(out, Zstd::Decoder.decode_parallel(StringIO.new(frames.join), out))
+    assert_equal(expect, out.string)
+
+    dict = Zstd::Dictionary.train_from_buffer(srcs.first(10).join, 10000)
+    assert_equal(srcs.join, Zstd::Decoder.decode_parallel(Zstd.encode_batch(srcs, dict: dict).join, dict: dict))
+
+    # the highly compressed frames are not presized by the frame header
+    highs = ["a" * (3 << 20), "b" * (70 << 20), "abc"]
+    assert_equal(highs.join, Zstd::Decoder.decode_parallel(Zstd.encode_batch(highs).join))
+
+    assert_equal("", Zstd::Decoder.decode_parallel(""))
+    assert_raise(Zstd::Error) { Zstd::Decoder.decode_parallel(frames.join.byteslice(0..-2)) }
+    assert_raise(Zstd::Error) { Zstd::Decoder.decode_parallel(StringIO.new(frames.join.byteslice(0..-2))) }
+  end
+
+  def test_seekable
+    src = 20000.times.map { |i| "line #{i}\n" }.join
+    dest = "".b
+    Zstd::SeekableWriter.open(dest, 3, frame_size: 4000) do |w|
+      w << src.byteslice(0, 100)
+      w.write(src.byteslice(100..))
+    end
+    assert_equal(src, Zstd.decode(dest))
+
+    [dest, StringIO.new(dest)].each do |inport|
+      r = Zstd::SeekableReader.new(inport)
+      assert_equal(src.bytesize, r.size)
+      assert_equal((src.bytesize + 3999) / 4000, r.frame_count)
+      assert_equal(src.byteslice(12345, 10000), r.pread(12345, 10000))
+      assert_equal(src.byteslice(-10, 10), r.pread(src.bytesize - 10, 100))
+      assert_nil(r.pread(src.bytesize, 1))
+      r.seek(-20, IO::SEEK_END)
+      assert_equal(src.byteslice(-20, 5), r.read(5))
+      assert_equal(src.byteslice(-15, 15), r.read)
+      assert_nil(r.read(1))
+      r.rewind
+      assert_equal(src, r.read)
+    end
+
+    assert_raise(Zstd::Error) { Zstd::SeekableReader.new(Zstd.encode(src)) }
+
+    d = Zstd::Decoder.new(StringIO.new(dest))
+    assert_equal(0, d.pos)
+    d.read(1000)
+    assert_equal(1000, d.pos)
+  end
+
+  def test_dictionary_train
+    rand = Random.new(1)
+    words = Array.new(200) { rand.bytes(rand.rand(3..8)).unpack1("H*") }
+    samples = Array.new(2000) { |i| %({"id":#{i},"name":"#{words.sample(random: rand)}","tags":[#{words.sample(3, random: rand).map(&:dump).join(",")}]}) }
+
+    [[:fastcover, {}], [:cover, { k: 64, d: 8 }], [:fastcover, { k: 64, d: 8, steps: 4 }], [:legacy, {}]].each do |algorithm, opts|
+      dict = Zstd::Dictionary.train(samples, 4096, algorithm: algorithm, threads: 2, **opts)
+      assert_operator(dict.bytesize, :>, 0)
+      assert_operator(dict.bytesize, :<=, 4096)
+      assert_operator(Zstd::Dictionary.getid(dict), :>, 0)
+      enc = Zstd.encode(samples[0], dict: dict)
+      assert_operator(enc.bytesize, :<, Zstd.encode(samples[0]).bytesize)
+      assert_equal(samples[0], Zstd.decode(enc, dict: dict))
+    end
+
+    assert_raise(ArgumentError) { Zstd::Dictionary.train(samples, 4096, algorithm: :unknown) }
+  end
+
+  def test_parameters
+    src = "abcdefghijklmnopqrstuvwxyz" * 10000
+
+    params = Zstd::Parameters.new(19, long_distance_matching: 1, ldm_hashlog: 20,
+                                  target_cblock_size: 1024, checksum: true)
+    assert_equal(1, params[:long_distance_matching])
+    assert_equal(20, params.ldm_hashlog)
+    assert_equal(1, params.checksum)
+    assert_equal(src, Zstd.decode(Zstd.encode(src, params)))
+
+    params[:windowlog] = 20
+    assert_equal(20, params.windowlog)
+    assert_equal(20, params.dup.windowlog)
+    assert_raise(Zstd::Error) { params.windowlog = 99 }
+    assert_raise(ArgumentError) { params[:no_such_parameter] }
+
+    assert_equal(Zstd::MIN_COMPRESSION_LEVEL .. Zstd::MAX_COMPRESSION_LEVEL,
+                 Zstd::Parameters.bounds(:compression_level))
+    fast = Zstd::Parameters.new(Zstd::MIN_COMPRESSION_LEVEL)
+    assert_equal(src, Zstd.decode(Zstd.encode(src, fast)))
+    fast = Zstd::Parameters.new(compression_level: -5)
+    assert_equal(0, fast.windowlog)
+    assert_equal(src, Zstd.decode(Zstd.encode(src, fast)))
+
+    frozen = Ractor.make_shareable(Zstd::Parameters.new(3, checksum: true))
+    assert_raise(FrozenError) { frozen.windowlog = 20 }
+    assert_equal(1, frozen.dup.checksum)
+    assert_equal(src, Zstd.decode(Zstd.encode(src, frozen)))
+  end
+
+  def test_decode_parameters
+    src = "abcdefghijklmnopqrstuvwxyz" * 10000
+
+    magicless = Zstd.encode(src, Zstd::Parameters.new(format: :magicless))
+    assert_raise(Zstd::Error) { Zstd.decode(magicless) }
+    assert_equal(src, Zstd.decode(magicless, format: :magicless))
+    assert_equal(src, Zstd::Decoder.open(magicless, nil, format: :magicless, &:read))
+
+    broken = Zstd.encode(src, Zstd::Parameters.new(checksum: true))
+    broken[-1] = (broken[-1].ord ^ 0xff).chr
+    assert_raise(Zstd::Error) { Zstd.decode(broken) }
+    assert_equal(src, Zstd.decode(broken, ignore_checksum: true))
+
+    large = StringIO.new("".b)
+    Zstd.encode(large, Zstd::Parameters.new(3, windowlog: 24)) { |z| z << src }
+    large = large.string
+    assert_raise(Zstd::Error) { Zstd::Decoder.open(StringIO.new(large), nil, window_log_max: 20, &:read) }
+    dparams = Zstd::DecodeParameters.new(window_log_max: 24).freeze
+    assert_equal(src, Zstd::Decoder.open(StringIO.new(large), nil, dparams, &:read))
+
+    stable = Zstd::Codec.new(nil, nil, stable_out_buffer: true)
+    assert_equal(src, stable.decode(Zstd.encode(src), src.bytesize))
+
+    assert_equal(0 .. 1, Zstd::DecodeParameters.bounds(:ignore_checksum))
+    assert_raise(Zstd::Error) { Zstd::DecodeParameters.new(window_log_max: 99) }
+    assert_raise(ArgumentError) { Zstd::DecodeParameters.new(no_such_parameter: 1) }
+  end
+
+  def test_write_frame
+    src = "abcdefghijklmnopqrstuvwxyz" * 100000
+    frames = []
+    d = StringIO.new("".b)
+    d.define_singleton_method(:<<) { |buf| frames << buf.dup; super(buf) }
+    Zstd::Encoder.open(d) do |z|
+      z << "head"
+      n = frames.size
+      z.write_frame(src)
+      assert_equal(n + 2, frames.size) # finishes the "head" frame, and writes one frame
+      z.write_frame(src)
+      assert_equal(n + 3, frames.size)
+    end
+    assert_equal(src, Zstd.decode(frames.last))
+    assert_equal("head" + src * 2, Zstd.decode(d.string))
+
+    d = StringIO.new("".b)
+    Zstd::Encoder.open(d, Zstd::Parameters.new(3, workers: 2)) { |z| z.write_frame(src) }
+    assert_equal(src, Zstd.decode(d.string))
+
+    # the string given to outport is shrunk from ZSTD_compressBound()
+    require "objspace"
+    kept = []
+    Zstd::Encoder.open(kept) { |z| z.write_frame(src) }
+    assert_equal(src, Zstd.decode(kept.join))
+    assert_operator(ObjectSpace.memsize_of(kept.first), :<, 4096)
+  end
+
+  def test_chunk_size
+    src = 2000.times.map { |i| "#{i}:#{i * 7919 % 1000003}," }.join * 10
+    chunks = []
+    d = StringIO.new("".b)
+    d.define_singleton_method(:<<) { |buf| chunks << buf.bytesize; super(buf) }
+    z = Zstd::Encoder.new(d, 1, nil, write_chunk_size: 4096)
+    src.each_char.each_slice(1000) { |s| z << s.join }
+    z.close
+    assert_equal(chunks.size, z.outport_calls)
+    assert_not_include(chunks, 0)
+    assert_equal([4096], chunks[0 ... -1].uniq)
+    assert_equal(src, Zstd.decode(d.string))
+
+    dec = Zstd::Decoder.new(StringIO.new(d.string), nil, read_chunk_size: 1000)
+    assert_equal(src, dec.read)
+    assert_equal((d.string.bytesize + 999) / 1000, dec.inport_calls)
+
+    dec = Zstd::Decoder.new(StringIO.new(d.string), read_chunk_size: 1000, ignore_checksum: true)
+    assert_equal(src, dec.read)
+    assert_raise(ArgumentError) { Zstd::Decoder.new(StringIO.new(d.string), read_chunk_size: 0) }
+  end
+
+  def test_native_io
+    src = SAMPLE * 4
+    r, w = IO.pipe
+    reader = Thread.new { r.read }
+    w.write "head:"
+    Zstd::Encoder.open(w, 1, write_chunk_size: 4096) { |z| z << src; z.write_frame(src) }
+    w.close
+    data = reader.value
+    assert_equal("head:", data.byteslice(0, 5))
+    assert_equal(src * 2, Zstd.decode(data.byteslice(5 .. -1)))
+
+    r, w = IO.pipe
+    writer = Thread.new { w << data; w.close }
+    assert_equal("head:", r.read(5)) # leaves the buffered data in r
+    dec = Zstd::Decoder.new(r, read_chunk_size: 1000)
+    assert_equal(src, dec.read) # the first frame
+    r.read
+    writer.join
+    r.close
+
+    r, w = IO.pipe
+    w.close
+    assert_raise(IOError) { Zstd::Encoder.open(w) { |z| z << src } }
+  ensure
+    r.close rescue nil
+  end
+
+  def test_copy_stream
+    src = SAMPLE * 4
+    Dir.mktmpdir do |dir|
+      srcpath = File.join(dir, "src")
+      File.binwrite(srcpath, src)
+      zst = File.join(dir, "src.zst")
+      sizes = File.open(srcpath, "rb") { |i| File.open(zst, "wb") { |o| Zstd.copy_stream(i, o, level: 3, workers: 2) } }
+      assert_equal([src.bytesize, File.size(zst)], sizes)
+      assert_equal(src, Zstd.decode(File.binread(zst)))
+      enc = File.binread(zst)
+
+      r, w = IO.pipe
+      reader = Thread.new { r.read }
+      sizes = File.open(zst, "rb") { |i| Zstd.copy_stream(i, w, mode: :decompress) }
+      w.close
+      assert_equal([enc.bytesize, src.bytesize], sizes)
+      assert_equal(src, reader.value)
+      r.close
+
+      # the buffered data of IO is read by ruby
+      out = StringIO.new("".b)
+      File.open(zst, "rb") { |i| i.ungetc(i.getc); Zstd.copy_stream(i, out, mode: :decompress) }
+      assert_equal(src, out.string)
+
+      # duck typing
+      out = StringIO.new("".b)
+      sizes = Zstd.copy_stream(StringIO.new(src), out)
+      assert_equal([src.bytesize, out.size], sizes)
+      assert_equal(src, Zstd.decode(out.string))
+      assert_equal(src * 2, StringIO.new("".b).tap { |o| Zstd.copy_stream(StringIO.new(enc * 2), o, mode: :decompress) }.string)
+
+      assert_raise(Zstd::Error) { Zstd.copy_stream(StringIO.new(enc.byteslice(0 .. -2)), StringIO.new, mode: :decompress) }
+      assert_raise(ArgumentError) { Zstd.copy_stream(StringIO.new, StringIO.new, mode: :foo) }
+      assert_raise(ArgumentError) { Zstd.copy_stream(StringIO.new, StringIO.new, mode: :decompress, level: 1) }
+    end
+  end
+
+  def test_compress_file
+    src = SAMPLE * 4
+    Dir.mktmpdir do |dir|
+      srcpath = File.join(dir, "src")
+      zst = File.join(dir, "src.zst")
+      out = File.join(dir, "out")
+      File.binwrite(srcpath, src)
+
+      sizes = Zstd.compress_file(srcpath, zst, level: 3, workers: 2)
+      assert_equal([src.bytesize, File.size(zst)], sizes)
+      assert_equal(src, Zstd.decode(File.binread(zst)))
+
+      assert_equal([File.size(zst), src.bytesize], Zstd.decompress_file(zst, out))
+      assert_equal(src, File.binread(out))
+
+      # without the content size
+      File.open(zst, "wb") { |f| Zstd::Encoder.open(f) { |z| z << src } }
+      assert_equal([File.size(zst), src.bytesize], Zstd.decompress_file(zst, out))
+      assert_equal(src, File.binread(out))
+
+      File.binwrite(srcpath, "")
+      assert_equal(0, Zstd.compress_file(srcpath, zst)[0])
+      assert_equal([File.size(zst), 0], Zstd.decompress_file(zst, out))
+
+      File.binwrite(zst, Zstd.encode(src).byteslice(0 .. -2))
+      assert_raise(Zstd::Error) { Zstd.decompress_file(zst, out) }
+      # the forged content size does not make the huge file
+      File.binwrite(zst, forged_frame(64 << 30))
+      assert_raise(Zstd::Error) { Zstd.decompress_file(zst, out) }
+      assert_equal(0, File.size(out))
+      assert_raise(Errno::ENOENT) { Zstd.compress_file(File.join(dir, "nothing"), out) }
+      assert_raise(ArgumentError) { Zstd.decompress_file(zst, out, level: 1) }
+
+      # not a regular file (and opening the FIFO does not block)
+      if File.respond_to?(:mkfifo)
+        fifo = File.join(dir, "fifo")
+        File.mkfifo(fifo)
+        Timeout.timeout(10) do
+          assert_raise(Errno::EINVAL) { Zstd.compress_file(fifo, out) }
+          assert_raise(Errno::EINVAL) { Zstd.decompress_file(fifo, out) }
+          assert_raise(Errno::EINVAL) { Zstd.compress_file(srcpath, fifo) }
+        end
+      end
+
+      # the same file as the source is not truncated
+      File.binwrite(srcpath, src)
+      link = File.join(dir, "link")
+      File.link(srcpath, link)
+      File.symlink(srcpath, File.join(dir, "symlink"))
+      [srcpath, link, File.join(dir, "symlink")].each do |dest|
+        assert_raise(Errno::EINVAL) { Zstd.compress_file(srcpath, dest) }
+        assert_equal(src, File.binread(srcpath))
+      end
+      File.binwrite(zst, Zstd.encode(src))
+      assert_raise(Errno::EINVAL) { Zstd.decompress_file(zst, zst) }
+      assert_equal(src, Zstd.decode(File.binread(zst)))
+    end
+  end
+
+  def test_read_ahead
+    src = SAMPLE * 4
+    enc = Zstd.encode(src)
+
+    r, w = IO.pipe
+    writer = Thread.new { enc.bytes.each_slice(5000) { |s| w << s.pack("C*"); sleep 0.001 }; w.close }
+    dec = Zstd::Decoder.new(r, read_chunk_size: 4096, read_ahead: 4)
+    buf = "".b
+    dest = "".b
+    dest << buf while dec.read(10000, buf)
+    assert_equal(src, dest)
+    assert_operator(dec.inport_calls, :>=, enc.bytesize / 4096)
+    dec.close
+    writer.join
+    r.close
+
+    # stopped by #close while waiting the data
+    r, w = IO.pipe
+    w << enc.byteslice(0, 1000)
+    dec = Zstd::Decoder.new(r, read_ahead: 2)
+    assert_raise(Timeout::Error) { Timeout.timeout(0.3) { dec.read(100000) } }
+    dec.close
+    r.close
+    w.close
+
+    # the helper thread reads own descriptor, not the number reused after IO#close
+    small = "abcdefghij" * 100000
+    senc = Zstd.encode(small)
+    r, w = IO.pipe
+    w << senc.byteslice(0..-4)
+    dec = Zstd::Decoder.new(r, read_ahead: 2)
+    assert_equal(small.byteslice(0, 10), dec.read(10))
+    r.close
+    r2, w2 = IO.pipe
+    w2 << "garbage"
+    w << senc.byteslice(-3..)
+    w.close
+    assert_equal(small.byteslice(10..), dec.read)
+    dec.close
+    assert_equal("garbage", r2.read_nonblock(100))
+    r2.close
+    w2.close
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "src.zst")
+      File.binwrite(path, "head" + enc)
+      File.open(path, "rb") do |f|
+        assert_equal("h", f.getc) # leaves the buffered data in f
+        f.read(3)
+        assert_equal(src, Zstd::Decoder.new(f, read_ahead: 8, read_chunk_size: 1000).read)
+      end
+    end
+
+    assert_equal(src, Zstd::Decoder.new(StringIO.new(enc), read_ahead: 4).read)
+    assert_raise(ArgumentError) { Zstd::Decoder.new(StringIO.new(enc), read_ahead: -1) }
+  end
+
+  def test_thread_pool
+    src = SAMPLE * 16
+
+    pool = Zstd::ThreadPool.new(2)
+    assert_equal(2, pool.size)
+    assert_equal(false, pool.default?)
+    assert_predicate(pool, :frozen?)
+    assert_predicate(Zstd::ThreadPool.default, :default?)
+    assert_operator(Zstd::ThreadPool.default.size, :>=, 1)
+    assert(Ractor.shareable?(pool)) if defined?(Ractor)
+
+    encs = 3.times.map do
+      dest = "".b
+      [dest, Zstd::Encoder.new(dest, 1, workers: 2, job_size: 1 << 20, thread_pool: pool)]
+    end
+    encs.each { |_, e| e << src }
+    encs.each do |dest, e|
+      e.close
+      assert_equal(src, Zstd.decode(dest))
+    end
+
+    [nil, true, false].each do |tp|
+      dest = "".b
+      Zstd::Encoder.open(dest, 1, workers: 2, thread_pool: tp) { |e| e << src }
+      assert_equal(src, Zstd.decode(dest))
+    end
+    assert_equal(src, Zstd.decode(Zstd::Codec.new(Zstd::Parameters.new(1, workers: 2)).encode(src)))
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "src")
+      File.binwrite(path, src)
+      out = StringIO.new("".b)
+      File.open(path, "rb") { |f| Zstd.copy_stream(f, out, level: 1, workers: 2, thread_pool: pool) }
+      assert_equal(src, Zstd.decode(out.string))
+    end
+
+    assert_raise(TypeError) { Zstd::Encoder.new("".b, 1, workers: 2, thread_pool: 2) }
+    assert_raise(ArgumentError) { Zstd::ThreadPool.new(0) }
+    assert_raise(RuntimeError) { pool.send(:initialize, 2) }
+  end
+
+  def test_fork
+    omit "fork is not supported" unless Process.respond_to?(:fork)
+
+    src = SAMPLE * 16
+    pool = Zstd::ThreadPool.new(2)
+    codec = Zstd::Codec.new(Zstd::Parameters.new(1, workers: 2))
+    assert_equal(src, Zstd.decode(codec.encode(src)))
+    mtenc = Zstd::Encoder.new("".b, 1, workers: 2)
+    mtenc << src
+    enc = Zstd::Encoder.new("".b, 1)
+    enc << src
+
+    pid = fork do
+      status = begin
+        dest = "".b
+        Zstd::Encoder.open(dest, 1, workers: 2, job_size: 1 << 20, thread_pool: pool) { |e| e << src }
+        raise "thread_pool" unless Zstd.decode(dest) == src
+        dest = "".b
+        Zstd::Encoder.open(dest, 1, workers: 2) { |e| e << src }
+        raise "default pool" unless Zstd.decode(dest) == src
+        raise "codec" unless Zstd.decode(codec.encode(src)) == src
+        begin
+          mtenc << src
+          raise "encoder of parent"
+        rescue RuntimeError => e
+          raise unless e.message =~ /fork/
+        end
+        enc << src
+        enc.close
+        0
+      rescue Exception
+        $stderr.puts $!.full_message
+        1
+      end
+      exit! status
+    end
+
+    status = begin
+      Timeout.timeout(30) { Process.wait2(pid)[1] }
+    rescue Timeout::Error
+      Process.kill(:KILL, pid)
+      raise
+    end
+    assert_predicate(status, :success?)
+
+    mtenc.close
+    dest = "".b
+    Zstd::Encoder.open(dest, 1, workers: 2, thread_pool: pool) { |e| e << src }
+    assert_equal(src, Zstd.decode(dest))
+  end
+
+  def test_fork_batch
+    omit "fork is not supported" unless Process.respond_to?(:fork)
+
+    srcs = 200.times.map { |i| (i * 7919).to_s * 10000 }
+    frames = Zstd.encode_batch(srcs, level: 1, threads: 4)
+    running = Queue.new
+    workers = [
+      Thread.new { loop { Zstd.encode_batch(srcs, level: 1, threads: 4); running << 1 } },
+      Thread.new { loop { Zstd::Decoder.decode_parallel(frames.join, threads: 4); running << 1 } },
+    ]
+    2.times { running.pop }
+
+    pid = fork do
+      status = begin
+        # the batches of the lost threads are freed by GC
+        3.times { GC.start }
+        raise "encode_batch" unless Zstd.decode_batch(Zstd.encode_batch(srcs, threads: 2), threads: 2) == srcs
+        raise "decode_parallel" unless Zstd::Decoder.decode_parallel(frames.join, threads: 2) == srcs.join
+        GC.start
+        0
+      rescue Exception
+        $stderr.puts $!.full_message
+        1
+      end
+      exit! status
+    end
+
+    status = begin
+      Timeout.timeout(30) { Process.wait2(pid)[1] }
+    rescue Timeout::Error
+      Process.kill(:KILL, pid)
+      raise
+    end
+    assert_predicate(status, :success?)
+  ensure
+    workers&.each(&:kill)&.each(&:join)
+  end
+
+  def test_ractor
+    omit "Ractor is not supported" unless defined?(Ractor)
+
+    src = SAMPLE
+    dict = Zstd::Dictionary::Compressor.new(src.byteslice(0, 16000), 3)
+    ddict = Zstd::Dictionary::Decompressor.new(src.byteslice(0, 16000))
+    params = Ractor.make_shareable(Zstd::Parameters.new(3, windowlog: 20))
+    assert_predicate(dict, :frozen?)
+    assert(Ractor.shareable?(dict))
+    assert(Ractor.shareable?(ddict))
+    assert(Ractor.shareable?(params))
+
+    verbose, Warning[:experimental] = Warning[:experimental], false
+    begin
+      results = 4.times.map { |i|
+        Ractor.new(src, params, dict, ddict, i) do |src, params, dict, ddict, i|
+          codec = Zstd::Codec.new(params, dict)
+          enc = codec.encode(src + i.to_s)
+          [enc, Zstd.decode(enc, dict: ddict), Zstd.decode(Zstd.encode(src, 1)) == src, Zstd::LIBRARY_VERSION.to_s]
+        end
+      }.map(&:take)
+    ensure
+      Warning[:experimental] = verbose
+    end
+
+    results.each_with_index do |(enc, dec, plain, libver), i|
+      assert_equal(src + i.to_s, dec)
+      assert_equal(src + i.to_s, Zstd.decode(enc, dict: ddict))
+      assert_equal(true, plain)
+      assert_equal(Zstd::LIBRARY_VERSION.to_s, libver)
+    end
+  end
+
+  def test_memsize
+    require "objspace"
+
+    src = SAMPLE
+    params = Zstd::Parameters.new(19, windowlog: 24)
+    assert_operator(ObjectSpace.memsize_of(params), :>, 0)
+    assert_operator(ObjectSpace.memsize_of(Zstd::DecodeParameters.new), :>, 0)
+
+    enc = Zstd::Encoder.new("".b, params)
+    enc << src
+    assert_operator(ObjectSpace.memsize_of(enc), :>=, enc.sizeof)
+    assert_operator(ObjectSpace.memsize_of(enc), :>, 1 << 20)
+    enc.close
+
+    dec = Zstd::Decoder.new(StringIO.new(Zstd.encode(src)))
+    dec.read(100)
+    assert_operator(ObjectSpace.memsize_of(dec), :>=, dec.sizeof)
+
+    codec = Zstd::Codec.new(3)
+    assert_equal(src, codec.decode(codec.encode(src)))
+    assert_operator(ObjectSpace.memsize_of(codec), :>=, codec.sizeof)
+
+    if Zstd.gc_memory_accounting
+      GC.disable # the contexts of the other tests are not freed while measuring
+      begin
+        before = Zstd.gc_memory_allocated
+        encs = 4.times.map { Zstd::Encoder.new("".b, params).tap { |e| e << src } }
+        assert_operator(Zstd.gc_memory_allocated - before, :>=, encs.sum(&:sizeof) / 2)
+        encs.each(&:close)
+
+        Zstd.gc_memory_accounting = false
+        before = Zstd.gc_memory_allocated
+        Zstd::Encoder.new("".b, params).tap { |e| e << src; e.close }
+        assert_equal(before, Zstd.gc_memory_allocated)
+      ensure
+        Zstd.gc_memory_accounting = true
+        GC.enable
+      end
+    end
+  end
+
+  def test_workspace
+    require "objspace"
+
+    src = SAMPLE
+    params = Zstd::Parameters.new(3, windowlog: 20)
+
+    assert_operator(Zstd.estimate_cstream_size(19), :>, Zstd.estimate_cstream_size(1))
+    assert_operator(Zstd.estimate_cstream_size(params), :<, Zstd.estimate_cstream_size(Zstd::Parameters.new(3, windowlog: 24)))
+    assert_operator(Zstd.estimate_cctx_size(params), :>, 0)
+    assert_operator(Zstd.estimate_dstream_size(24), :>, Zstd.estimate_dstream_size(20))
+    assert_operator(Zstd.estimate_dstream_size(Zstd.encode(src)), :<=, Zstd.estimate_dstream_size)
+    assert_operator(Zstd.estimate_dctx_size, :>, 0)
+    assert_raise(ArgumentError) { Zstd.estimate_dstream_size(99) }
+
+    ws = Zstd::Workspace.new([Zstd.estimate_cstream_size(params), Zstd.estimate_dstream_size(20)].max)
+    assert_operator(ObjectSpace.memsize_of(ws), :>=, ws.capacity)
+
+    2.times do
+      dest = "".b
+      Zstd::Encoder.open(dest, params, workspace: ws) do |enc|
+        assert_true(ws.busy?)
+        assert_raise(RuntimeError) { Zstd::Encoder.new("".b, params, workspace: ws) }
+        enc << src
+      end
+      assert_false(ws.busy?)
+      assert_equal(src, Zstd.decode(dest))
+
+      dec = Zstd::Decoder.new(StringIO.new(dest), workspace: ws)
+      assert_equal(src, dec.read)
+      dec.close
+      dec.close
+      assert_false(ws.busy?)
+      assert_true(dec.eof?)
+      assert_raise(TypeError) { dec.read }
+    end
+
+    # not released while another thread reads
+    enc = Zstd.encode(src)
+    [0, 2].each do |read_ahead|
+      r, w = IO.pipe
+      dec = Zstd::Decoder.new(r, workspace: ws, read_ahead: read_ahead)
+      th = Thread.new { dec.read }
+      Thread.pass until th.stop?
+      assert_raise(RuntimeError) { dec.close }
+      assert_true(ws.busy?)
+      w << enc
+      w.close
+      assert_equal(src, th.value)
+      dec.close
+      assert_false(ws.busy?)
+      r.close
+    end
+
+    # the window is limited by the capacity
+    large = "".b
+    Zstd::Encoder.open(large, Zstd::Parameters.new(3, windowlog: 24)) { |e| e << src }
+    dec = Zstd::Decoder.new(StringIO.new(large), workspace: ws)
+    assert_raise(Zstd::Error) { dec.read }
+    dec.close
+    assert_false(ws.busy?)
+
+    cdict = Zstd::Dictionary::Compressor.new(src.byteslice(0, 4096), 1)
+    ddict = Zstd::Dictionary::Decompressor.new(src.byteslice(0, 4096))
+    small = Zstd::Workspace.new(Zstd.estimate_cstream_size(1) + Zstd.estimate_dstream_size(20))
+    dest = "".b
+    Zstd::Encoder.open(dest, 1, cdict, workspace: small) { |e| e << src }
+    assert_equal(src, Zstd::Decoder.open(dest, ddict, workspace: small, &:read))
+
+    tiny = Zstd::Workspace.new(4096)
+    assert_raise(ArgumentError) { Zstd::Encoder.new("".b, 3, workspace: tiny) }
+    assert_raise(ArgumentError) { Zstd::Decoder.new(StringIO.new(dest), workspace: tiny) }
+    assert_raise(ArgumentError) { Zstd::Decoder.new(StringIO.new(dest), window_log_max: 27, workspace: ws) }
+    assert_raise(ArgumentError) { Zstd::Encoder.new("".b, 1, src.byteslice(0, 4096), workspace: small) }
+    assert_raise(ArgumentError) { Zstd::Encoder.new("".b, 1, workspace: small, workers: 2) }
+    assert_raise(ArgumentError) { Zstd::Workspace.new(0) }
+    assert_false(tiny.busy?)
+    assert_false(small.busy?)
+  end
+
+  def test_context_pool
+    src = SAMPLE
+    pool = Zstd::ContextPool.new(2)
+    assert_equal(2, pool.capacity)
+
+    dest = "".b
+    3.times do
+      dest = "".b
+      Zstd::Encoder.open(dest, Zstd::Parameters.new(3, windowlog: 20), nil, pool: pool) { |e| e << src }
+      assert_equal(src, Zstd.decode(dest))
+    end
+    assert_equal([2, 1, 1], [pool.hits, pool.misses, pool.size])
+
+    enc = Zstd::Encoder.new("".b, 3, pool: pool) # different parameters
+    enc << src
+    enc.close
+    enc.close
+    assert_true(enc.eof?)
+    assert_raise(TypeError) { enc << src }
+    assert_equal([2, 2, 2], [pool.hits, pool.misses, pool.size])
+
+    2.times do
+      dec = Zstd::Decoder.new(StringIO.new(dest), pool: pool)
+      assert_equal(src, dec.read)
+      dec.close
+    end
+    assert_equal([3, 3, 2], [pool.hits, pool.misses, pool.size]) # the least recently returned is freed
+
+    dict = src.byteslice(0, 4096)
+    2.times do
+      d = "".b
+      Zstd::Encoder.open(d, 1, dict, pool: pool) { |e| e << src }
+      assert_equal(src, Zstd::Decoder.open(d, dict, pool: pool, &:read))
+    end
+    assert_equal(5, pool.hits)
+
+    # not returned while another thread reads
+    q = Queue.new
+    inport = Object.new
+    inport.define_singleton_method(:read) { |size, buf = nil| q.pop }
+    rpool = Zstd::ContextPool.new
+    dec = Zstd::Decoder.new(inport, pool: rpool)
+    th = Thread.new { dec.read }
+    Thread.pass until th.stop?
+    assert_raise(RuntimeError) { dec.close }
+    assert_equal(0, rpool.size)
+    q << dest
+    q.close
+    assert_equal(src, th.value)
+    dec.close
+    assert_equal(1, rpool.size)
+
+    require "objspace"
+    assert_operator(ObjectSpace.memsize_of(pool), :>, 0)
+    pool.clear
+    assert_equal(0, pool.size)
+
+    nopool = Zstd::ContextPool.new(0)
+    Zstd::Encoder.open("".b, pool: nopool) { |e| e << src }
+    assert_equal(0, nopool.size)
+
+    assert_raise(TypeError) { Zstd::Encoder.new("".b, pool: Object.new) }
+    assert_raise(ArgumentError) { Zstd::Decoder.new(StringIO.new(dest), pool: pool, workspace: Zstd::Workspace.new(1 << 20)) }
+    assert_raise(ArgumentError) { Zstd::ContextPool.new(-1) }
+  end
 end